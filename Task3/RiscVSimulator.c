@@ -1,621 +1,7774 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// Guest memory is mapped with mmap() where it is available, so pages are only allocated when touched,
+// and the program file is mapped into it instead of being read
+#if defined(__unix__) || defined(__APPLE__)
+#define MMAP_SUPPORTED 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Batch mode runs every program of a directory where dirent.h is available
+#if defined(__unix__) || defined(__APPLE__) || defined(__MINGW32__)
+#define DIRECTORIES_SUPPORTED 1
+#include <dirent.h>
+#endif
+
+// Batch mode runs programs on several worker threads where POSIX threads are available
+#if defined(__unix__) || defined(__APPLE__)
+#define THREADS_SUPPORTED 1
+#include <pthread.h>
+#endif
+
+// Snapshots are written by a forked copy of the process where fork() is available, so the program keeps running
+#if defined(__unix__) || defined(__APPLE__)
+#define FORK_SUPPORTED 1
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+// Counters and flags shared between threads, plain accesses when there is only one thread
+#ifdef THREADS_SUPPORTED
+#define ATOMIC_LOAD(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(pointer, value) __atomic_store_n(pointer, value, __ATOMIC_RELEASE)
+#define ATOMIC_FETCH_ADD(pointer, value) __atomic_fetch_add(pointer, value, __ATOMIC_ACQ_REL)
+#else
+#define ATOMIC_LOAD(pointer) (*(pointer))
+#define ATOMIC_STORE(pointer, value) (*(pointer) = (value))
+#define ATOMIC_FETCH_ADD(pointer, value) ((*(pointer) += (value)) - (value))
+#endif
+
+// Floating-point arithmetic runs on the host's SSE unit, whose MXCSR register selects the rounding mode and
+// collects the exception flags. Other hosts do the same through fenv.h.
+#if defined(__SSE_MATH__) && defined(__SSE2_MATH__)
+#define SSE_SUPPORTED 1
+#include <emmintrin.h>
+#else
+#include <fenv.h>
+#endif
+
+// The JIT engine generates x86-64 code and needs mmap() for executable memory
+#if defined(__x86_64__) && defined(MMAP_SUPPORTED)
+#define JIT_SUPPORTED 1
+#endif
 
 #define NUM_REGISTERS 32
-#define MEMORY_SIZE 1024 * 1024 // 1 MB
+#define DEFAULT_MEMORY_SIZE (1024 * 1024) // 1 MB, changed with --mem=SIZE
+#define MAX_HARTS 1024
+#define DEFAULT_QUANTUM 10000 // Instructions a hart runs before the next hart gets its turn
+#define MIN_MEMORY_SIZE 4096
+#define MAX_MEMORY_SIZE (4ULL * 1024 * 1024 * 1024) // Everything a 32-bit address can reach
+
+// With --sparse, addresses beyond the flat memory are backed by pages allocated on first touch
+#define PAGE_BITS 12
+#define PAGE_SIZE (1 << PAGE_BITS)        // 4 KiB
+#define PAGE_TABLE_BITS 10                // The 20-bit page number is split into two 10-bit table indices
+#define PAGE_TABLE_SIZE (1 << PAGE_TABLE_BITS)
+#define TLB_ENTRIES 64                    // Direct-mapped translations of recently used pages
+
+// Rounding modes of the F extension, in the rm field of an instruction or in frm
+#define FRM_RNE 0     // Round to nearest, ties to even
+#define FRM_RTZ 1     // Round towards zero
+#define FRM_RDN 2     // Round down
+#define FRM_RUP 3     // Round up
+#define FRM_RMM 4     // Round to nearest, ties to max magnitude
+#define FRM_DYNAMIC 7 // Use the rounding mode in frm
+
+// Accrued exception flags in fflags
+#define FFLAG_NX 0x01 // Inexact
+#define FFLAG_UF 0x02 // Underflow
+#define FFLAG_OF 0x04 // Overflow
+#define FFLAG_DZ 0x08 // Division by zero
+#define FFLAG_NV 0x10 // Invalid operation
+
+// The CSRs that exist, the floating-point control and status register and its two fields
+#define CSR_FFLAGS 0x001
+#define CSR_FRM 0x002
+#define CSR_FCSR 0x003
+
+#define CANONICAL_NAN 0x7FC00000 // The NaN that operations return instead of propagating a NaN operand
+
+// The parts of ELF32 executables used by the loader
+#define ELF_HEADER_SIZE 52
+#define ELF_PROGRAM_HEADER_SIZE 32
+#define ELF_MACHINE_RISCV 243
+#define ELF_TYPE_EXECUTABLE 2
+#define ELF_SEGMENT_LOAD 1   // p_type of segments that are loaded into memory
+#define ELF_SEGMENT_EXECUTE 1 // p_flags bit of segments holding code
+
+// Trace levels, selected with --trace=LEVEL (--quiet is the same as --trace=0)
+#define TRACE_NONE 0         // Only the final register dump is printed
+#define TRACE_INSTRUCTIONS 1 // One banner and mnemonic per executed instruction
+#define TRACE_FULL 2         // Register values before and after every instruction (default)
+
+int traceLevel = TRACE_FULL;
+
+// Building with -DNO_TRACE removes all tracing code from the simulator
+#ifdef NO_TRACE
+#define TRACE(level, ...) ((void)0)
+#else
+#define TRACE(level, ...)                \
+    do                                   \
+    {                                    \
+        if (traceLevel >= (level))       \
+        {                                \
+            printf(__VA_ARGS__);         \
+        }                                \
+    } while (0)
+#endif
+
+int showStats = 0;         // Print the executed instruction count and speed when the program ends
+int timingModel = 0;       // Count the cycles of a 5-stage pipeline while interpreting, and print them at the end
+struct timespec startTime; // Time at which the simulation started
+
+// How the simulated program ended, instructions are executed while it is PROGRAM_RUNNING
+#define PROGRAM_RUNNING 0
+#define PROGRAM_EXITED 1  // E-call, or the program counter left the program image
+#define PROGRAM_FAULTED 2 // Access fault, misaligned program counter or unrecognized opcode
+
+// Batch mode runs many programs in one process and compares their registers with the expected .res files
+int batchMode = 0;
+int jobs = 0;                 // Threads running the programs of a batch or the harts, 0 for the default
+char **inputFileNames = NULL; // Programs, and in batch mode also directories of programs, from the command line
+int inputFileCount = 0;
+
+uint64_t memorySize = DEFAULT_MEMORY_SIZE; // Number of bytes of flat memory of every machine
+int sparseMemory = 0;                      // Addresses beyond the flat memory are backed by pages instead of faulting
+
+int hartCount = 1;                 // Harts running the program, all sharing its memory
+uint64_t quantum = DEFAULT_QUANTUM; // Length of a turn when there are several harts
+
+// Snapshots of the whole machine: the harts' registers and every page of memory that is not all zeros
+#define SNAPSHOT_MAGIC "RV32SNP1"
+#define DEFAULT_SNAPSHOT_FILE "snapshot.ckpt"
+#define SNAPSHOT_END 0xFFFFFFFF // Ends a list of pages, page numbers only have 20 bits
+#define SNAPSHOT_HART_WORDS (7 + 2 * NUM_REGISTERS)
+
+uint64_t snapshotAt = 0;                              // Instructions after which --snapshot saves the machine, 0 for none
+const char *snapshotFileName = DEFAULT_SNAPSHOT_FILE; // Written by --snapshot, changed with --snapshot-file
+const char *restoreFileName = NULL;                   // Snapshot the program resumes from, instead of loading a program
+int firstTurn = 0;                                    // Hart that takes the first turn, after a restore the next one of the snapshot
 
 typedef struct
 {
-    uint32_t value;
-    int locked; // Flag to indicate if the register is locked
-} Register;
+    uint32_t page; // Page number, or TLB_INVALID
+    uint8_t *data;
+} TlbEntry;
+
+#define TLB_INVALID 0xFFFFFFFF // Page numbers only have 20 bits, so this never matches
+
+// Which process*Type function executes a decoded instruction, following the opcode groups
+enum
+{
+    HANDLER_UNDECODED = 0, // Cache entry that has not been decoded yet
+    HANDLER_R,
+    HANDLER_I,
+    HANDLER_S,
+    HANDLER_L,
+    HANDLER_LUI,
+    HANDLER_AUIPC,
+    HANDLER_B,
+    HANDLER_JAL,
+    HANDLER_JALR,
+    HANDLER_ECALL,
+    HANDLER_A,
+    HANDLER_F,
+    HANDLER_CSR,
+    HANDLER_FENCE,
+    HANDLER_UNKNOWN
+};
+
+// The exact operation within an instruction group
+enum
+{
+    OP_UNKNOWN = 0,
+    OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_SRAI, OP_ORI, OP_ANDI,
+    OP_SB, OP_SH, OP_SW,
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_LUI, OP_AUIPC,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_JAL, OP_JALR, OP_ECALL,
+    OP_LR_W, OP_SC_W, OP_AMOSWAP_W, OP_AMOADD_W, OP_AMOXOR_W, OP_AMOAND_W, OP_AMOOR_W,
+    OP_AMOMIN_W, OP_AMOMAX_W, OP_AMOMINU_W, OP_AMOMAXU_W,
+    OP_FLW, OP_FSW, OP_FMADD_S, OP_FMSUB_S, OP_FNMSUB_S, OP_FNMADD_S,
+    OP_FADD_S, OP_FSUB_S, OP_FMUL_S, OP_FDIV_S, OP_FSQRT_S, OP_FSGNJ_S, OP_FSGNJN_S, OP_FSGNJX_S, OP_FMIN_S, OP_FMAX_S,
+    OP_FCVT_W_S, OP_FCVT_WU_S, OP_FCVT_S_W, OP_FCVT_S_WU, OP_FMV_X_W, OP_FMV_W_X, OP_FEQ_S, OP_FLT_S, OP_FLE_S, OP_FCLASS_S,
+    OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+    OP_FENCE, OP_FENCE_I,
+    // Superinstructions, made by the block engine from two instructions in a row
+    OP_LUI_ADDI, OP_AUIPC_JALR, OP_SLT_BNE, OP_SLT_BEQ, OP_SLTU_BNE, OP_SLTU_BEQ,
+    OP_BLOCK_END, // End of a block that falls through to the next instruction
+    OPERATION_COUNT
+};
+
+// An instruction with all of its fields extracted and its immediate sign-extended
+typedef struct
+{
+    uint8_t handler;
+    uint8_t operation;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t length;       // 4 bytes, or 2 for a compressed instruction
+    uint16_t pcOffset;    // Address relative to the start of the block, only set in the code of a block
+    int32_t imm;
+    uint32_t instruction; // Original instruction word (or halfword if compressed), used for tracing
+} DecodedInstruction;
+
+// Execution engines, selected with --engine=NAME
+#define ENGINE_INTERPRETER 0 // Decode cache and process*Type handlers, supports tracing
+#define ENGINE_THREADED 1    // Threaded code jumping directly between instructions
+#define ENGINE_BLOCK 2       // Cached and chained basic blocks with fused instruction pairs
+#define ENGINE_JIT 3         // Block engine that compiles frequently executed blocks to x86-64 code
+
+int engine = ENGINE_INTERPRETER;
+
+#define MAX_BLOCK_LENGTH 64 // Longest run of instructions translated into one block
+
+#define JIT_THRESHOLD 16                   // Executions of a block before the JIT compiles it
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024) // Executable memory for compiled blocks
+
+// Compiled block, runs the whole block and returns the next program counter
+typedef uint32_t (*JitBlockFunction)(void);
+
+// Straight-line code ending in a branch or jump, translated for the block engine
+typedef struct BasicBlock
+{
+    uint32_t startPc;
+    uint32_t length;                 // Number of instructions in the block
+    struct BasicBlock *successor[2]; // Blocks that followed this one, chained to skip the cache lookup
+    uint32_t successorPc[2];
+    uint32_t executions;             // Times the block ran before being compiled
+    JitBlockFunction native;         // Compiled code of the block, NULL while it is interpreted
+    DecodedInstruction code[];       // The instructions, followed by an OP_BLOCK_END marker
+} BasicBlock;
+
+// Branch prediction model, enabled with --predict=LIST. Each predictor of the list guesses the direction of every
+// conditional branch, and they share a branch target buffer and a return address stack for the targets.
+#define MAX_PREDICTORS 4        // Predictors that can be compared in one run
+#define PREDICTOR_TABLE_BITS 12 // 4096 two-bit counters in the bimodal and gshare predictors and the base table of TAGE
+#define BTB_ENTRIES 512         // Direct-mapped branch target buffer
+#define RAS_ENTRIES 16          // Return address stack, a call overwrites the oldest entry when it is full
+#define BRANCH_REPORT_LIMIT 20  // Branches listed at the end of a program, the most executed ones
+
+// A direction predictor. Its state is all zero at the start of a program, and predict() is always followed by update()
+// for the same branch, so it can keep what it looked up.
+typedef struct
+{
+    const char *name;
+    size_t stateSize;
+    int (*predict)(void *state, uint32_t pc, uint32_t target);
+    void (*update)(void *state, uint32_t pc, uint32_t target, int taken);
+} PredictorType;
+
+int predictorCount = 0;                          // Number of predictors given with --predict
+const PredictorType *predictors[MAX_PREDICTORS]; // The first one decides the branch penalties of the timing model
+
+typedef struct
+{
+    uint32_t pc;
+    uint32_t target;
+} BtbEntry;
+
+// How one conditional branch behaved, and how often each predictor got it wrong
+typedef struct
+{
+    uint32_t pc;
+    uint64_t executions; // 0 for an unused entry
+    uint64_t taken;
+    uint64_t mispredictions[MAX_PREDICTORS];
+} BranchRecord;
+
+// The predictors of one hart
+typedef struct
+{
+    void *state[MAX_PREDICTORS];
+    BtbEntry btb[BTB_ENTRIES];
+    uint32_t returnStack[RAS_ENTRIES];
+    uint32_t returnDepth;      // Pushes minus pops, the stack is used modulo RAS_ENTRIES
+    BranchRecord *records;     // Hash table of the conditional branches by PC, at most half full
+    uint32_t recordCapacity;
+    uint32_t recordCount;
+} BranchModel;
+
+// Cache model, enabled with --cache or by configuring a level with --cache-l1i, --cache-l1d or --cache-l2.
+// Each hart has its own L1 instruction and data caches in front of its own unified L2 cache.
+#define CACHE_L1I 0
+#define CACHE_L1D 1
+#define CACHE_L2 2
+#define CACHE_LEVELS 3
+#define CACHE_MAX_WAYS 32         // The PLRU tree of a set fits in 32 bits
+#define CACHE_DIRTY 0x80000000    // Tag bit of a line that was written and not yet written back
+#define CACHE_REPORT_LIMIT 20     // Instructions listed at the end of a program, those with the most misses
+
+// Replacement policies
+#define CACHE_LRU 0    // Least recently used
+#define CACHE_PLRU 1   // Tree pseudo-LRU
+#define CACHE_RANDOM 2
+
+typedef struct
+{
+    uint32_t size;     // Bytes, 0 for a missing L2
+    uint32_t ways;
+    uint32_t lineSize; // Bytes
+    int policy;
+    int writeThrough;  // Stores are passed on to the next level and do not allocate lines, instead of being written back
+} CacheConfig;
+
+int cacheModel = 0;
+CacheConfig cacheConfigs[CACHE_LEVELS] = {
+    {16 * 1024, 4, 64, CACHE_LRU, 0},
+    {16 * 1024, 4, 64, CACHE_LRU, 0},
+    {256 * 1024, 8, 64, CACHE_LRU, 0},
+};
+
+// One cache level. The tags of a set are kept in the order of their last use for LRU, so no other state is needed.
+typedef struct
+{
+    uint32_t *tags;     // ways tags per set, the line number plus 1 (0 for an empty way) and CACHE_DIRTY
+    uint32_t *plru;     // One tree of ways - 1 bits per set, for CACHE_PLRU
+    uint32_t setMask;
+    uint32_t lineBits;
+    uint32_t random;    // State of the xorshift generator of CACHE_RANDOM
+    uint32_t lastLine;  // Line number plus 1 of the last instruction fetch, only for L1I
+} Cache;
+
+// Misses caused by the instruction at one address
+typedef struct
+{
+    uint64_t instruction; // L1I misses fetching it
+    uint64_t data;        // L1D misses of its loads and stores
+    uint64_t l2;          // L2 misses of either
+} CacheMisses;
+
+typedef struct
+{
+    uint64_t reads;
+    uint64_t readMisses;
+    uint64_t writes;
+    uint64_t writeMisses;
+    uint64_t writebacks; // Dirty lines written to the next level when they were replaced
+} CacheCounters;
+
+// Counters of one machine, summed over all machines of a batch for --stats
+typedef struct
+{
+    uint64_t instructionsExecuted; // Number of instructions fetched and executed
+    uint64_t blocksTranslated;     // Number of blocks built
+    uint64_t fusedPairs;           // Number of instruction pairs fused into superinstructions
+    uint64_t blocksCompiled;       // Number of blocks compiled to host code by the JIT
+    uint64_t pagesAllocated;       // Number of sparse memory pages
+    uint64_t tlbMisses;            // Sparse memory accesses that had to walk the page table
+    uint64_t cycles;               // Cycles of the timing model, from the first fetch until the last instruction left WB
+    uint64_t loadUseStalls;        // Cycles an instruction waited for a value still being loaded
+    uint64_t executeStalls;        // Cycles an instruction waited for a multi-cycle operation to leave EX
+    uint64_t flushCycles;          // Cycles lost to instructions fetched after a taken branch or jump
+    uint64_t conditionalBranches;  // Branches seen by the predictors of --predict
+    uint64_t takenBranches;
+    uint64_t branchMispredictions[MAX_PREDICTORS]; // Wrongly guessed directions, for each predictor in the order of --predict
+    uint64_t directJumps;          // JAL instructions, and those whose target was not in the BTB
+    uint64_t directJumpMisses;
+    uint64_t returns;              // JALR instructions that return, and those the return address stack got wrong
+    uint64_t returnMisses;
+    uint64_t indirectJumps;        // Other JALR instructions, and those whose target was not in the BTB
+    uint64_t indirectJumpMisses;
+    CacheCounters caches[CACHE_LEVELS];
+    uint64_t memoryReads;          // Lines the caches read from memory and writes that reached it
+    uint64_t memoryWrites;
+    uint64_t memoryStalls;         // Cycles the timing model waited for lines missing in L1
+} Statistics;
+
+// Timing model of a classic in-order pipeline (IF, ID, EX, MEM, WB) with forwarding into EX, enabled with --timing.
+// Branches are predicted not taken and resolved in EX, JAL is resolved in ID, unless --predict chooses predictors. Multiplications, divisions and
+// floating-point arithmetic stay in EX for several cycles and hold up the instructions behind them.
+#define TIMING_LOAD_DELAY 1             // Extra cycles before a loaded value can be forwarded, a use right after the load stalls
+#define TIMING_BRANCH_PENALTY 2         // Instructions flushed after a taken branch or a JALR
+#define TIMING_JUMP_PENALTY 1           // Instructions flushed after a JAL
+#define TIMING_MULTIPLY_CYCLES 3        // Cycles in EX of mul, mulh, mulhsu and mulhu
+#define TIMING_DIVIDE_CYCLES 33         // Cycles in EX of div, divu, rem and remu, one per quotient bit
+#define TIMING_FLOAT_CYCLES 4           // Cycles in EX of the floating-point additions, multiplications and conversions
+#define TIMING_FLOAT_DIVIDE_CYCLES 20   // Cycles in EX of fdiv.s and fsqrt.s
+#define TIMING_L2_LATENCY 10            // Cycles to get a line missing in L1 from L2, with --cache
+#define TIMING_MEMORY_LATENCY 100       // Further cycles to get a line missing in L2 from memory
+
+// Where the timing model is in the pipeline. Cycles are counted from the one in which the first instruction enters EX.
+typedef struct
+{
+    uint64_t nextIssue;                // Cycle in which the next instruction enters EX if nothing holds it up
+    uint64_t executeFree;              // Cycle in which the last instruction leaves EX
+    uint64_t fetchReady;               // First cycle in which an instruction fetched after a taken branch or jump can be in EX
+    uint64_t ready[2 * NUM_REGISTERS]; // Cycle from which the values of x0-x31 and then f0-f31 can be forwarded into EX
+    uint64_t finished;                 // Cycles until the last instruction left WB
+} Pipeline;
+
+// Profiler, enabled with --profile. It counts the instructions retired at every address and of every handler, and
+// follows calls and returns to build a calling context tree, whose nodes are written as folded stacks.
+#define PROFILE_MAX_DEPTH 1024   // Deeper calls are counted in the deepest function followed
+#define PROFILE_REPORT_LIMIT 20  // Addresses and call sites listed at the end of a program
+#define DEFAULT_PROFILE_FILE "profile.folded"
+
+const char *profileFileName = NULL; // Where --profile writes the folded stacks, NULL when not profiling
+
+// A function as called from one call site in one calling context
+typedef struct
+{
+    uint32_t function;    // Address of its first instruction
+    uint32_t callSite;    // Address of the call, 0 for the root
+    uint32_t parent;      // Index of the caller's node
+    uint32_t firstChild;  // Indices of the callees' nodes, 0 ends the list as the root is nobody's child
+    uint32_t nextSibling;
+    uint64_t calls;
+    uint64_t instructions; // Retired in the function itself, not in its callees
+} ProfileNode;
+
+typedef struct
+{
+    uint64_t *counts;                       // Instructions retired at every halfword of the program
+    uint64_t handlers[HANDLER_UNKNOWN + 1]; // Instructions retired of every handler
+    ProfileNode *nodes;                     // Node 0 is the root, the code running before any call
+    uint32_t nodeCount;
+    uint32_t nodeCapacity;
+    uint32_t current;        // Node of the running function
+    uint64_t currentSince;   // instructionsExecuted when it started running
+    uint32_t returnAddresses[PROFILE_MAX_DEPTH]; // Where the functions on the call stack return to
+    uint32_t depth;
+    uint32_t hiddenDepth;    // Calls beyond PROFILE_MAX_DEPTH that have not returned
+} Profile;
+
+// Binary execution trace, written with --trace-file=FILE and printed like --trace=2 with --decode. The file starts
+// with TRACE_MAGIC and holds chunks of a hart's records: the hart id and the number of bytes, both 32 bits,
+// then the records. All values are little-endian.
+#define TRACE_MAGIC "RV32TRC1"
+#define TRACE_BUFFER_SIZE (1024 * 1024) // Bytes of records a hart collects before writing them as one chunk
+
+// A record is a byte of these flags, the PC if TRACE_RECORD_PC, the instruction in 2 or 4 bytes, the value
+// written to rd if one of the value flags is set, and the address and value of the memory access if there is one.
+// Loads and atomics record the value memory held before the instruction, stores the value they wrote.
+#define TRACE_RECORD_WIDTH 0x03      // Bytes of the memory access: 0 for none, 1, 2, or 3 for 4 bytes
+#define TRACE_RECORD_COMPRESSED 0x04
+#define TRACE_RECORD_PC 0x08         // The instruction does not follow the one before, after a taken branch or jump
+#define TRACE_RECORD_X_VALUE 0x10    // rd is an x register the instruction wrote
+#define TRACE_RECORD_F_VALUE 0x20    // rd is an f register the instruction wrote
+#define TRACE_RECORD_START 0x40      // Alone, starts the trace of a hart: PC, x0 to x31, f0 to f31 and fcsr
+#define TRACE_RECORD_MAX_SIZE 21
+#define TRACE_START_SIZE (1 + 4 * (2 + 2 * NUM_REGISTERS))
+
+const char *traceFileName = NULL; // Where --trace-file writes the binary trace, NULL when not writing one
+int decodeMode = 0;               // --decode prints the binary trace given instead of running a program
+FILE *traceFile = NULL;
+
+typedef struct
+{
+    uint8_t *data; // Records of the hart not yet written, TRACE_BUFFER_SIZE bytes
+    size_t used;
+    uint32_t nextPc; // Address following the last instruction recorded
+} TraceBuffer;
+
+// Sampled simulation, with --sample=N:W:M. The program runs N instructions without the models, on the faster engine
+// if one is chosen, then W instructions with them to warm up their state and M measured ones, and so on until it
+// ends. The measured samples estimate the CPI, miss rates and mispredictions of the whole run.
+#define SAMPLE_T_VALUES 30 // Student's t for up to 30 degrees of freedom, more samples use the normal distribution
+
+uint64_t sampleSkip = 0;   // Instructions run between the samples
+uint64_t sampleWarmup = 0; // Instructions before each sample that only warm up the models
+uint64_t sampleLength = 0; // Instructions measured in each sample, 0 when not sampling
+
+// What the models counted in one sample
+typedef struct
+{
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t accesses[CACHE_LEVELS];
+    uint64_t misses[CACHE_LEVELS];
+    uint64_t branches; // Conditional branches
+    uint64_t mispredictions[MAX_PREDICTORS];
+} Sample;
+
+typedef struct
+{
+    Sample *samples;
+    uint32_t count;
+    uint32_t capacity;
+    int detailed; // The models follow the instructions, while warming up and measuring
+} Sampling;
+
+// Everything a running program changes, so that several machines can run side by side in one process.
+// Each is only used by one thread at a time, the options above are shared and never change while running.
+typedef struct
+{
+    uint32_t registers[NUM_REGISTERS]; // Register file, x0 is hard-wired to zero by writeRegister()
+    uint32_t programCounter;           // Additional register for the program counter
+    int programState;                  // PROGRAM_RUNNING until the program ends
+    uint32_t hartId;                   // Index of the hart, the harts of one program share its memory
+    uint64_t stopAt;                   // The engines return once instructionsExecuted reaches this
+
+    // Reservation of the last LR.W, a following SC.W stores if the word at the address still holds the value
+    int reservationValid;
+    uint32_t reservationAddress;
+    uint32_t reservationValue;
+
+    // Register file of the F extension, holding the bits of single-precision values, and the fields of fcsr
+    uint32_t floatRegisters[NUM_REGISTERS];
+    uint32_t fflags; // Exception flags accrued since the program last cleared them
+    uint32_t frm;    // Rounding mode of the instructions that use the dynamic rounding mode
+
+    uint8_t *memory;      // Simulated memory for the program, memorySize bytes
+    uint32_t programSize; // Number of bytes of the program image loaded into memory
+    int sharesMemory;     // The memory and page table belong to hart 0 and are not freed by this machine
+
+    // Two-level page table of PAGE_TABLE_SIZE entries, the upper 10 bits of the page number select a table of 1024 pages
+    uint8_t ***pageDirectory;
+    TlbEntry tlb[TLB_ENTRIES];
 
-Register registers[NUM_REGISTERS];
+    // Decoded instructions of the program image, filled in on first execution. There is one entry per
+    // halfword, as compressed instructions make every halfword a possible instruction address.
+    DecodedInstruction *decodeCache;
 
-void initializeRegisters()
+    // Code address of the instruction at every halfword for the threaded engine, parallel to decodeCache
+    const void **threadedTargets;
+    const void *threadedTranslateTarget; // Entry that translates an instruction again
+
+    BasicBlock **blockCache; // Block starting at each halfword of the program
+    uint8_t *blockHalfwords; // Halfwords of the program that are part of a translated block
+    int blocksStale;         // A store changed translated code, so the blocks must be rebuilt
+
+#ifdef JIT_SUPPORTED
+    uint8_t *jitBuffer; // Executable memory holding the compiled blocks, kept when the machine is reset
+    size_t jitUsed;     // Bytes of jitBuffer in use
+    uint8_t *jitCode;   // Write position while compiling a block
+    int jitAccessFault; // Set by compiled code that returned before an instruction that faults, like an access outside memory
+#endif
+
+    FILE *output; // Where the messages of the program go, stdout or the report of a batch program
+    Statistics stats;
+    Pipeline pipeline;          // Only used with --timing
+    BranchModel *branchModel;   // Only allocated with --predict
+    Cache caches[CACHE_LEVELS]; // Only allocated with the cache model
+    CacheMisses *cacheMisses;   // Misses of the instruction at every halfword of the program, allocated at the first miss
+    Profile *profile;           // Only allocated with --profile, once the program runs
+    TraceBuffer *trace;         // Only allocated with --trace-file, once the program runs
+    Sampling *sampling;         // Only allocated with --sample
+} Machine;
+
+void initializeRegisters(Machine *m)
 {
     for (int i = 0; i < NUM_REGISTERS; i++)
     {
-        registers[i].value = 0;
-        registers[i].locked = 0;
+        m->registers[i] = 0;
+        m->floatRegisters[i] = 0;
     }
+    m->fflags = 0;
+    m->frm = FRM_RNE;
+}
+
+// Every load and store checks its address with this single compare before touching memory
+#define OUTSIDE_MEMORY(address, width) ((uint64_t)(address) + (width) > memorySize)
+
+// Little-endian memory accesses shared by all engines, for addresses already checked against memorySize.
+// memcpy keeps them portable and compilers turn it into one (unaligned) host load or store.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LITTLE_ENDIAN_16(x) __builtin_bswap16(x)
+#define LITTLE_ENDIAN_32(x) __builtin_bswap32(x)
+#else
+#define LITTLE_ENDIAN_16(x) (x)
+#define LITTLE_ENDIAN_32(x) (x)
+#endif
+
+static inline uint32_t loadHalf(Machine *m, uint32_t address)
+{
+    uint16_t value;
+    memcpy(&value, &m->memory[address], sizeof(value));
+    return LITTLE_ENDIAN_16(value);
+}
 
-    // Lock x0 to ensure it stays at 0
-    registers[0].locked = 1;
+static inline uint32_t loadWord(Machine *m, uint32_t address)
+{
+    uint32_t value;
+    memcpy(&value, &m->memory[address], sizeof(value));
+    return LITTLE_ENDIAN_32(value);
 }
 
-uint32_t programCounter = 0; // Additional register for the program counter
+static inline void storeHalf(Machine *m, uint32_t address, uint32_t value)
+{
+    uint16_t half = LITTLE_ENDIAN_16((uint16_t)value);
+    memcpy(&m->memory[address], &half, sizeof(half));
+}
 
-uint8_t memory[MEMORY_SIZE]; // Simulated memory for the program
+static inline void storeWord(Machine *m, uint32_t address, uint32_t value)
+{
+    uint32_t word = LITTLE_ENDIAN_32(value);
+    memcpy(&m->memory[address], &word, sizeof(word));
+}
 
-uint32_t readRegister(int regNum)
+// Zero-extended load of 1, 2 or 4 bytes from the flat memory, width is a constant at every use
+static inline uint32_t loadFlat(Machine *m, uint32_t address, uint32_t width)
 {
-    return registers[regNum].value;
+    return width == 1 ? m->memory[address] : width == 2 ? loadHalf(m, address) : loadWord(m, address);
 }
 
-void writeRegister(int regNum, uint32_t value)
+static inline void storeFlat(Machine *m, uint32_t address, uint32_t width, uint32_t value)
 {
-    if (!registers[regNum].locked)
+    if (width == 1)
     {
-        registers[regNum].value = value;
+        m->memory[address] = value & 0xFF;
+    }
+    else if (width == 2)
+    {
+        storeHalf(m, address, value);
     }
     else
     {
-        printf("Warning: Attempted write to locked register x%d ignored.\n", regNum);
+        storeWord(m, address, value);
+    }
+}
+
+// Floating-point registers hold the bits of a value, which are converted to a host float to compute with it
+static inline float floatFromBits(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline uint32_t bitsFromFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+void initializeTlb(Machine *m)
+{
+    for (int i = 0; i < TLB_ENTRIES; i++)
+    {
+        m->tlb[i].page = TLB_INVALID;
+        m->tlb[i].data = NULL;
+    }
+}
+
+static void *installShared(void **slot, void *value)
+{
+    // The page table is shared by the harts, which may run on other threads. This puts a new table or
+    // page into an empty slot and returns what the slot holds afterwards, another one if a hart was faster.
+#ifdef THREADS_SUPPORTED
+    void *expected = NULL;
+    if (!__atomic_compare_exchange_n(slot, &expected, value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(value);
+        return expected;
+    }
+#else
+    *slot = value;
+#endif
+    return value;
+}
+
+uint8_t *walkPageTable(Machine *m, uint32_t page)
+{
+    // Find the page in the page table, allocating the table and the zero-filled page on first touch
+    uint8_t **table = ATOMIC_LOAD(&m->pageDirectory[page >> PAGE_TABLE_BITS]);
+    if (!table)
+    {
+        table = installShared((void **)&m->pageDirectory[page >> PAGE_TABLE_BITS], calloc(PAGE_TABLE_SIZE, sizeof(uint8_t *)));
+    }
+
+    uint8_t *data = table ? ATOMIC_LOAD(&table[page & (PAGE_TABLE_SIZE - 1)]) : NULL;
+    if (table && !data)
+    {
+        uint8_t *allocated = calloc(PAGE_SIZE, 1);
+        data = installShared((void **)&table[page & (PAGE_TABLE_SIZE - 1)], allocated);
+        if (data && data == allocated)
+        {
+            m->stats.pagesAllocated++;
+        }
+    }
+    if (!data)
+    {
+        printf("Error: Could not allocate a page of sparse memory\n");
+        exit(1);
+    }
+    return data;
+}
+
+static inline uint8_t *sparsePage(Machine *m, uint32_t address)
+{
+    // Host address of the page holding address, through the TLB
+    uint32_t page = address >> PAGE_BITS;
+    TlbEntry *entry = &m->tlb[page & (TLB_ENTRIES - 1)];
+    if (entry->page != page)
+    {
+        m->stats.tlbMisses++;
+        entry->page = page;
+        entry->data = walkPageTable(m, page);
+    }
+    return entry->data;
+}
+
+static uint8_t *byteOutside(Machine *m, uint32_t address)
+{
+    // A byte of an access that starts outside the flat memory, which may end or wrap around into it
+    return address < memorySize ? &m->memory[address] : &sparsePage(m, address)[address & (PAGE_SIZE - 1)];
+}
+
+int loadOutside(Machine *m, uint32_t address, uint32_t width, uint32_t *value)
+{
+    // Slow path of loads that are not inside the flat memory. Fails without sparse memory, and for accesses
+    // wrapping around the end of the address space.
+    if (!sparseMemory || (uint64_t)address + width > MAX_MEMORY_SIZE)
+    {
+        return 0;
+    }
+
+    // An access within one page is one copy, one crossing a page or the end of the flat memory goes byte by byte
+    uint32_t offset = address & (PAGE_SIZE - 1);
+    if (address >= memorySize && offset <= PAGE_SIZE - width)
+    {
+        uint8_t *data = sparsePage(m, address) + offset;
+        *value = width == 1 ? data[0] : width == 2 ? (uint32_t)(data[0] | (data[1] << 8)) : (uint32_t)(data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24));
+        return 1;
+    }
+
+    *value = 0;
+    for (uint32_t i = 0; i < width; i++)
+    {
+        *value |= (uint32_t)*byteOutside(m, address + i) << (8 * i);
+    }
+    return 1;
+}
+
+int storeOutside(Machine *m, uint32_t address, uint32_t width, uint32_t value)
+{
+    if (!sparseMemory || (uint64_t)address + width > MAX_MEMORY_SIZE)
+    {
+        return 0;
+    }
+
+    // The caller still checks for a store into the program image, a store can start in the last bytes of a
+    // program that fills the whole flat memory
+    for (uint32_t i = 0; i < width; i++)
+    {
+        *byteOutside(m, address + i) = (value >> (8 * i)) & 0xFF;
+    }
+    return 1;
+}
+
+uint32_t *atomicWord(Machine *m, uint32_t address)
+{
+    // Host address of an aligned word for an atomic operation, NULL if it is not entirely in the flat or sparse memory
+    if (!OUTSIDE_MEMORY(address, 4))
+    {
+        return (uint32_t *)&m->memory[address];
+    }
+    if (!sparseMemory || address < memorySize)
+    {
+        return NULL;
+    }
+    return (uint32_t *)(sparsePage(m, address) + (address & (PAGE_SIZE - 1)));
+}
+
+static uint32_t atomicResult(int operation, uint32_t old, uint32_t operand)
+{
+    // Value an AMO writes back, given the value it read
+    switch (operation)
+    {
+    case OP_AMOSWAP_W:
+        return operand;
+    case OP_AMOADD_W:
+        return old + operand;
+    case OP_AMOXOR_W:
+        return old ^ operand;
+    case OP_AMOAND_W:
+        return old & operand;
+    case OP_AMOOR_W:
+        return old | operand;
+    case OP_AMOMIN_W:
+        return (int32_t)old < (int32_t)operand ? old : operand;
+    case OP_AMOMAX_W:
+        return (int32_t)old > (int32_t)operand ? old : operand;
+    case OP_AMOMINU_W:
+        return old < operand ? old : operand;
+    default: // OP_AMOMAXU_W
+        return old > operand ? old : operand;
+    }
+}
+
+uint32_t atomicMemoryOperation(uint32_t *word, int operation, uint32_t operand)
+{
+    // Read-modify-write of the guest word with one host atomic, so harts on other threads need no lock.
+    // Returns the value that was read.
+#ifdef THREADS_SUPPORTED
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    switch (operation)
+    {
+    case OP_AMOSWAP_W:
+        return __atomic_exchange_n(word, operand, __ATOMIC_SEQ_CST);
+    case OP_AMOADD_W:
+        return __atomic_fetch_add(word, operand, __ATOMIC_SEQ_CST);
+    case OP_AMOXOR_W:
+        return __atomic_fetch_xor(word, operand, __ATOMIC_SEQ_CST);
+    case OP_AMOAND_W:
+        return __atomic_fetch_and(word, operand, __ATOMIC_SEQ_CST);
+    case OP_AMOOR_W:
+        return __atomic_fetch_or(word, operand, __ATOMIC_SEQ_CST);
+    }
+#endif
+    // Minimum and maximum have no host instruction, they retry until no other hart changed the word in between
+    uint32_t stored = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(word, &stored, LITTLE_ENDIAN_32(atomicResult(operation, LITTLE_ENDIAN_32(stored), operand)),
+                                        0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+    }
+    return LITTLE_ENDIAN_32(stored);
+#else
+    uint32_t old = LITTLE_ENDIAN_32(*word);
+    *word = LITTLE_ENDIAN_32(atomicResult(operation, old, operand));
+    return old;
+#endif
+}
+
+int storeConditional(uint32_t *word, uint32_t expected, uint32_t value)
+{
+    // SC.W succeeds if the word still holds what LR.W read, checked and stored in one host compare-and-swap
+#ifdef THREADS_SUPPORTED
+    uint32_t stored = LITTLE_ENDIAN_32(expected);
+    return __atomic_compare_exchange_n(word, &stored, LITTLE_ENDIAN_32(value), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+#else
+    if (LITTLE_ENDIAN_32(*word) != expected)
+    {
+        return 0;
+    }
+    *word = LITTLE_ENDIAN_32(value);
+    return 1;
+#endif
+}
+
+uint32_t readRegister(Machine *m, int regNum)
+{
+    return m->registers[regNum];
+}
+
+void writeRegister(Machine *m, int regNum, uint32_t value)
+{
+    // A write to x0 is undone right away, which is cheaper than checking the register number
+    m->registers[regNum] = value;
+    m->registers[0] = 0;
+}
+
+void processRType(Machine *m, const DecodedInstruction *decoded);
+void processIType(Machine *m, const DecodedInstruction *decoded);
+void processSType(Machine *m, const DecodedInstruction *decoded);
+void processUType(Machine *m, const DecodedInstruction *decoded);
+void processBType(Machine *m, const DecodedInstruction *decoded);
+void processJALType(Machine *m, const DecodedInstruction *decoded);
+void processJALRType(Machine *m, const DecodedInstruction *decoded);
+void processLType(Machine *m, const DecodedInstruction *decoded);
+void processAType(Machine *m, const DecodedInstruction *decoded);
+void processFType(Machine *m, const DecodedInstruction *decoded);
+void processCSRType(Machine *m, const DecodedInstruction *decoded);
+void processFenceType(Machine *m, const DecodedInstruction *decoded);
+
+const PredictorType *findPredictor(const char *name);
+void printPredictions(const Statistics *stats);
+void printBranchRecords(Machine **harts, int count);
+int parseCacheConfig(const char *text, CacheConfig *config, int level);
+void printCaches(const Statistics *stats);
+void printCacheMisses(Machine **harts, int count);
+void printProfile(Machine **harts, int count);
+void writeFoldedStacks(Machine **harts, int count);
+void finishTrace(Machine **harts, int count);
+void finishSnapshot();
+void printSampling(const Machine *m, const Statistics *total);
+
+void printStats(const Statistics *stats)
+{
+    struct timespec endTime;
+    timespec_get(&endTime, TIME_UTC);
+    double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+
+    // Statistics go to stderr so they can be read while the trace is discarded
+    fprintf(stderr, "Instructions executed: %llu\n", (unsigned long long)stats->instructionsExecuted);
+    fprintf(stderr, "Elapsed time: %.3f s\n", seconds);
+    if (seconds > 0)
+    {
+        fprintf(stderr, "Instructions per second: %.0f\n", stats->instructionsExecuted / seconds);
+    }
+    if (engine == ENGINE_BLOCK || engine == ENGINE_JIT)
+    {
+        fprintf(stderr, "Blocks translated: %llu, fused instruction pairs: %llu\n", (unsigned long long)stats->blocksTranslated, (unsigned long long)stats->fusedPairs);
+    }
+    if (engine == ENGINE_JIT)
+    {
+        fprintf(stderr, "Blocks compiled: %llu\n", (unsigned long long)stats->blocksCompiled);
+    }
+    if (sparseMemory)
+    {
+        fprintf(stderr, "Sparse pages allocated: %llu, TLB misses: %llu\n", (unsigned long long)stats->pagesAllocated, (unsigned long long)stats->tlbMisses);
     }
 }
 
-void processRType(uint32_t instruction);
-void processIType(uint32_t instruction);
-void processSType(uint32_t instruction);
-void processUType(uint32_t instruction);
-void processBType(uint32_t instruction);
-void processJALType(uint32_t instruction);
-void processJALRType(uint32_t instruction);
-void processLType(uint32_t instruction);
+void addStatistics(Statistics *total, const Statistics *stats)
+{
+    total->instructionsExecuted += stats->instructionsExecuted;
+    total->blocksTranslated += stats->blocksTranslated;
+    total->fusedPairs += stats->fusedPairs;
+    total->blocksCompiled += stats->blocksCompiled;
+    total->pagesAllocated += stats->pagesAllocated;
+    total->tlbMisses += stats->tlbMisses;
+    total->cycles += stats->cycles;
+    total->loadUseStalls += stats->loadUseStalls;
+    total->executeStalls += stats->executeStalls;
+    total->flushCycles += stats->flushCycles;
+    total->conditionalBranches += stats->conditionalBranches;
+    total->takenBranches += stats->takenBranches;
+    for (int i = 0; i < MAX_PREDICTORS; i++)
+    {
+        total->branchMispredictions[i] += stats->branchMispredictions[i];
+    }
+    total->directJumps += stats->directJumps;
+    total->directJumpMisses += stats->directJumpMisses;
+    total->returns += stats->returns;
+    total->returnMisses += stats->returnMisses;
+    total->indirectJumps += stats->indirectJumps;
+    total->indirectJumpMisses += stats->indirectJumpMisses;
+    for (int i = 0; i < CACHE_LEVELS; i++)
+    {
+        total->caches[i].reads += stats->caches[i].reads;
+        total->caches[i].readMisses += stats->caches[i].readMisses;
+        total->caches[i].writes += stats->caches[i].writes;
+        total->caches[i].writeMisses += stats->caches[i].writeMisses;
+        total->caches[i].writebacks += stats->caches[i].writebacks;
+    }
+    total->memoryReads += stats->memoryReads;
+    total->memoryWrites += stats->memoryWrites;
+    total->memoryStalls += stats->memoryStalls;
+}
 
-void finishProgram()
+void printTiming(const Statistics *stats)
 {
-    // Print the contents of the registers in hexadecimal, four registers per line
-    printf("Register contents in HEX:\n");
-    for (int i = 0; i < NUM_REGISTERS; i += 4)
+    // The cycles of the timing model, with several harts the sum of their pipelines
+    fprintf(stderr, "Cycles: %llu\n", (unsigned long long)stats->cycles);
+    if (stats->instructionsExecuted > 0)
     {
-        printf("x%02d = %08X, x%02d = %08X, x%02d = %08X, x%02d = %08X\n", i, registers[i].value, i + 1, registers[i + 1].value, i + 2, registers[i + 2].value, i + 3, registers[i + 3].value);
+        fprintf(stderr, "CPI: %.3f\n", (double)stats->cycles / stats->instructionsExecuted);
     }
+    fprintf(stderr, "Stall cycles: %llu load-use, %llu multi-cycle execute, %llu branch and jump flushes",
+            (unsigned long long)stats->loadUseStalls, (unsigned long long)stats->executeStalls, (unsigned long long)stats->flushCycles);
+    fprintf(stderr, cacheModel ? ", %llu cache misses\n" : "\n", (unsigned long long)stats->memoryStalls);
+}
 
-    printf("\n");
-    // Print the contents of the registers in decimal, four registers per line
-    printf("Register contents in DEC:\n");
-    for (int i = 0; i < NUM_REGISTERS; i += 4)
+void finishProgram(Machine **harts, int count, int status)
+{
+    Statistics total;
+    memset(&total, 0, sizeof(total));
+    for (int hart = 0; hart < count; hart++)
     {
-        printf("x%02d = %d, x%02d = %d, x%02d = %d, x%02d = %d\n", i, registers[i].value, i + 1, registers[i + 1].value, i + 2, registers[i + 2].value, i + 3, registers[i + 3].value);
+        const uint32_t *registers = harts[hart]->registers;
+        if (count > 1)
+        {
+            printf("Hart %d:\n", hart);
+        }
+
+        // Print the contents of the registers in hexadecimal, four registers per line
+        printf("Register contents in HEX:\n");
+        for (int i = 0; i < NUM_REGISTERS; i += 4)
+        {
+            printf("x%02d = %08X, x%02d = %08X, x%02d = %08X, x%02d = %08X\n", i, registers[i], i + 1, registers[i + 1], i + 2, registers[i + 2], i + 3, registers[i + 3]);
+        }
+
+        printf("\n");
+        // Print the contents of the registers in decimal, four registers per line
+        printf("Register contents in DEC:\n");
+        for (int i = 0; i < NUM_REGISTERS; i += 4)
+        {
+            printf("x%02d = %d, x%02d = %d, x%02d = %d, x%02d = %d\n", i, registers[i], i + 1, registers[i + 1], i + 2, registers[i + 2], i + 3, registers[i + 3]);
+        }
+
+        printf("\n");
+        // Print the floating-point registers in hexadecimal and as values, four registers per line, and fcsr
+        const uint32_t *floatRegisters = harts[hart]->floatRegisters;
+        printf("Floating-point register contents:\n");
+        for (int i = 0; i < NUM_REGISTERS; i += 4)
+        {
+            printf("f%02d = %08X (%g), f%02d = %08X (%g), f%02d = %08X (%g), f%02d = %08X (%g)\n",
+                   i, floatRegisters[i], floatFromBits(floatRegisters[i]), i + 1, floatRegisters[i + 1], floatFromBits(floatRegisters[i + 1]),
+                   i + 2, floatRegisters[i + 2], floatFromBits(floatRegisters[i + 2]), i + 3, floatRegisters[i + 3], floatFromBits(floatRegisters[i + 3]));
+        }
+        printf("fcsr = %02X (frm = %u, fflags = %02X)\n", (harts[hart]->frm << 5) | harts[hart]->fflags, harts[hart]->frm, harts[hart]->fflags);
+        if (hart + 1 < count)
+        {
+            printf("\n");
+        }
+        addStatistics(&total, &harts[hart]->stats);
     }
 
-    // Also create a dump file with the content of the registers in hexadecimal
-    FILE *dumpFile = fopen("registers.hex", "w");
+    // Also create a dump file with the content of the registers, 4 little-endian bytes per register,
+    // and the registers of one hart after the other
+    FILE *dumpFile = fopen("registers.hex", "wb");
     if (!dumpFile)
     {
         printf("Error: Could not create registers.hex file.\n");
         exit(1);
     }
-    fwrite(registers, sizeof(Register), NUM_REGISTERS, dumpFile);
+    for (int hart = 0; hart < count; hart++)
+    {
+        uint8_t dump[NUM_REGISTERS * 4];
+        for (int i = 0; i < NUM_REGISTERS; i++)
+        {
+            dump[4 * i] = harts[hart]->registers[i] & 0xFF;
+            dump[4 * i + 1] = (harts[hart]->registers[i] >> 8) & 0xFF;
+            dump[4 * i + 2] = (harts[hart]->registers[i] >> 16) & 0xFF;
+            dump[4 * i + 3] = (harts[hart]->registers[i] >> 24) & 0xFF;
+        }
+        fwrite(dump, sizeof(uint8_t), sizeof(dump), dumpFile);
+    }
 
     fclose(dumpFile);
     printf("Simulation completed.\n");
-    exit(0);
-}
-
-void loadInstructions(FILE *file)
-{
-    // Seek to the starting address in memory
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
 
-    // Ensure the file size doesn't exceed the available memory
-    if (file_size > MEMORY_SIZE)
+    if (showStats)
+    {
+        printStats(&total);
+    }
+    if (sampleLength)
+    {
+        // The timing model only counted the cycles of the samples, the estimate takes the place of its report
+        printSampling(harts[0], &total);
+    }
+    else if (timingModel)
+    {
+        printTiming(&total);
+    }
+    if (predictorCount > 0)
+    {
+        printPredictions(&total);
+        printBranchRecords(harts, count);
+    }
+    if (cacheModel)
+    {
+        printCaches(&total);
+        printCacheMisses(harts, count);
+    }
+    if (profileFileName)
+    {
+        // The report charges the instructions of the running functions, so it comes before the folded stacks
+        printProfile(harts, count);
+        writeFoldedStacks(harts, count);
+    }
+    if (traceFileName)
+    {
+        finishTrace(harts, count);
+    }
+    if (snapshotAt)
+    {
+        finishSnapshot();
+    }
+    exit(status);
+}
+
+void raiseAccessFault(Machine *m, uint32_t address, uint32_t width, const char *access)
+{
+    // There are no trap handlers, so an access outside memory ends the program like an e-call but with an error.
+    // The caller returns without executing the rest of the instruction.
+    fprintf(m->output, "Error: Access fault at PC 0x%08X, %s of %u bytes at address 0x%08X is outside the %llu bytes of memory.\n",
+            m->programCounter, access, width, address, (unsigned long long)memorySize);
+    m->programState = PROGRAM_FAULTED;
+}
+
+int initializeMemory(Machine *m)
+{
+    if (memorySize > SIZE_MAX)
+    {
+        fprintf(m->output, "Error: %llu bytes of memory do not fit in the address space of this host\n", (unsigned long long)memorySize);
+        return 0;
+    }
+
+#ifdef MMAP_SUPPORTED
+    // The mapping is zero-filled and only backed by host memory where the program writes, so a large memory is cheap
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *region = mmap(NULL, (size_t)memorySize, PROT_READ | PROT_WRITE, flags, -1, 0);
+    m->memory = (region == MAP_FAILED) ? NULL : region;
+#else
+    m->memory = calloc((size_t)memorySize, 1);
+#endif
+
+    m->pageDirectory = calloc(PAGE_TABLE_SIZE, sizeof(uint8_t **));
+    if (!m->memory || !m->pageDirectory)
+    {
+        fprintf(m->output, "Error: Could not allocate %llu bytes of memory\n", (unsigned long long)memorySize);
+        return 0;
+    }
+
+    initializeTlb(m);
+    return 1;
+}
+
+void releaseMemory(Machine *m)
+{
+    // Give back the flat memory, including the mapped program, and every sparse page. The other harts
+    // only forget hart 0's memory, hart 0 is released last.
+    if (m->sharesMemory)
+    {
+        m->memory = NULL;
+        m->pageDirectory = NULL;
+        m->sharesMemory = 0;
+    }
+    if (m->memory)
+    {
+#ifdef MMAP_SUPPORTED
+        munmap(m->memory, (size_t)memorySize);
+#else
+        free(m->memory);
+#endif
+        m->memory = NULL;
+    }
+
+    for (int i = 0; m->pageDirectory && i < PAGE_TABLE_SIZE; i++)
+    {
+        if (m->pageDirectory[i])
+        {
+            for (int j = 0; j < PAGE_TABLE_SIZE; j++)
+            {
+                free(m->pageDirectory[i][j]);
+            }
+            free(m->pageDirectory[i]);
+        }
+    }
+    free(m->pageDirectory);
+    m->pageDirectory = NULL;
+    initializeTlb(m);
+}
+
+static uint32_t readElf16(const uint8_t *field)
+{
+    return field[0] | (field[1] << 8);
+}
+
+static uint32_t readElf32(const uint8_t *field)
+{
+    return field[0] | (field[1] << 8) | (field[2] << 16) | ((uint32_t)field[3] << 24);
+}
+
+#ifdef MMAP_SUPPORTED
+int mapSegment(Machine *m, int fd, uint32_t address, uint32_t offset, uint32_t fileBytes)
+{
+    // Map the segment's pages of the file copy-on-write over the guest memory, so nothing is read before the
+    // program touches it and only pages it writes are copied. The file offset must share the page offset.
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = address & ~(pageSize - 1);
+    uint64_t end = ((uint64_t)address + fileBytes + pageSize - 1) & ~(pageSize - 1);
+    uint64_t mappedEnd = (memorySize + pageSize - 1) & ~(pageSize - 1);
+    if (fileBytes == 0 || offset % pageSize != address % pageSize || end > mappedEnd)
+    {
+        return 0;
+    }
+
+    void *pages = mmap(m->memory + start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset - (address - start));
+    if (pages == MAP_FAILED)
+    {
+        // Put zero-filled memory back in case the failed mapping removed it, the segment is then copied instead
+        mmap(m->memory + start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return 0;
+    }
+
+    // The first and last page also hold bytes of the file that are not part of the segment, like the ELF
+    // headers or the start of the next section, which must read as zero like the rest of memory and .bss
+    memset(m->memory + start, 0, address - start);
+    memset(m->memory + address + fileBytes, 0, end - address - fileBytes);
+    return 1;
+}
+#endif
+
+int placeSegment(Machine *m, int fd, const uint8_t *image, uint32_t address, uint32_t offset, uint32_t fileBytes, uint32_t memoryBytes, int mappable)
+{
+    // Place the bytes of the file at address, the memoryBytes - fileBytes bytes after them (.bss) stay zero
+    if ((uint64_t)address + memoryBytes > MAX_MEMORY_SIZE)
+    {
+        fprintf(m->output, "Error: A segment of the program at 0x%08X does not fit in the 32-bit address space\n", address);
+        return 0;
+    }
+    if ((uint64_t)address + memoryBytes > memorySize && !sparseMemory)
+    {
+        fprintf(m->output, "Error: The program needs memory up to 0x%08llX, run it with a larger --mem or with --sparse\n", (unsigned long long)address + memoryBytes);
+        return 0;
+    }
+
+#ifdef MMAP_SUPPORTED
+    if (mappable && fd >= 0 && mapSegment(m, fd, address, offset, fileBytes))
+    {
+        return 1;
+    }
+#else
+    (void)fd;
+    (void)mappable;
+#endif
+
+    // Otherwise copy it, segments beyond the flat memory go to sparse memory
+    uint32_t flatBytes = (uint64_t)address + fileBytes <= memorySize ? fileBytes : address < memorySize ? (uint32_t)(memorySize - address) : 0;
+    memcpy(m->memory + address, image + offset, flatBytes);
+    for (uint32_t i = flatBytes; i < fileBytes; i++)
+    {
+        storeOutside(m, address + i, 1, image[offset + i]);
+    }
+    return 1;
+}
+
+int loadElf(Machine *m, int fd, const uint8_t *image, uint64_t fileSize)
+{
+    // Only 32-bit little-endian RISC-V executables are supported
+    if (fileSize < ELF_HEADER_SIZE || image[4] != 1 || image[5] != 1 ||
+        readElf16(image + 18) != ELF_MACHINE_RISCV || readElf16(image + 16) != ELF_TYPE_EXECUTABLE)
+    {
+        fprintf(m->output, "Error: Only 32-bit little-endian RISC-V ELF executables are supported\n");
+        return 0;
+    }
+
+    uint32_t headerOffset = readElf32(image + 28);
+    uint32_t headerSize = readElf16(image + 42);
+    uint32_t headerCount = readElf16(image + 44);
+    if (headerSize < ELF_PROGRAM_HEADER_SIZE || headerOffset + (uint64_t)headerSize * headerCount > fileSize)
+    {
+        fprintf(m->output, "Error: The ELF program headers are outside the file\n");
+        return 0;
+    }
+
+    uint64_t codeEnd = 0;
+    for (uint32_t i = 0; i < headerCount; i++)
+    {
+        const uint8_t *header = image + headerOffset + i * headerSize;
+        uint32_t offset = readElf32(header + 4);
+        uint32_t address = readElf32(header + 8);
+        uint32_t fileBytes = readElf32(header + 16);
+        uint32_t memoryBytes = readElf32(header + 20);
+        uint32_t flags = readElf32(header + 24);
+        if (readElf32(header) != ELF_SEGMENT_LOAD)
+        {
+            continue;
+        }
+        if ((uint64_t)offset + fileBytes > fileSize || fileBytes > memoryBytes)
+        {
+            fprintf(m->output, "Error: ELF segment %u is outside the file\n", i);
+            return 0;
+        }
+
+        // Pages shared with another segment are copied, mapping them would replace that segment's bytes
+        int mappable = 1;
+        uint64_t pageSize = 4096;
+#ifdef MMAP_SUPPORTED
+        pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+        for (uint32_t j = 0; j < headerCount; j++)
+        {
+            const uint8_t *other = image + headerOffset + j * headerSize;
+            uint64_t otherStart = readElf32(other + 8) & ~(pageSize - 1);
+            uint64_t otherEnd = (readElf32(other + 8) + (uint64_t)readElf32(other + 20) + pageSize - 1) & ~(pageSize - 1);
+            if (j != i && readElf32(other) == ELF_SEGMENT_LOAD &&
+                otherStart < (((uint64_t)address + memoryBytes + pageSize - 1) & ~(pageSize - 1)) && (address & ~(pageSize - 1)) < otherEnd)
+            {
+                mappable = 0;
+            }
+        }
+
+        if (!placeSegment(m, fd, image, address, offset, fileBytes, memoryBytes, mappable))
+        {
+            return 0;
+        }
+        if ((flags & ELF_SEGMENT_EXECUTE) && (uint64_t)address + memoryBytes > codeEnd)
+        {
+            codeEnd = (uint64_t)address + memoryBytes;
+        }
+    }
+
+    // Instructions are fetched from the flat memory, so the code has to be there
+    if (codeEnd > memorySize)
+    {
+        fprintf(m->output, "Error: The code of the program ends at 0x%08llX, outside the flat memory, run it with a larger --mem\n", (unsigned long long)codeEnd);
+        return 0;
+    }
+    m->programSize = (uint32_t)codeEnd;
+    m->programCounter = readElf32(image + 24);
+    return 1;
+}
+
+int loadInstructions(Machine *m, FILE *file)
+{
+    // Get the whole file, mapped read-only where possible so that nothing is read up front
+    uint64_t fileSize;
+    const uint8_t *image = NULL;
+    int fd = -1;
+#ifdef MMAP_SUPPORTED
+    struct stat status;
+    fd = fileno(file);
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode))
+    {
+        fprintf(m->output, "Error: The program must be a regular file\n");
+        return 0;
+    }
+    fileSize = (uint64_t)status.st_size;
+    if (fileSize > 0)
+    {
+        void *mapped = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        image = (mapped == MAP_FAILED) ? NULL : mapped;
+    }
+    if (!image)
+    {
+        // Files that cannot be mapped are read below
+        fd = -1;
+    }
+#else
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    fileSize = length < 0 ? 0 : (uint64_t)length;
+#endif
+
+    uint8_t *buffer = NULL;
+    if (!image && fileSize > 0)
+    {
+        buffer = malloc(fileSize);
+        if (!buffer || fread(buffer, 1, fileSize, file) != fileSize)
+        {
+            fprintf(m->output, "Error: Could not read the program into memory\n");
+            free(buffer);
+            return 0;
+        }
+        image = buffer;
+    }
+
+    int loaded;
+    if (fileSize >= 4 && memcmp(image, "\x7F" "ELF", 4) == 0)
+    {
+        loaded = loadElf(m, fd, image, fileSize);
+    }
+    else if (fileSize > memorySize)
+    {
+        // A raw binary is placed at address 0 and starts executing there
+        fprintf(m->output, "Error: File size exceeds available memory\n");
+        loaded = 0;
+    }
+    else
+    {
+        loaded = fileSize == 0 || placeSegment(m, fd, image, 0, 0, (uint32_t)fileSize, (uint32_t)fileSize, 1);
+        m->programSize = (uint32_t)fileSize;
+    }
+
+    // The segments keep their own mappings, the view of the whole file is not needed anymore
+#ifdef MMAP_SUPPORTED
+    if (!buffer && image)
+    {
+        munmap((void *)image, fileSize);
+    }
+#endif
+    free(buffer);
+    if (!loaded)
+    {
+        return 0;
+    }
+
+    // One decode cache entry per halfword of the program
+    m->decodeCache = calloc(m->programSize / 2 + 1, sizeof(DecodedInstruction));
+    if (!m->decodeCache)
+    {
+        fprintf(m->output, "Error: Could not allocate the decode cache\n");
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t fetchInstruction(Machine *m, uint32_t address)
+{
+    // Instructions are stored little-endian in the simulated memory. The lowest two bits tell a 4-byte
+    // instruction from a compressed one, whose following halfword is not read, it may be past the program.
+    uint32_t instruction = loadHalf(m, address);
+    if ((instruction & 0x3) == 0x3 && address + 4 <= m->programSize)
+    {
+        instruction |= loadHalf(m, address + 2) << 16;
+    }
+    return instruction;
+}
+
+void printUsage()
+{
+    printf("Usage: RiscVSimulator [options] <input_file>\n");
+    printf("       RiscVSimulator --batch [options] <input_file or directory>...\n");
+    printf("       RiscVSimulator --restore=FILE [options]\n");
+    printf("       RiscVSimulator --decode [--trace=LEVEL] <trace_file>\n");
+    printf("Options:\n");
+    printf("  --trace=LEVEL  0 = no tracing, 1 = one line per instruction, 2 = full tracing (default)\n");
+    printf("  --quiet        Same as --trace=0, only the final register dump is printed\n");
+    printf("  --trace-file=FILE\n");
+    printf("                 Write a compact binary trace to FILE instead of the text trace, interpreter only. --decode\n");
+    printf("                 prints the trace of FILE given as input like --trace=LEVEL would have printed it\n");
+    printf("  --stats        Print the number of executed instructions and instructions per second\n");
+    printf("  --timing       Count the cycles of an in-order 5-stage pipeline and print them with the CPI, interpreter only\n");
+    printf("  --predict=LIST Compare branch predictors, a comma-separated list of btfn, bimodal, gshare and tage, or all,\n");
+    printf("                 and report their accuracy overall and for each branch, interpreter only\n");
+    printf("  --profile[=FILE]\n");
+    printf("                 Count the instructions of every address, class and call site, print the hottest ones and write\n");
+    printf("                 the calls as folded stacks for flame graphs to FILE (default profile.folded), interpreter only\n");
+    printf("  --cache        Simulate L1 instruction and data caches and an L2 cache, and report their misses, interpreter only\n");
+    printf("  --cache-l1i=SIZE:WAYS:LINE[:POLICY][:WRITE], --cache-l1d=..., --cache-l2=...\n");
+    printf("                 Configure a cache level and turn on --cache. POLICY is lru (default), plru or random, WRITE is\n");
+    printf("                 back (default) or through. The defaults are 16K:4:64 for L1 and 256K:8:64 for L2, 0 leaves L2 out\n");
+    printf("  --engine=NAME  interpreter (default), threaded, block or jit, only the interpreter traces instructions\n");
+    printf("  --mem=SIZE     Size of the simulated memory in bytes, with an optional K, M or G suffix (default 1M, at most 4G)\n");
+    printf("  --sparse       Back the addresses beyond --mem with 4 KiB pages allocated on first touch instead of faulting\n");
+    printf("  --sample=N:W:M Run N instructions without --timing, --cache and --predict (on the faster --engine), W that warm\n");
+    printf("                 them up and M measured, and repeat. Estimates the CPI, misses and mispredictions of the whole run\n");
+    printf("  --snapshot=N   Save the harts and the memory to a snapshot after N instructions, while the program goes on\n");
+    printf("  --snapshot-file=FILE\n");
+    printf("                 Where --snapshot saves the snapshot (default snapshot.ckpt)\n");
+    printf("  --restore=FILE Resume the program saved in a snapshot, with its harts and memory size, instead of loading one\n");
+    printf("  --batch        Run all given programs, and the .bin and .elf files of given directories, in one process and\n");
+    printf("                 compare their registers with the .res file next to each program\n");
+    printf("  --harts=N      Run the program on N harts sharing its memory, a0 holds the hart id (default 1)\n");
+    printf("  --quantum=N    Instructions a hart runs before the next hart gets its turn (default 10000)\n");
+    printf("  --jobs=N       Host threads running the harts (default 1), or the programs of a batch (default one per core)\n");
+}
+
+uint64_t parseSize(const char *text)
+{
+    // A number of bytes with an optional K, M or G suffix, 0 if the text is not a valid size
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text || size > MAX_MEMORY_SIZE)
+    {
+        return 0;
+    }
+
+    switch (*end)
+    {
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        size <<= 20;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        size <<= 30;
+        end++;
+        break;
+    }
+
+    return (*end == '\0') ? size : 0;
+}
+
+int parseCount(const char *text, uint64_t *count)
+{
+    // A decimal number without sign or suffix, returns 0 if the text is not a valid count
+    if (*text < '0' || *text > '9')
+    {
+        return 0;
+    }
+    char *end;
+    *count = strtoull(text, &end, 10);
+    return *end == '\0';
+}
+
+char *splitField(char **rest)
+{
+    // The text up to the next ':', which is cut off there, and *rest moves past the colon. An empty field is
+    // returned as an empty string, and after the last field *rest is NULL.
+    char *field = *rest;
+    if (field)
+    {
+        char *colon = strchr(field, ':');
+        *rest = colon ? colon + 1 : NULL;
+        if (colon)
+        {
+            *colon = '\0';
+        }
+    }
+    return field;
+}
+
+int parseArguments(int argc, char *argv[])
+{
+    inputFileNames = malloc(argc * sizeof(char *));
+    if (!inputFileNames)
+    {
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quiet") == 0)
+        {
+            traceLevel = TRACE_NONE;
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            char *end;
+            long level = strtol(argv[i] + 8, &end, 10);
+            if (end == argv[i] + 8 || *end != '\0' || level < TRACE_NONE || level > TRACE_FULL)
+            {
+                printf("Error: Invalid trace level '%s', it must be 0, 1 or 2.\n", argv[i] + 8);
+                return 0;
+            }
+            traceLevel = (int)level;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            showStats = 1;
+        }
+        else if (strcmp(argv[i], "--timing") == 0)
+        {
+            timingModel = 1;
+        }
+        else if (strcmp(argv[i], "--profile") == 0)
+        {
+            profileFileName = DEFAULT_PROFILE_FILE;
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10])
+        {
+            profileFileName = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--trace-file=", 13) == 0 && argv[i][13])
+        {
+            traceFileName = argv[i] + 13;
+        }
+        else if (strcmp(argv[i], "--decode") == 0)
+        {
+#ifdef NO_TRACE
+            printf("Error: --decode needs a build with tracing, without -DNO_TRACE.\n");
+            return 0;
+#endif
+            decodeMode = 1;
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            cacheModel = 1;
+        }
+        else if (strncmp(argv[i], "--cache-l1i=", 12) == 0 || strncmp(argv[i], "--cache-l1d=", 12) == 0 || strncmp(argv[i], "--cache-l2=", 11) == 0)
+        {
+            int level = (argv[i][9] == '2') ? CACHE_L2 : (argv[i][10] == 'i') ? CACHE_L1I : CACHE_L1D;
+            const char *spec = strchr(argv[i], '=') + 1;
+            if (!parseCacheConfig(spec, &cacheConfigs[level], level))
+            {
+                printf("Error: Invalid %s cache configuration '%s'.\n", level == CACHE_L2 ? "L2" : level == CACHE_L1I ? "L1I" : "L1D", spec);
+                return 0;
+            }
+            cacheModel = 1;
+        }
+        else if (strncmp(argv[i], "--predict=", 10) == 0)
+        {
+            // Each predictor can be given once, and all of them with "all"
+            char list[64];
+            snprintf(list, sizeof(list), "%s", strcmp(argv[i] + 10, "all") == 0 ? "btfn,bimodal,gshare,tage" : argv[i] + 10);
+            predictorCount = 0;
+            for (char *name = strtok(list, ","); name; name = strtok(NULL, ","))
+            {
+                const PredictorType *type = findPredictor(name);
+                for (int j = 0; j < predictorCount; j++)
+                {
+                    if (predictors[j] == type)
+                    {
+                        type = NULL;
+                    }
+                }
+                if (!type)
+                {
+                    printf("Error: Invalid predictor list '%s'.\n", argv[i] + 10);
+                    return 0;
+                }
+                predictors[predictorCount++] = type;
+            }
+            if (predictorCount == 0)
+            {
+                printf("Error: Invalid predictor list '%s'.\n", argv[i] + 10);
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--engine=interpreter") == 0)
+        {
+            engine = ENGINE_INTERPRETER;
+        }
+        else if (strcmp(argv[i], "--engine=threaded") == 0)
+        {
+            engine = ENGINE_THREADED;
+        }
+        else if (strcmp(argv[i], "--engine=block") == 0)
+        {
+            engine = ENGINE_BLOCK;
+        }
+        else if (strcmp(argv[i], "--engine=jit") == 0)
+        {
+            engine = ENGINE_JIT;
+        }
+        else if (strncmp(argv[i], "--mem=", 6) == 0)
+        {
+            memorySize = parseSize(argv[i] + 6);
+            if (memorySize < MIN_MEMORY_SIZE || memorySize > MAX_MEMORY_SIZE)
+            {
+                printf("Error: Invalid memory size '%s', it must be between 4K and 4G.\n", argv[i] + 6);
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--sparse") == 0)
+        {
+            sparseMemory = 1;
+        }
+        else if (strncmp(argv[i], "--sample=", 9) == 0)
+        {
+            // N:W:M, three counts separated by colons
+            char spec[64];
+            char *rest = spec;
+            uint64_t counts[3];
+            int valid = strlen(argv[i] + 9) < sizeof(spec);
+            if (valid)
+            {
+                strcpy(spec, argv[i] + 9);
+            }
+            for (int j = 0; j < 3 && valid; j++)
+            {
+                char *field = splitField(&rest);
+                valid = field && parseCount(field, &counts[j]);
+            }
+            if (!valid || rest || counts[2] < 1)
+            {
+                printf("Error: Invalid sampling '%s', it must be N:W:M with M at least 1.\n", argv[i] + 9);
+                return 0;
+            }
+            sampleSkip = counts[0];
+            sampleWarmup = counts[1];
+            sampleLength = counts[2];
+        }
+        else if (strncmp(argv[i], "--snapshot=", 11) == 0)
+        {
+            if (!parseCount(argv[i] + 11, &snapshotAt) || snapshotAt < 1)
+            {
+                printf("Error: Invalid snapshot point '%s'.\n", argv[i] + 11);
+                return 0;
+            }
+        }
+        else if (strncmp(argv[i], "--snapshot-file=", 16) == 0 && argv[i][16])
+        {
+            snapshotFileName = argv[i] + 16;
+        }
+        else if (strncmp(argv[i], "--restore=", 10) == 0 && argv[i][10])
+        {
+            restoreFileName = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batchMode = 1;
+        }
+        else if (strncmp(argv[i], "--harts=", 8) == 0)
+        {
+            uint64_t count;
+            if (!parseCount(argv[i] + 8, &count) || count < 1 || count > MAX_HARTS)
+            {
+                printf("Error: Invalid number of harts '%s', it must be between 1 and %d.\n", argv[i] + 8, MAX_HARTS);
+                return 0;
+            }
+            hartCount = (int)count;
+        }
+        else if (strncmp(argv[i], "--quantum=", 10) == 0)
+        {
+            if (!parseCount(argv[i] + 10, &quantum) || quantum < 1)
+            {
+                printf("Error: Invalid quantum '%s'.\n", argv[i] + 10);
+                return 0;
+            }
+        }
+        else if (strncmp(argv[i], "--jobs=", 7) == 0)
+        {
+            uint64_t count;
+            if (!parseCount(argv[i] + 7, &count) || count < 1 || count > MAX_HARTS)
+            {
+                printf("Error: Invalid number of jobs '%s', it must be between 1 and %d.\n", argv[i] + 7, MAX_HARTS);
+                return 0;
+            }
+            jobs = (int)count;
+        }
+        else if (argv[i][0] == '-')
+        {
+            printf("Error: Unexpected argument '%s'.\n", argv[i]);
+            return 0;
+        }
+        else
+        {
+            inputFileNames[inputFileCount++] = argv[i];
+        }
+    }
+
+    // Without --batch exactly one program is run, or none when a snapshot is restored
+    int programs = restoreFileName ? 0 : 1;
+    if ((inputFileCount == 0 && programs > 0) || (!batchMode && inputFileCount > programs))
+    {
+        if (inputFileCount > programs)
+        {
+            printf("Error: Unexpected argument '%s'.\n", inputFileNames[programs]);
+        }
+        return 0;
+    }
+
+    // --decode prints the trace whatever else is given, except for the trace level
+    if (decodeMode)
+    {
+        return 1;
+    }
+
+    if (batchMode && hartCount > 1)
+    {
+        printf("Error: --harts cannot be used with --batch.\n");
+        return 0;
+    }
+    if (batchMode && (snapshotAt || restoreFileName))
+    {
+        printf("Error: --snapshot and --restore cannot be used with --batch.\n");
+        return 0;
+    }
+    if (snapshotAt && hartCount > 1 && jobs > 1)
+    {
+        printf("Error: --snapshot needs the harts to take turns on one thread, it cannot be used with --jobs.\n");
+        return 0;
+    }
+
+    // The timing model, the predictors, the caches, the profiler and the binary trace follow every instruction, which
+    // only the interpreter executes one by one. When sampling, the faster engines run the instructions between the samples.
+    if (((!sampleLength && (timingModel || predictorCount > 0 || cacheModel)) || profileFileName || traceFileName) && engine != ENGINE_INTERPRETER)
+    {
+        printf("Error: --timing, --predict, --cache, --profile and --trace-file only work with the interpreter engine, the first three also with --sample.\n");
+        return 0;
+    }
+    if (sampleLength && (batchMode || hartCount > 1 || snapshotAt))
+    {
+        printf("Error: --sample cannot be used with --batch, --harts or --snapshot.\n");
+        return 0;
+    }
+    if (sampleLength && !timingModel && predictorCount == 0 && !cacheModel)
+    {
+        // Sampling estimates the CPI unless the caches or predictors are what should be measured
+        timingModel = 1;
+    }
+    if (batchMode && (profileFileName || traceFileName))
+    {
+        printf("Error: --profile and --trace-file cannot be used with --batch.\n");
+        return 0;
+    }
+
+    // The binary trace takes the place of the text trace
+    if (traceFileName)
+    {
+        traceLevel = TRACE_NONE;
+    }
+
+    // Only the interpreter traces, the other engines, batch mode and harts on several threads always run quietly
+    if (engine != ENGINE_INTERPRETER || batchMode || (hartCount > 1 && jobs > 1))
+    {
+        traceLevel = TRACE_NONE;
+    }
+
+    return 1;
+}
+
+// The atomic operations of the A extension, as X(operation, funct5). The fast engines leave them to the interpreter.
+#define ATOMIC_OPERATIONS(X)    \
+    X(OP_LR_W, 0x02)            \
+    X(OP_SC_W, 0x03)            \
+    X(OP_AMOSWAP_W, 0x01)       \
+    X(OP_AMOADD_W, 0x00)        \
+    X(OP_AMOXOR_W, 0x04)        \
+    X(OP_AMOAND_W, 0x0C)        \
+    X(OP_AMOOR_W, 0x08)         \
+    X(OP_AMOMIN_W, 0x10)        \
+    X(OP_AMOMAX_W, 0x14)        \
+    X(OP_AMOMINU_W, 0x18)       \
+    X(OP_AMOMAXU_W, 0x1C)
+
+// The instructions of the F extension, as X(operation, name). The fast engines run them with executeFloat().
+#define FLOAT_OPERATIONS(X)            \
+    X(OP_FLW, "FLW")                   \
+    X(OP_FSW, "FSW")                   \
+    X(OP_FMADD_S, "FMADD.S")           \
+    X(OP_FMSUB_S, "FMSUB.S")           \
+    X(OP_FNMSUB_S, "FNMSUB.S")         \
+    X(OP_FNMADD_S, "FNMADD.S")         \
+    X(OP_FADD_S, "FADD.S")             \
+    X(OP_FSUB_S, "FSUB.S")             \
+    X(OP_FMUL_S, "FMUL.S")             \
+    X(OP_FDIV_S, "FDIV.S")             \
+    X(OP_FSQRT_S, "FSQRT.S")           \
+    X(OP_FSGNJ_S, "FSGNJ.S")           \
+    X(OP_FSGNJN_S, "FSGNJN.S")         \
+    X(OP_FSGNJX_S, "FSGNJX.S")         \
+    X(OP_FMIN_S, "FMIN.S")             \
+    X(OP_FMAX_S, "FMAX.S")             \
+    X(OP_FCVT_W_S, "FCVT.W.S")         \
+    X(OP_FCVT_WU_S, "FCVT.WU.S")       \
+    X(OP_FCVT_S_W, "FCVT.S.W")         \
+    X(OP_FCVT_S_WU, "FCVT.S.WU")       \
+    X(OP_FMV_X_W, "FMV.X.W")           \
+    X(OP_FMV_W_X, "FMV.W.X")           \
+    X(OP_FEQ_S, "FEQ.S")               \
+    X(OP_FLT_S, "FLT.S")               \
+    X(OP_FLE_S, "FLE.S")               \
+    X(OP_FCLASS_S, "FCLASS.S")
+
+// The CSR instructions, as X(operation, funct3, name). The fast engines leave them to the interpreter.
+#define CSR_OPERATIONS(X)              \
+    X(OP_CSRRW, 0x1, "CSRRW")          \
+    X(OP_CSRRS, 0x2, "CSRRS")          \
+    X(OP_CSRRC, 0x3, "CSRRC")          \
+    X(OP_CSRRWI, 0x5, "CSRRWI")        \
+    X(OP_CSRRSI, 0x6, "CSRRSI")        \
+    X(OP_CSRRCI, 0x7, "CSRRCI")
+
+// Encoders of the 32-bit instruction formats, used to expand compressed instructions
+static uint32_t encodeR(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t encodeI(int32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+    return ((uint32_t)imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t encodeS(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t opcode)
+{
+    return (((uint32_t)imm >> 5) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((imm & 0x1F) << 7) | opcode;
+}
+
+static uint32_t encodeB(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3)
+{
+    uint32_t offset = (uint32_t)imm;
+    return (((offset >> 12) & 0x1) << 31) | (((offset >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+           (((offset >> 1) & 0xF) << 8) | (((offset >> 11) & 0x1) << 7) | 0x63;
+}
+
+static uint32_t encodeJ(int32_t imm, uint32_t rd)
+{
+    uint32_t offset = (uint32_t)imm;
+    return (((offset >> 20) & 0x1) << 31) | (((offset >> 1) & 0x3FF) << 21) | (((offset >> 11) & 0x1) << 20) |
+           (offset & 0xFF000) | (rd << 7) | 0x6F;
+}
+
+// Bit field of a compressed instruction, moved to bit position to
+#define CBITS(high, low, to) ((((uint32_t)instruction >> (low)) & ((1u << ((high) - (low) + 1)) - 1)) << (to))
+
+uint32_t expandCompressed(uint16_t instruction)
+{
+    // The 32-bit instruction a compressed RV32C instruction stands for, or 0 (an unknown instruction) if it
+    // is reserved or belongs to an extension that is not simulated, like the double-precision loads and stores
+    uint32_t funct3 = (instruction >> 13) & 0x7;
+    uint32_t rd = (instruction >> 7) & 0x1F; // Full register fields of quadrants 1 and 2
+    uint32_t rs2 = (instruction >> 2) & 0x1F;
+    uint32_t rdPrime = 8 + ((instruction >> 2) & 0x7); // x8-x15 fields of the other formats
+    uint32_t rs1Prime = 8 + ((instruction >> 7) & 0x7);
+    int32_t imm6 = (int32_t)(CBITS(12, 12, 31) | CBITS(6, 2, 26)) >> 26;
+
+    switch ((instruction & 0x3) << 3 | funct3)
+    {
+    case 0x00: // c.addi4spn
+    {
+        int32_t imm = CBITS(12, 11, 4) | CBITS(10, 7, 6) | CBITS(6, 6, 2) | CBITS(5, 5, 3);
+        return imm ? encodeI(imm, 2, 0x0, rdPrime, 0x13) : 0;
+    }
+    case 0x02: // c.lw
+        return encodeI(CBITS(12, 10, 3) | CBITS(6, 6, 2) | CBITS(5, 5, 6), rs1Prime, 0x2, rdPrime, 0x03);
+    case 0x03: // c.flw
+        return encodeI(CBITS(12, 10, 3) | CBITS(6, 6, 2) | CBITS(5, 5, 6), rs1Prime, 0x2, rdPrime, 0x07);
+    case 0x06: // c.sw
+        return encodeS(CBITS(12, 10, 3) | CBITS(6, 6, 2) | CBITS(5, 5, 6), rdPrime, rs1Prime, 0x2, 0x23);
+    case 0x07: // c.fsw
+        return encodeS(CBITS(12, 10, 3) | CBITS(6, 6, 2) | CBITS(5, 5, 6), rdPrime, rs1Prime, 0x2, 0x27);
+
+    case 0x08: // c.addi, c.nop
+        return encodeI(imm6, rd, 0x0, rd, 0x13);
+    case 0x09: // c.jal
+    case 0x0D: // c.j
+    {
+        int32_t imm = (int32_t)(CBITS(12, 12, 31) | CBITS(11, 11, 24) | CBITS(10, 9, 28) | CBITS(8, 8, 30) | CBITS(7, 7, 26) |
+                                CBITS(6, 6, 27) | CBITS(5, 3, 21) | CBITS(2, 2, 25)) >> 20;
+        return encodeJ(imm, funct3 == 0x1 ? 1 : 0);
+    }
+    case 0x0A: // c.li
+        return encodeI(imm6, 0, 0x0, rd, 0x13);
+    case 0x0B:
+        if (rd == 2)
+        {
+            // c.addi16sp
+            int32_t imm = (int32_t)(CBITS(12, 12, 31) | CBITS(6, 6, 26) | CBITS(5, 5, 28) | CBITS(4, 3, 29) | CBITS(2, 2, 27)) >> 22;
+            return imm ? encodeI(imm, 2, 0x0, 2, 0x13) : 0;
+        }
+        // c.lui
+        return imm6 ? ((uint32_t)imm6 << 12) | (rd << 7) | 0x37 : 0;
+    case 0x0C:
+        switch ((instruction >> 10) & 0x3)
+        {
+        case 0x0: // c.srli, shift amounts of 32 and more are for RV64
+            return (instruction & 0x1000) ? 0 : encodeI(rs2, rs1Prime, 0x5, rs1Prime, 0x13);
+        case 0x1: // c.srai
+            return (instruction & 0x1000) ? 0 : encodeI(0x400 | rs2, rs1Prime, 0x5, rs1Prime, 0x13);
+        case 0x2: // c.andi
+            return encodeI(imm6, rs1Prime, 0x7, rs1Prime, 0x13);
+        default:
+        {
+            // c.sub, c.xor, c.or, c.and, the others are RV64 word operations
+            static const uint8_t functs[4] = {0x0, 0x4, 0x6, 0x7};
+            uint32_t select = (instruction >> 5) & 0x3;
+            if (instruction & 0x1000)
+            {
+                return 0;
+            }
+            return encodeR(select == 0 ? 0x20 : 0x00, rdPrime, rs1Prime, functs[select], rs1Prime, 0x33);
+        }
+        }
+    case 0x0E: // c.beqz
+    case 0x0F: // c.bnez
+    {
+        int32_t imm = (int32_t)(CBITS(12, 12, 31) | CBITS(11, 10, 26) | CBITS(6, 5, 29) | CBITS(4, 3, 24) | CBITS(2, 2, 28)) >> 23;
+        return encodeB(imm, 0, rs1Prime, funct3 == 0x6 ? 0x0 : 0x1);
+    }
+
+    case 0x10: // c.slli
+        return (instruction & 0x1000) ? 0 : encodeI(rs2, rd, 0x1, rd, 0x13);
+    case 0x12: // c.lwsp
+        return rd ? encodeI(CBITS(12, 12, 5) | CBITS(6, 4, 2) | CBITS(3, 2, 6), 2, 0x2, rd, 0x03) : 0;
+    case 0x13: // c.flwsp, unlike c.lwsp it can load f0
+        return encodeI(CBITS(12, 12, 5) | CBITS(6, 4, 2) | CBITS(3, 2, 6), 2, 0x2, rd, 0x07);
+    case 0x14:
+        if (!(instruction & 0x1000))
+        {
+            if (rs2 == 0)
+            {
+                // c.jr
+                return rd ? encodeI(0, rd, 0x0, 0, 0x67) : 0;
+            }
+            // c.mv
+            return encodeR(0x00, rs2, 0, 0x0, rd, 0x33);
+        }
+        if (rs2 == 0)
+        {
+            // c.ebreak, c.jalr
+            return rd ? encodeI(0, rd, 0x0, 1, 0x67) : 0x00100073;
+        }
+        // c.add
+        return encodeR(0x00, rs2, rd, 0x0, rd, 0x33);
+    case 0x16: // c.swsp
+        return encodeS(CBITS(12, 9, 2) | CBITS(8, 7, 6), rs2, 2, 0x2, 0x23);
+    case 0x17: // c.fswsp
+        return encodeS(CBITS(12, 9, 2) | CBITS(8, 7, 6), rs2, 2, 0x2, 0x27);
+
+    default:
+        return 0;
+    }
+}
+
+#undef CBITS
+
+void decodeInstruction(uint32_t instruction, DecodedInstruction *decoded)
+{
+    // Compressed instructions are expanded to the instruction they stand for and decoded like it,
+    // the cached decoding keeps their length so the program counter advances by 2
+    decoded->instruction = instruction;
+    decoded->length = 4;
+    if ((instruction & 0x3) != 0x3)
+    {
+        decoded->instruction = instruction & 0xFFFF;
+        decoded->length = 2;
+        instruction = expandCompressed((uint16_t)instruction);
+    }
+
+    // Extract opcode and other fields once, so executing the instruction again needs no decoding
+    uint32_t opcode = instruction & 0x7F;
+    uint32_t funct3 = (instruction >> 12) & 0x7;
+    uint32_t funct7 = (instruction >> 25) & 0x7F;
+
+    decoded->rd = (instruction >> 7) & 0x1F;
+    decoded->rs1 = (instruction >> 15) & 0x1F;
+    decoded->rs2 = (instruction >> 20) & 0x1F;
+    decoded->operation = OP_UNKNOWN;
+
+    // Sign-extended immediates of the different instruction formats
+    int32_t immI = (int32_t)instruction >> 20;
+    int32_t immS = ((int32_t)(instruction & 0xFE000000) >> 20) | ((instruction >> 7) & 0x1F);
+    int32_t immB = ((int32_t)(instruction & 0x80000000) >> 19) | ((instruction << 4) & 0x800) | ((instruction >> 20) & 0x7E0) | ((instruction >> 7) & 0x1E);
+    int32_t immJ = ((int32_t)(instruction & 0x80000000) >> 11) | (instruction & 0xFF000) | ((instruction >> 9) & 0x800) | ((instruction >> 20) & 0x7FE);
+
+    switch (opcode)
+    {
+    case 0x33: // R-type opcode
+    {
+        static const uint8_t baseOperations[8] = {OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND};
+        static const uint8_t multiplyOperations[8] = {OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU};
+        decoded->handler = HANDLER_R;
+        if (funct7 == 0x00)
+        {
+            decoded->operation = baseOperations[funct3];
+        }
+        else if (funct7 == 0x01)
+        {
+            decoded->operation = multiplyOperations[funct3];
+        }
+        else if (funct7 == 0x20 && funct3 == 0x0)
+        {
+            decoded->operation = OP_SUB;
+        }
+        else if (funct7 == 0x20 && funct3 == 0x5)
+        {
+            decoded->operation = OP_SRA;
+        }
+        decoded->imm = 0;
+        break;
+    }
+    case 0x13: // I-type opcode
+    {
+        static const uint8_t immediateOperations[8] = {OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_ORI, OP_ANDI};
+        decoded->handler = HANDLER_I;
+        decoded->operation = immediateOperations[funct3];
+        decoded->imm = immI;
+        if (funct3 == 0x1 || funct3 == 0x5)
+        {
+            // Shifts only use the lower 5 bits as the shift amount, bit 30 selects SRAI
+            decoded->imm = immI & 0x1F;
+            if (funct3 == 0x5 && (instruction & 0x40000000))
+            {
+                decoded->operation = OP_SRAI;
+            }
+        }
+        break;
+    }
+    case 0x23: // S-type opcode
+    {
+        static const uint8_t storeOperations[8] = {OP_SB, OP_SH, OP_SW, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN};
+        decoded->handler = HANDLER_S;
+        decoded->operation = storeOperations[funct3];
+        decoded->imm = immS;
+        break;
+    }
+    case 0x03: // L-type opcode
+    {
+        static const uint8_t loadOperations[8] = {OP_LB, OP_LH, OP_LW, OP_UNKNOWN, OP_LBU, OP_LHU, OP_UNKNOWN, OP_UNKNOWN};
+        decoded->handler = HANDLER_L;
+        decoded->operation = loadOperations[funct3];
+        decoded->imm = immI;
+        break;
+    }
+    case 0x37: // U-type opcode
+        decoded->handler = HANDLER_LUI;
+        decoded->operation = OP_LUI;
+        decoded->imm = instruction & 0xFFFFF000;
+        break;
+    case 0x17: // AUIPC opcode
+        decoded->handler = HANDLER_AUIPC;
+        decoded->operation = OP_AUIPC;
+        decoded->imm = instruction & 0xFFFFF000;
+        break;
+    case 0x63: // B-type opcode
+    {
+        static const uint8_t branchOperations[8] = {OP_BEQ, OP_BNE, OP_UNKNOWN, OP_UNKNOWN, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU};
+        decoded->handler = HANDLER_B;
+        decoded->operation = branchOperations[funct3];
+        decoded->imm = immB;
+        break;
+    }
+    case 0x6F: // JAL opcode
+        decoded->handler = HANDLER_JAL;
+        decoded->operation = OP_JAL;
+        decoded->imm = immJ;
+        break;
+    case 0x67: // JALR opcode
+        decoded->handler = HANDLER_JALR;
+        decoded->operation = OP_JALR;
+        decoded->imm = immI;
+        break;
+    case 0x2F: // Atomic memory operations, only on words
+    {
+        static const uint8_t atomicOperations[32] = {
+#define X(operation, funct5) [funct5] = operation,
+            ATOMIC_OPERATIONS(X)
+#undef X
+        };
+        decoded->handler = HANDLER_A;
+        decoded->operation = funct3 == 0x2 ? atomicOperations[funct7 >> 2] : OP_UNKNOWN;
+        decoded->imm = 0;
+        break;
+    }
+    case 0x07: // Floating-point load
+        decoded->handler = HANDLER_F;
+        decoded->operation = funct3 == 0x2 ? OP_FLW : OP_UNKNOWN;
+        decoded->imm = immI;
+        break;
+    case 0x27: // Floating-point store
+        decoded->handler = HANDLER_F;
+        decoded->operation = funct3 == 0x2 ? OP_FSW : OP_UNKNOWN;
+        decoded->imm = immS;
+        break;
+    case 0x43: // Fused multiply-add opcodes, bits 25-26 select single precision
+    case 0x47:
+    case 0x4B:
+    case 0x4F:
+    {
+        // The third source register is kept above the rounding mode in imm
+        static const uint8_t fusedOperations[4] = {OP_FMADD_S, OP_FMSUB_S, OP_FNMSUB_S, OP_FNMADD_S};
+        decoded->handler = HANDLER_F;
+        decoded->operation = (funct7 & 0x3) == 0 ? fusedOperations[(opcode >> 2) & 0x3] : OP_UNKNOWN;
+        decoded->imm = (int32_t)((instruction >> 27) << 3 | funct3);
+        break;
+    }
+    case 0x53: // Other floating-point operations, funct3 is the rounding mode of those that round
+    {
+        uint32_t rs2 = decoded->rs2;
+        decoded->handler = HANDLER_F;
+        decoded->imm = funct3;
+        switch (funct7)
+        {
+        case 0x00:
+            decoded->operation = OP_FADD_S;
+            break;
+        case 0x04:
+            decoded->operation = OP_FSUB_S;
+            break;
+        case 0x08:
+            decoded->operation = OP_FMUL_S;
+            break;
+        case 0x0C:
+            decoded->operation = OP_FDIV_S;
+            break;
+        case 0x2C:
+            decoded->operation = rs2 == 0 ? OP_FSQRT_S : OP_UNKNOWN;
+            break;
+        case 0x10:
+            decoded->operation = funct3 == 0x0 ? OP_FSGNJ_S : funct3 == 0x1 ? OP_FSGNJN_S : funct3 == 0x2 ? OP_FSGNJX_S : OP_UNKNOWN;
+            break;
+        case 0x14:
+            decoded->operation = funct3 == 0x0 ? OP_FMIN_S : funct3 == 0x1 ? OP_FMAX_S : OP_UNKNOWN;
+            break;
+        case 0x60:
+            decoded->operation = rs2 == 0 ? OP_FCVT_W_S : rs2 == 1 ? OP_FCVT_WU_S : OP_UNKNOWN;
+            break;
+        case 0x68:
+            decoded->operation = rs2 == 0 ? OP_FCVT_S_W : rs2 == 1 ? OP_FCVT_S_WU : OP_UNKNOWN;
+            break;
+        case 0x70:
+            decoded->operation = rs2 != 0 ? OP_UNKNOWN : funct3 == 0x0 ? OP_FMV_X_W : funct3 == 0x1 ? OP_FCLASS_S : OP_UNKNOWN;
+            break;
+        case 0x78:
+            decoded->operation = rs2 == 0 && funct3 == 0x0 ? OP_FMV_W_X : OP_UNKNOWN;
+            break;
+        case 0x50:
+            decoded->operation = funct3 == 0x2 ? OP_FEQ_S : funct3 == 0x1 ? OP_FLT_S : funct3 == 0x0 ? OP_FLE_S : OP_UNKNOWN;
+            break;
+        default:
+            decoded->operation = OP_UNKNOWN;
+            break;
+        }
+        break;
+    }
+    case 0x73: // E-call and CSR opcode
+    {
+        static const uint8_t csrOperations[8] = {
+#define X(operation, funct3, name) [funct3] = operation,
+            CSR_OPERATIONS(X)
+#undef X
+        };
+        if (funct3 == 0x0)
+        {
+            decoded->handler = HANDLER_ECALL;
+            decoded->operation = OP_ECALL;
+            decoded->imm = 0;
+        }
+        else
+        {
+            // imm is the CSR number, the immediate forms use the rs1 field as a 5-bit value
+            decoded->handler = HANDLER_CSR;
+            decoded->operation = csrOperations[funct3];
+            decoded->imm = instruction >> 20;
+        }
+        break;
+    }
+    case 0x0F: // FENCE and FENCE.I opcode, the predecessor and successor sets are not needed
+        decoded->handler = HANDLER_FENCE;
+        decoded->operation = funct3 == 0x0 ? OP_FENCE : funct3 == 0x1 ? OP_FENCE_I : OP_UNKNOWN;
+        decoded->imm = 0;
+        break;
+    default:
+        decoded->handler = HANDLER_UNKNOWN;
+        decoded->imm = 0;
+        break;
+    }
+}
+
+void invalidateDecodedInstructions(Machine *m, uint32_t address, uint32_t length)
+{
+    // Forget the decoding of every instruction overlapping [address, address + length), which includes
+    // a 4-byte instruction starting at the halfword before it
+    uint32_t first = (address < 2 ? 0 : address - 2) / 2;
+    for (uint32_t halfword = first; halfword <= (address + length - 1) / 2 && halfword < m->programSize / 2; halfword++)
+    {
+        m->decodeCache[halfword].handler = HANDLER_UNDECODED;
+        if (m->threadedTargets)
+        {
+            m->threadedTargets[halfword] = m->threadedTranslateTarget;
+        }
+        if (m->blockHalfwords && m->blockHalfwords[halfword] && 2 * halfword + 2 > address)
+        {
+            m->blocksStale = 1;
+        }
+    }
+}
+
+// Multiplication and division of the M extension. RISC-V defines every case instead of trapping:
+// dividing by zero gives all ones (the remainder is the dividend) and INT_MIN / -1 gives INT_MIN
+// (the remainder is 0), so these are checked before using the host division, which would trap.
+static inline uint32_t multiplyHigh(uint32_t a, uint32_t b)
+{
+    return (uint32_t)(((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32);
+}
+
+static inline uint32_t multiplyHighSignedUnsigned(uint32_t a, uint32_t b)
+{
+    return (uint32_t)(((int64_t)(int32_t)a * (int64_t)b) >> 32);
+}
+
+static inline uint32_t multiplyHighUnsigned(uint32_t a, uint32_t b)
+{
+    return (uint32_t)(((uint64_t)a * b) >> 32);
+}
+
+static inline uint32_t divideSigned(uint32_t a, uint32_t b)
+{
+    if (b == 0)
+    {
+        return 0xFFFFFFFF;
+    }
+    if (a == 0x80000000 && b == 0xFFFFFFFF)
+    {
+        return a;
+    }
+    return (uint32_t)((int32_t)a / (int32_t)b);
+}
+
+static inline uint32_t divideUnsigned(uint32_t a, uint32_t b)
+{
+    return b == 0 ? 0xFFFFFFFF : a / b;
+}
+
+static inline uint32_t remainderSigned(uint32_t a, uint32_t b)
+{
+    if (b == 0)
+    {
+        return a;
+    }
+    if (a == 0x80000000 && b == 0xFFFFFFFF)
+    {
+        return 0;
+    }
+    return (uint32_t)((int32_t)a % (int32_t)b);
+}
+
+static inline uint32_t remainderUnsigned(uint32_t a, uint32_t b)
+{
+    return b == 0 ? a : a % b;
+}
+
+// The F extension keeps the bits of each value and converts them to host floats for the arithmetic, which
+// the host does in the rounding mode of the instruction. The exceptions it raises are added to fflags.
+#ifdef SSE_SUPPORTED
+#define MXCSR_DEFAULT 0x1F80 // All exceptions masked, round to nearest, subnormals kept
+
+static inline void setHostRounding(uint32_t mode)
+{
+    // The rounding control is in bits 13-14 of MXCSR, RMM has no SSE equivalent and rounds to nearest even.
+    // Setting MXCSR also clears its exception flags.
+    static const uint32_t control[5] = {0x0000, 0x6000, 0x2000, 0x4000, 0x0000};
+    _mm_setcsr(MXCSR_DEFAULT | control[mode]);
+}
+
+static inline uint32_t hostExceptions(void)
+{
+    // The IE, ZE, OE, UE and PE flags of MXCSR as fflags, the denormal operand flag has no RISC-V equivalent
+    uint32_t status = _mm_getcsr();
+    return ((status & 0x01) << 4) | ((status & 0x04) << 1) | ((status & 0x08) >> 1) | ((status & 0x10) >> 3) | ((status & 0x20) >> 5);
+}
+
+static inline float hostSquareRoot(float value)
+{
+    return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(value)));
+}
+#else
+static inline void setHostRounding(uint32_t mode)
+{
+    static const int rounding[5] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST};
+    fesetround(rounding[mode]);
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+static inline uint32_t hostExceptions(void)
+{
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    return ((raised & FE_INVALID) ? FFLAG_NV : 0) | ((raised & FE_DIVBYZERO) ? FFLAG_DZ : 0) | ((raised & FE_OVERFLOW) ? FFLAG_OF : 0) |
+           ((raised & FE_UNDERFLOW) ? FFLAG_UF : 0) | ((raised & FE_INEXACT) ? FFLAG_NX : 0);
+}
+
+static inline float hostSquareRoot(float value)
+{
+    return sqrtf(value);
+}
+#endif
+
+static inline int isNan(uint32_t bits)
+{
+    return (bits & 0x7FFFFFFF) > 0x7F800000;
+}
+
+static inline int isSignalingNan(uint32_t bits)
+{
+    return isNan(bits) && !(bits & 0x00400000);
+}
+
+static inline uint32_t canonicalNan(uint32_t bits)
+{
+    return isNan(bits) ? CANONICAL_NAN : bits;
+}
+
+// The operands and results of host arithmetic are volatile, so the compiler keeps the operation between
+// setting the rounding mode and reading the exceptions. Afterwards the host rounds to nearest again.
+static double roundedToOdd(double value, uint32_t raised)
+{
+    // A double computed by rounding towards zero, with the lowest bit set if it is inexact, rounds to the same
+    // float in every rounding mode as the exact value it stands for, as it has enough extra bits
+    if (raised & FFLAG_NX)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        bits |= 1;
+        memcpy(&value, &bits, sizeof(bits));
+    }
+    return value;
+}
+
+static uint32_t roundToFloat(Machine *m, double value, uint32_t mode)
+{
+    // Rounds a double that is exact or rounded to odd. The host does RMM like RNE, which only differs for values
+    // halfway between two floats: they are rounded away from zero instead of to the even one.
+    volatile double wide = value;
+    volatile float result;
+    setHostRounding(mode);
+    result = (float)wide;
+    m->fflags |= hostExceptions();
+    if (mode == FRM_RMM)
+    {
+        setHostRounding(FRM_RTZ);
+        volatile float truncated = (float)wide;
+        uint32_t below = bitsFromFloat(truncated);
+        if ((below & 0x7FFFFFFF) < 0x7F7FFFFF)
+        {
+            float above = floatFromBits(below + 1);
+            if (value == ((double)truncated + (double)above) / 2)
+            {
+                result = above;
+            }
+        }
+    }
+    setHostRounding(FRM_RNE);
+    return canonicalNan(bitsFromFloat(result));
+}
+
+static uint32_t floatArithmetic(Machine *m, int operation, uint32_t a, uint32_t b, uint32_t mode)
+{
+    volatile float x = floatFromBits(a);
+    volatile float y = floatFromBits(b);
+
+    // Not every host raises the invalid flag for a signaling NaN operand, for example the x87 unit
+    if (isSignalingNan(a) || (operation != OP_FSQRT_S && isSignalingNan(b)))
+    {
+        m->fflags |= FFLAG_NV;
+    }
+
+    // Square roots of floats are never halfway between two floats, so RMM gives the same as RNE. In the other
+    // rounding modes of SSE the host computes the float result directly.
+    if (operation == OP_FSQRT_S && mode == FRM_RMM)
+    {
+        mode = FRM_RNE;
+    }
+    if (mode != FRM_RMM)
+    {
+        volatile float result;
+        setHostRounding(mode);
+        switch (operation)
+        {
+        case OP_FADD_S:
+            result = x + y;
+            break;
+        case OP_FSUB_S:
+            result = x - y;
+            break;
+        case OP_FMUL_S:
+            result = x * y;
+            break;
+        case OP_FDIV_S:
+            result = x / y;
+            break;
+        default:
+            result = hostSquareRoot(x);
+            break;
+        }
+        m->fflags |= hostExceptions();
+        setHostRounding(FRM_RNE);
+        return canonicalNan(bitsFromFloat(result));
+    }
+
+    // RMM computes in double precision, rounded to odd. Invalid operations and divisions by zero are
+    // raised there, the other exceptions when rounding to a float.
+    volatile double result;
+    setHostRounding(FRM_RTZ);
+    switch (operation)
+    {
+    case OP_FADD_S:
+        result = (double)x + (double)y;
+        break;
+    case OP_FSUB_S:
+        result = (double)x - (double)y;
+        break;
+    case OP_FMUL_S:
+        result = (double)x * (double)y;
+        break;
+    default:
+        result = (double)x / (double)y;
+        break;
+    }
+    uint32_t raised = hostExceptions();
+    m->fflags |= raised & (FFLAG_NV | FFLAG_DZ);
+    return roundToFloat(m, roundedToOdd(result, raised), mode);
+}
+
+static uint32_t floatMultiplyAdd(Machine *m, uint32_t a, uint32_t b, uint32_t c, int negateProduct, int negateAddend, uint32_t mode)
+{
+    // Without a host FMA the product is computed in double precision, where it is exact, and the sum is rounded
+    // to odd. Only the invalid flag of these steps counts.
+    volatile float x = floatFromBits(a);
+    volatile float y = floatFromBits(b);
+    volatile float z = floatFromBits(c);
+    if (isSignalingNan(a) || isSignalingNan(b) || isSignalingNan(c))
+    {
+        m->fflags |= FFLAG_NV;
+    }
+    setHostRounding(FRM_RTZ);
+    volatile double product = (double)x * (double)y;
+    double addend = negateAddend ? -(double)z : (double)z;
+    volatile double sum = (negateProduct ? -product : product) + addend;
+    uint32_t raised = hostExceptions();
+    m->fflags |= raised & FFLAG_NV;
+
+    double odd = roundedToOdd(sum, raised);
+    if (odd == 0 && !(raised & FFLAG_NX) && mode == FRM_RDN)
+    {
+        // An exact zero sum of opposite values is -0 when rounding down
+        setHostRounding(FRM_RDN);
+        volatile double exact = (negateProduct ? -product : product) + addend;
+        odd = exact;
+    }
+    return roundToFloat(m, odd, mode);
+}
+
+static uint32_t floatToInteger(Machine *m, uint32_t bits, int isUnsigned, uint32_t mode)
+{
+    // Rounded in integer arithmetic, which supports every rounding mode. NaN and values out of range give the
+    // nearest representable integer (the largest one for NaN) and raise the invalid flag instead of inexact.
+    int64_t minimum = isUnsigned ? 0 : INT32_MIN;
+    int64_t maximum = isUnsigned ? UINT32_MAX : INT32_MAX;
+    if (isNan(bits))
+    {
+        m->fflags |= FFLAG_NV;
+        return (uint32_t)maximum;
+    }
+    double value = floatFromBits(bits);
+    if (value <= -0x1p33 || value >= 0x1p33)
+    {
+        m->fflags |= FFLAG_NV;
+        return (uint32_t)(value < 0 ? minimum : maximum);
+    }
+
+    int64_t integer = (int64_t)value;
+    double fraction = value - (double)integer;
+    switch (mode)
+    {
+    case FRM_RNE:
+        integer += (fraction > 0.5 || (fraction == 0.5 && (integer & 1))) - (fraction < -0.5 || (fraction == -0.5 && (integer & 1)));
+        break;
+    case FRM_RDN:
+        integer -= fraction < 0;
+        break;
+    case FRM_RUP:
+        integer += fraction > 0;
+        break;
+    case FRM_RMM:
+        integer += (fraction >= 0.5) - (fraction <= -0.5);
+        break;
+    default:
+        break;
+    }
+
+    if (integer < minimum || integer > maximum)
+    {
+        m->fflags |= FFLAG_NV;
+        return (uint32_t)(integer < minimum ? minimum : maximum);
+    }
+    if (fraction != 0)
+    {
+        m->fflags |= FFLAG_NX;
+    }
+    return (uint32_t)integer;
+}
+
+static uint32_t integerToFloat(Machine *m, uint32_t value, int isUnsigned, uint32_t mode)
+{
+    // Every 32-bit integer is exact as a double
+    return roundToFloat(m, isUnsigned ? (double)value : (double)(int32_t)value, mode);
+}
+
+static uint32_t floatMinimumMaximum(Machine *m, uint32_t a, uint32_t b, int isMaximum)
+{
+    // A NaN operand gives the other operand, only two NaNs give NaN. -0 is less than +0.
+    if (isSignalingNan(a) || isSignalingNan(b))
+    {
+        m->fflags |= FFLAG_NV;
+    }
+    if (isNan(a) || isNan(b))
+    {
+        return isNan(a) && isNan(b) ? CANONICAL_NAN : isNan(a) ? b : a;
+    }
+    float x = floatFromBits(a);
+    float y = floatFromBits(b);
+    int aIsLess = x < y || (x == y && (a & 0x80000000));
+    return aIsLess != isMaximum ? a : b;
+}
+
+static uint32_t floatCompare(Machine *m, int operation, uint32_t a, uint32_t b)
+{
+    // FEQ is a quiet comparison, only signaling NaNs are invalid. For FLT and FLE any NaN is.
+    if (isNan(a) || isNan(b))
+    {
+        if (operation != OP_FEQ_S || isSignalingNan(a) || isSignalingNan(b))
+        {
+            m->fflags |= FFLAG_NV;
+        }
+        return 0;
+    }
+    float x = floatFromBits(a);
+    float y = floatFromBits(b);
+    return operation == OP_FEQ_S ? x == y : operation == OP_FLT_S ? x < y : x <= y;
+}
+
+static uint32_t floatClass(uint32_t bits)
+{
+    // One bit for each of: -inf, negative normal, negative subnormal, -0, +0, positive subnormal,
+    // positive normal, +inf, signaling NaN and quiet NaN
+    uint32_t negative = bits >> 31;
+    uint32_t exponent = (bits >> 23) & 0xFF;
+    uint32_t fraction = bits & 0x7FFFFF;
+    if (exponent == 0xFF)
+    {
+        return fraction == 0 ? (negative ? 1 << 0 : 1 << 7) : (fraction & 0x400000) ? 1 << 9 : 1 << 8;
+    }
+    if (exponent == 0)
+    {
+        return fraction == 0 ? (negative ? 1 << 3 : 1 << 4) : (negative ? 1 << 2 : 1 << 5);
+    }
+    return negative ? 1 << 1 : 1 << 6;
+}
+
+int executeFloat(Machine *m, const DecodedInstruction *d)
+{
+    // Executes an instruction of the F extension for every engine. If it faults, because its access is outside
+    // memory or its rounding mode is reserved, it returns 0 without changing anything and the caller reports it.
+    uint32_t *f = m->floatRegisters;
+    switch (d->operation)
+    {
+    case OP_FLW:
+    {
+        uint32_t address = m->registers[d->rs1] + d->imm;
+        uint32_t value;
+        if (!OUTSIDE_MEMORY(address, 4))
+        {
+            value = loadWord(m, address);
+        }
+        else if (!loadOutside(m, address, 4, &value))
+        {
+            return 0;
+        }
+        f[d->rd] = value;
+        return 1;
+    }
+    case OP_FSW:
+    {
+        uint32_t address = m->registers[d->rs1] + d->imm;
+        if (!OUTSIDE_MEMORY(address, 4))
+        {
+            storeWord(m, address, f[d->rs2]);
+        }
+        else if (!storeOutside(m, address, 4, f[d->rs2]))
+        {
+            return 0;
+        }
+        if (address < m->programSize)
+        {
+            invalidateDecodedInstructions(m, address, 4);
+        }
+        return 1;
+    }
+    case OP_FSGNJ_S:
+        f[d->rd] = (f[d->rs1] & 0x7FFFFFFF) | (f[d->rs2] & 0x80000000);
+        return 1;
+    case OP_FSGNJN_S:
+        f[d->rd] = (f[d->rs1] & 0x7FFFFFFF) | (~f[d->rs2] & 0x80000000);
+        return 1;
+    case OP_FSGNJX_S:
+        f[d->rd] = f[d->rs1] ^ (f[d->rs2] & 0x80000000);
+        return 1;
+    case OP_FMIN_S:
+    case OP_FMAX_S:
+        f[d->rd] = floatMinimumMaximum(m, f[d->rs1], f[d->rs2], d->operation == OP_FMAX_S);
+        return 1;
+    case OP_FMV_X_W:
+        writeRegister(m, d->rd, f[d->rs1]);
+        return 1;
+    case OP_FMV_W_X:
+        f[d->rd] = m->registers[d->rs1];
+        return 1;
+    case OP_FEQ_S:
+    case OP_FLT_S:
+    case OP_FLE_S:
+        writeRegister(m, d->rd, floatCompare(m, d->operation, f[d->rs1], f[d->rs2]));
+        return 1;
+    case OP_FCLASS_S:
+        writeRegister(m, d->rd, floatClass(f[d->rs1]));
+        return 1;
+    default:
+        break;
+    }
+
+    // The remaining operations round, in the mode of the lowest 3 bits of imm or in frm
+    uint32_t mode = d->imm & 0x7;
+    if (mode == FRM_DYNAMIC)
+    {
+        mode = m->frm;
+    }
+    if (mode > FRM_RMM)
+    {
+        return 0;
+    }
+
+    switch (d->operation)
+    {
+    case OP_FMADD_S:
+    case OP_FMSUB_S:
+    case OP_FNMSUB_S:
+    case OP_FNMADD_S:
+        f[d->rd] = floatMultiplyAdd(m, f[d->rs1], f[d->rs2], f[d->imm >> 3], d->operation == OP_FNMSUB_S || d->operation == OP_FNMADD_S,
+                                    d->operation == OP_FMSUB_S || d->operation == OP_FNMADD_S, mode);
+        break;
+    case OP_FCVT_W_S:
+    case OP_FCVT_WU_S:
+        writeRegister(m, d->rd, floatToInteger(m, f[d->rs1], d->operation == OP_FCVT_WU_S, mode));
+        break;
+    case OP_FCVT_S_W:
+    case OP_FCVT_S_WU:
+        f[d->rd] = integerToFloat(m, m->registers[d->rs1], d->operation == OP_FCVT_S_WU, mode);
+        break;
+    default:
+        f[d->rd] = floatArithmetic(m, d->operation, f[d->rs1], f[d->rs2], mode);
+        break;
+    }
+    return 1;
+}
+
+// The operations of the fast engines, written once and expanded in each engine. They use d for the
+// decoded instruction, RS1/RS2 for the source register values and CURRENT_PC for its address.
+
+// Operations that only write rd, as X(operation, result)
+#define REGISTER_OPERATIONS(X)                          \
+    X(OP_ADD, RS1 + RS2)                                \
+    X(OP_SUB, RS1 - RS2)                                \
+    X(OP_SLL, RS1 << (RS2 & 0x1F))                      \
+    X(OP_SLT, ((int32_t)RS1 < (int32_t)RS2) ? 1 : 0)    \
+    X(OP_SLTU, (RS1 < RS2) ? 1 : 0)                     \
+    X(OP_XOR, RS1 ^ RS2)                                \
+    X(OP_SRL, RS1 >> (RS2 & 0x1F))                      \
+    X(OP_SRA, (int32_t)RS1 >> (RS2 & 0x1F))             \
+    X(OP_OR, RS1 | RS2)                                 \
+    X(OP_AND, RS1 & RS2)                                \
+    X(OP_MUL, RS1 * RS2)                                \
+    X(OP_MULH, multiplyHigh(RS1, RS2))                  \
+    X(OP_MULHSU, multiplyHighSignedUnsigned(RS1, RS2))  \
+    X(OP_MULHU, multiplyHighUnsigned(RS1, RS2))         \
+    X(OP_DIV, divideSigned(RS1, RS2))                   \
+    X(OP_DIVU, divideUnsigned(RS1, RS2))                \
+    X(OP_REM, remainderSigned(RS1, RS2))                \
+    X(OP_REMU, remainderUnsigned(RS1, RS2))             \
+    X(OP_ADDI, RS1 + d->imm)                            \
+    X(OP_SLLI, RS1 << d->imm)                           \
+    X(OP_SLTI, ((int32_t)RS1 < d->imm) ? 1 : 0)         \
+    X(OP_SLTIU, (RS1 < (uint32_t)d->imm) ? 1 : 0)       \
+    X(OP_XORI, RS1 ^ d->imm)                            \
+    X(OP_SRLI, RS1 >> d->imm)                           \
+    X(OP_SRAI, (int32_t)RS1 >> d->imm)                  \
+    X(OP_ORI, RS1 | d->imm)                             \
+    X(OP_ANDI, RS1 & d->imm)                            \
+    X(OP_LUI, d->imm)                                   \
+    X(OP_AUIPC, CURRENT_PC + d->imm)
+
+// Loads from address = RS1 + imm into rd, as X(operation, width, result) with the zero-extended value
+#define LOAD_OPERATIONS(X)                            \
+    X(OP_LB, 1, (int8_t)value)                        \
+    X(OP_LH, 2, (int16_t)value)                       \
+    X(OP_LW, 4, value)                                \
+    X(OP_LBU, 1, value)                               \
+    X(OP_LHU, 2, value)
+
+// Stores of RS2 to address = RS1 + imm, as X(operation, width)
+#define STORE_OPERATIONS(X)                           \
+    X(OP_SB, 1)                                       \
+    X(OP_SH, 2)                                       \
+    X(OP_SW, 4)
+
+// Conditional branches to CURRENT_PC + imm, as X(operation, condition)
+#define BRANCH_OPERATIONS(X)                          \
+    X(OP_BEQ, RS1 == RS2)                             \
+    X(OP_BNE, RS1 != RS2)                             \
+    X(OP_BLT, (int32_t)RS1 < (int32_t)RS2)            \
+    X(OP_BGE, (int32_t)RS1 >= (int32_t)RS2)           \
+    X(OP_BLTU, RS1 < RS2)                             \
+    X(OP_BGEU, RS1 >= RS2)
+
+// Writes to x0 are undone right away instead of checking the register number first
+#define WRITE(reg, result)         \
+    do                             \
+    {                              \
+        m->registers[reg] = (result); \
+        m->registers[0] = 0;          \
+    } while (0)
+#define RS1 m->registers[d->rs1]
+#define RS2 m->registers[d->rs2]
+
+// The fast engines jump straight from one instruction's code to the next with GCC's labels as
+// values. Other compilers, or building with -DNO_COMPUTED_GOTO, use a single switch instead.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+
+#if THREADED_DISPATCH
+#define TARGET(operation) target_##operation
+#else
+#define TARGET(operation) case operation
+#endif
+
+void runThreaded(Machine *m)
+{
+    uint32_t pc = m->programCounter;
+    uint64_t executed = 0;
+    uint64_t limit = m->stopAt - m->stats.instructionsExecuted; // Checked at jumps, so loops cannot run past it
+    const DecodedInstruction *d;
+
+#define CURRENT_PC pc
+
+#if THREADED_DISPATCH
+    // Code executing each operation, indexed by the operation number
+    static const void *operationTargets[OPERATION_COUNT] = {
+#define X(operation, ...) [operation] = &&target_##operation,
+        REGISTER_OPERATIONS(X) LOAD_OPERATIONS(X) STORE_OPERATIONS(X) BRANCH_OPERATIONS(X) FLOAT_OPERATIONS(X)
+#undef X
+        [OP_JAL] = &&target_OP_JAL,
+        [OP_JALR] = &&target_OP_JALR,
+        [OP_ECALL] = &&target_OP_ECALL,
+#define X(operation, ...) [operation] = &&target_OP_UNKNOWN,
+        ATOMIC_OPERATIONS(X) CSR_OPERATIONS(X)
+#undef X
+        [OP_FENCE] = &&target_OP_UNKNOWN,
+        [OP_FENCE_I] = &&target_OP_UNKNOWN,
+        [OP_UNKNOWN] = &&target_OP_UNKNOWN};
+
+    // The same for compressed instructions, which have their own copy of the operations that fall through
+    static const void *compressedTargets[OPERATION_COUNT] = {
+#define X(operation, ...) [operation] = &&compressed_##operation,
+        REGISTER_OPERATIONS(X) LOAD_OPERATIONS(X) STORE_OPERATIONS(X) FLOAT_OPERATIONS(X)
+#undef X
+#define X(operation, ...) [operation] = &&target_##operation,
+        BRANCH_OPERATIONS(X)
+#undef X
+        [OP_JAL] = &&target_OP_JAL,
+        [OP_JALR] = &&target_OP_JALR,
+        [OP_ECALL] = &&target_OP_ECALL,
+#define X(operation, ...) [operation] = &&target_OP_UNKNOWN,
+        ATOMIC_OPERATIONS(X) CSR_OPERATIONS(X)
+#undef X
+        [OP_FENCE] = &&target_OP_UNKNOWN,
+        [OP_FENCE_I] = &&target_OP_UNKNOWN,
+        [OP_UNKNOWN] = &&target_OP_UNKNOWN};
+
+    // Translate the program into a table with the code address of every instruction. Entries start
+    // out pointing at the translator, and the entry after the last instruction ends the engine.
+    if (!m->threadedTargets)
+    {
+        m->threadedTargets = malloc((m->programSize / 2 + 1) * sizeof(const void *));
+        if (!m->threadedTargets)
+        {
+            fprintf(m->output, "Error: Could not allocate the threaded code table\n");
+            return;
+        }
+        m->threadedTranslateTarget = &&translate;
+        for (uint32_t halfword = 0; halfword < m->programSize / 2; halfword++)
+        {
+            m->threadedTargets[halfword] = &&translate;
+        }
+        m->threadedTargets[m->programSize / 2] = &&endOfProgram;
+    }
+
+    // Falling through to the next instruction can only reach the end marker, so only jumps are checked
+#define DISPATCH()                        \
+    do                                    \
+    {                                     \
+        d = &m->decodeCache[pc / 2];      \
+        executed++;                       \
+        goto *m->threadedTargets[pc / 2]; \
+    } while (0)
+#define NEXT(length)  \
+    do                \
+    {                 \
+        pc += length; \
+        DISPATCH();   \
+    } while (0)
+    // Operations that fall through exist once per instruction length, so the program counter advances by a
+    // constant. Advancing by d->length would put a load between one instruction and the next.
+#define FALL_THROUGH(operation, ...)            \
+    TARGET(operation) : __VA_ARGS__ NEXT(4);    \
+    compressed_##operation : __VA_ARGS__ NEXT(2);
+#define JUMP(target)                                                                          \
+    do                                                                                        \
+    {                                                                                         \
+        pc = (target);                                                                        \
+        if (m->programSize < 2 || pc > m->programSize - 2 || (pc & 0x1) || executed >= limit) \
+        {                                                                                     \
+            goto leave;                                                                       \
+        }                                                                                     \
+        DISPATCH();                                                                           \
+    } while (0)
+
+    JUMP(pc);
+
+translate:
+    // First execution of this address: decode it and point its table entry at the matching code. A 4-byte
+    // instruction cut off by the end of the program is left to the interpreter, which ends the program.
+    decodeInstruction(fetchInstruction(m, pc), (DecodedInstruction *)d);
+    if (pc + d->length > m->programSize)
+    {
+        executed--;
+        goto leave;
+    }
+    m->threadedTargets[pc / 2] = (d->length == 2 ? compressedTargets : operationTargets)[d->operation];
+    goto *m->threadedTargets[pc / 2];
+#else
+#define NEXT(length)   \
+    do                 \
+    {                  \
+        pc += length;  \
+        goto dispatch; \
+    } while (0)
+#define FALL_THROUGH(operation, ...) \
+    TARGET(operation) : __VA_ARGS__ NEXT(d->length);
+#define JUMP(target)   \
+    do                 \
+    {                  \
+        pc = (target); \
+        goto dispatch; \
+    } while (0)
+
+dispatch:
+    if (m->programSize < 2 || pc > m->programSize - 2 || (pc & 0x1) || executed >= limit)
+    {
+        goto leave;
+    }
+    d = &m->decodeCache[pc / 2];
+    if (d->handler == HANDLER_UNDECODED)
+    {
+        decodeInstruction(fetchInstruction(m, pc), (DecodedInstruction *)d);
+    }
+    if (pc + d->length > m->programSize)
+    {
+        goto leave;
+    }
+    executed++;
+
+    switch (d->operation)
+    {
+#endif
+
+#define X(operation, result) \
+    FALL_THROUGH(operation, WRITE(d->rd, result);)
+        REGISTER_OPERATIONS(X)
+#undef X
+
+        // Faulting accesses outside memory are left to the interpreter, which reports them
+#define X(operation, width, result)                              \
+    FALL_THROUGH(operation, {                                    \
+        uint32_t address = RS1 + d->imm;                         \
+        uint32_t value;                                          \
+        if (!OUTSIDE_MEMORY(address, width))                     \
+        {                                                        \
+            value = loadFlat(m, address, width);                 \
+        }                                                        \
+        else if (!loadOutside(m, address, width, &value))        \
+        {                                                        \
+            executed--;                                          \
+            goto leave;                                          \
+        }                                                        \
+        WRITE(d->rd, result);                                    \
+    })
+        LOAD_OPERATIONS(X)
+#undef X
+
+#define X(operation, width)                                      \
+    FALL_THROUGH(operation, {                                    \
+        uint32_t address = RS1 + d->imm;                         \
+        if (!OUTSIDE_MEMORY(address, width))                     \
+        {                                                        \
+            storeFlat(m, address, width, RS2);                   \
+        }                                                        \
+        else if (!storeOutside(m, address, width, RS2))          \
+        {                                                        \
+            executed--;                                          \
+            goto leave;                                          \
+        }                                                        \
+        if (address < m->programSize)                            \
+        {                                                        \
+            invalidateDecodedInstructions(m, address, width);    \
+        }                                                        \
+    })
+        STORE_OPERATIONS(X)
+#undef X
+
+        // Floating-point instructions run in place, one that faults is left to the interpreter, which reports it
+#define X(operation, name)                \
+    FALL_THROUGH(operation, {             \
+        if (!executeFloat(m, d))          \
+        {                                 \
+            executed--;                   \
+            goto leave;                   \
+        }                                 \
+    })
+        FLOAT_OPERATIONS(X)
+#undef X
+
+#define X(operation, condition) \
+    TARGET(operation):          \
+        JUMP((condition) ? pc + d->imm : pc + d->length);
+        BRANCH_OPERATIONS(X)
+#undef X
+
+    TARGET(OP_JAL):
+    {
+        uint32_t link = pc + d->length;
+        WRITE(d->rd, link);
+        JUMP(pc + d->imm);
+    }
+    TARGET(OP_JALR):
+    {
+        uint32_t jumpAddress = (RS1 + d->imm) & 0xFFFFFFFE;
+        WRITE(d->rd, pc + d->length);
+        JUMP(jumpAddress);
+    }
+
+    // E-calls, atomics, fences, CSR accesses and unrecognized instructions are left to the interpreter, which reports and handles them
+    TARGET(OP_ECALL):
+    TARGET(OP_UNKNOWN):
+        executed--;
+        goto leave;
+
+#if !THREADED_DISPATCH
+    default:
+        executed--;
+        goto leave;
+    }
+#else
+endOfProgram:
+    // Running past the last instruction, the end marker was counted but is not an instruction
+    executed--;
+#endif
+
+leave:
+    m->programCounter = pc;
+    m->stats.instructionsExecuted += executed;
+
+#undef CURRENT_PC
+#undef NEXT
+#undef FALL_THROUGH
+#undef JUMP
+#ifdef DISPATCH
+#undef DISPATCH
+#endif
+}
+
+void flushBlocks(Machine *m)
+{
+    // Throw away every translated block, they are built again from the current code when executed
+    for (uint32_t halfword = 0; halfword < m->programSize / 2; halfword++)
+    {
+        free(m->blockCache[halfword]);
+        m->blockCache[halfword] = NULL;
+    }
+    memset(m->blockHalfwords, 0, m->programSize / 2);
+    m->blocksStale = 0;
+
+#ifdef JIT_SUPPORTED
+    // The compiled code belonged to the blocks that were just freed
+    m->jitUsed = 0;
+#endif
+}
+
+void fuseInstructions(Machine *m, DecodedInstruction *code, uint32_t length)
+{
+    // Replace common instruction pairs by one superinstruction. The first instruction of the pair takes
+    // the fused operation and the second one keeps its fields, both are executed as one step.
+    for (uint32_t i = 0; i + 1 < length; i++)
+    {
+        DecodedInstruction *first = &code[i];
+        DecodedInstruction *second = &code[i + 1];
+
+        // Only pairs where the second instruction reads the first one's result are fused
+        if (first->rd == 0 || second->rs1 != first->rd)
+        {
+            continue;
+        }
+
+        if (first->operation == OP_LUI && second->operation == OP_ADDI)
+        {
+            // li/la of a 32-bit constant
+            first->operation = OP_LUI_ADDI;
+        }
+        else if (first->operation == OP_AUIPC && second->operation == OP_JALR)
+        {
+            // Far call or tail call
+            first->operation = OP_AUIPC_JALR;
+        }
+        else if ((first->operation == OP_SLT || first->operation == OP_SLTU) && second->rs2 == 0 &&
+                 (second->operation == OP_BNE || second->operation == OP_BEQ))
+        {
+            // Compare and branch on the result
+            if (first->operation == OP_SLT)
+            {
+                first->operation = (second->operation == OP_BNE) ? OP_SLT_BNE : OP_SLT_BEQ;
+            }
+            else
+            {
+                first->operation = (second->operation == OP_BNE) ? OP_SLTU_BNE : OP_SLTU_BEQ;
+            }
+        }
+        else
+        {
+            continue;
+        }
+
+        m->stats.fusedPairs++;
+        i++;
+    }
+}
+
+BasicBlock *buildBlock(Machine *m, uint32_t startPc)
+{
+    // Collect straight-line code up to and including the next branch or jump
+    DecodedInstruction code[MAX_BLOCK_LENGTH];
+    uint32_t length = 0;
+    uint32_t pc = startPc;
+
+    while (length < MAX_BLOCK_LENGTH && pc <= m->programSize - 2)
+    {
+        DecodedInstruction *decoded = &m->decodeCache[pc / 2];
+        if (decoded->handler == HANDLER_UNDECODED)
+        {
+            decodeInstruction(fetchInstruction(m, pc), decoded);
+        }
+
+        // E-calls, atomics, fences, CSR accesses, unrecognized instructions and an instruction cut off by the end of
+        // the program are left to the interpreter
+        if (decoded->operation == OP_ECALL || decoded->operation == OP_UNKNOWN || decoded->handler == HANDLER_A ||
+            decoded->handler == HANDLER_CSR || decoded->handler == HANDLER_FENCE || pc + decoded->length > m->programSize)
+        {
+            break;
+        }
+
+        // Instructions can be 2 or 4 bytes long, so each one remembers where it is in the block
+        code[length] = *decoded;
+        code[length++].pcOffset = (uint16_t)(pc - startPc);
+        pc += decoded->length;
+        if (decoded->handler == HANDLER_B || decoded->handler == HANDLER_JAL || decoded->handler == HANDLER_JALR)
+        {
+            break;
+        }
+    }
+
+    if (length == 0)
+    {
+        return NULL;
+    }
+
+    fuseInstructions(m, code, length);
+
+    // The block ends with a marker that falls through to the instruction after the block
+    BasicBlock *block = malloc(sizeof(BasicBlock) + (length + 1) * sizeof(DecodedInstruction));
+    if (!block)
+    {
+        return NULL;
+    }
+    block->startPc = startPc;
+    block->length = length;
+    block->successor[0] = block->successor[1] = NULL;
+    block->successorPc[0] = block->successorPc[1] = 0;
+    block->executions = 0;
+    block->native = NULL;
+    memcpy(block->code, code, length * sizeof(DecodedInstruction));
+    memset(&block->code[length], 0, sizeof(DecodedInstruction));
+    block->code[length].operation = OP_BLOCK_END;
+    block->code[length].pcOffset = (uint16_t)(pc - startPc);
+
+    // Remember which halfwords are translated, so stores into them throw the blocks away
+    memset(&m->blockHalfwords[startPc / 2], 1, (pc - startPc) / 2);
+    m->blockCache[startPc / 2] = block;
+    m->stats.blocksTranslated++;
+    return block;
+}
+
+BasicBlock *findBlock(Machine *m, uint32_t pc)
+{
+    if (m->programSize < 2 || pc > m->programSize - 2 || (pc & 0x1))
+    {
+        return NULL;
+    }
+    if (m->blockCache[pc / 2])
+    {
+        return m->blockCache[pc / 2];
+    }
+    return buildBlock(m, pc);
+}
+
+#ifdef JIT_SUPPORTED
+// Host registers used by the generated code. rbx holds the address of the register file and r12 the
+// address of the simulated memory, both are callee-saved so they survive calls into the simulator.
+#define HOST_EAX 0
+#define HOST_ECX 1
+#define HOST_EDX 2
+
+// x86 condition codes for setcc, cmovcc and jcc
+#define CONDITION_B 0x2
+#define CONDITION_AE 0x3
+#define CONDITION_E 0x4
+#define CONDITION_NE 0x5
+#define CONDITION_L 0xC
+#define CONDITION_GE 0xD
+
+static void emit8(Machine *m, uint8_t byte)
+{
+    *m->jitCode++ = byte;
+}
+
+static void emit32(Machine *m, uint32_t value)
+{
+    memcpy(m->jitCode, &value, 4);
+    m->jitCode += 4;
+}
+
+static void emit64(Machine *m, uint64_t value)
+{
+    memcpy(m->jitCode, &value, 8);
+    m->jitCode += 8;
+}
+
+static int32_t registerOffset(uint32_t reg)
+{
+    return (int32_t)(reg * sizeof(uint32_t));
+}
+
+static void emitLoadRegister(Machine *m, int host, uint32_t reg)
+{
+    if (reg == 0)
+    {
+        // xor host, host
+        emit8(m, 0x31);
+        emit8(m, 0xC0 | (host << 3) | host);
+    }
+    else
+    {
+        // mov host, [rbx + offset]
+        emit8(m, 0x8B);
+        emit8(m, 0x83 | (host << 3));
+        emit32(m, registerOffset(reg));
+    }
+}
+
+static void emitStoreRegister(Machine *m, uint32_t reg, int host)
+{
+    // Writes to x0 are simply not generated
+    if (reg != 0)
+    {
+        // mov [rbx + offset], host
+        emit8(m, 0x89);
+        emit8(m, 0x83 | (host << 3));
+        emit32(m, registerOffset(reg));
+    }
+}
+
+static void emitStoreRegisterImmediate(Machine *m, uint32_t reg, uint32_t value)
+{
+    if (reg != 0)
+    {
+        // mov dword [rbx + offset], value
+        emit8(m, 0xC7);
+        emit8(m, 0x83);
+        emit32(m, registerOffset(reg));
+        emit32(m, value);
+    }
+}
+
+static void emitMoveImmediate(Machine *m, int host, uint32_t value)
+{
+    // mov host, value
+    emit8(m, 0xB8 + host);
+    emit32(m, value);
+}
+
+static void emitSetCondition(Machine *m, int condition)
+{
+    // setcc al; movzx eax, al
+    emit8(m, 0x0F);
+    emit8(m, 0x90 | condition);
+    emit8(m, 0xC0);
+    emit8(m, 0x0F);
+    emit8(m, 0xB6);
+    emit8(m, 0xC0);
+}
+
+static void emitReturn(Machine *m)
+{
+    // The next program counter is already in eax: add rsp, 8; pop r12; pop rbx; ret
+    emit8(m, 0x48);
+    emit8(m, 0x83);
+    emit8(m, 0xC4);
+    emit8(m, 0x08);
+    emit8(m, 0x41);
+    emit8(m, 0x5C);
+    emit8(m, 0x5B);
+    emit8(m, 0xC3);
+}
+
+static void emitConditionalReturn(Machine *m, int condition, uint32_t target, uint32_t fallThrough)
+{
+    // Flags are set by the caller: mov eax, fallThrough; mov edx, target; cmovcc eax, edx
+    emitMoveImmediate(m, HOST_EAX, fallThrough);
+    emitMoveImmediate(m, HOST_EDX, target);
+    emit8(m, 0x0F);
+    emit8(m, 0x40 | condition);
+    emit8(m, 0xC2);
+    emitReturn(m);
+}
+
+static int jitStoreToCode(Machine *m, uint32_t address, uint32_t width)
+{
+    // Called by compiled stores that hit the program image, tells the block to stop if it was changed
+    invalidateDecodedInstructions(m, address, width);
+    return m->blocksStale;
+}
+
+// Called by compiled loads and stores that are not inside the flat memory. They return the zero-extended
+// loaded value or 0 to continue, and bit 32 set with the pc to return at to leave the block.
+#define JIT_LEAVE (1ULL << 32)
+
+static uint64_t jitLoadOutside(Machine *m, uint32_t address, uint32_t width, uint32_t pc)
+{
+    uint32_t value;
+    if (!loadOutside(m, address, width, &value))
+    {
+        m->jitAccessFault = 1;
+        return JIT_LEAVE | pc;
+    }
+    return value;
+}
+
+static uint64_t jitStoreOutside(Machine *m, uint32_t address, uint32_t width, uint32_t value, uint32_t pc, uint32_t nextPc)
+{
+    if (!storeOutside(m, address, width, value))
+    {
+        m->jitAccessFault = 1;
+        return JIT_LEAVE | pc;
+    }
+    if (address < m->programSize && jitStoreToCode(m, address, width))
+    {
+        return JIT_LEAVE | nextPc;
+    }
+    return 0;
+}
+
+static uint64_t jitFloat(Machine *m, const DecodedInstruction *d, uint32_t pc, uint32_t nextPc)
+{
+    // Called by compiled floating-point instructions, which leave the block like loads and stores
+    if (!executeFloat(m, d))
+    {
+        m->jitAccessFault = 1;
+        return JIT_LEAVE | pc;
+    }
+    if (m->blocksStale)
+    {
+        return JIT_LEAVE | nextPc;
+    }
+    return 0;
+}
+
+static void emitMachineArgument(Machine *m)
+{
+    // The helpers called by compiled code get the machine as first argument: mov rdi, m
+    emit8(m, 0x48);
+    emit8(m, 0xBF);
+    emit64(m, (uint64_t)(uintptr_t)m);
+}
+
+static void emitMemoryAddress(Machine *m, const DecodedInstruction *d)
+{
+    // ecx = rs1 + imm
+    emitLoadRegister(m, HOST_ECX, d->rs1);
+    emit8(m, 0x81);
+    emit8(m, 0xC1);
+    emit32(m, d->imm);
+}
+
+static uint8_t *emitOutsideCheck(Machine *m, uint32_t width)
+{
+    // cmp ecx, memorySize - width; ja outside, returns the jump offset to fill in
+    emit8(m, 0x81);
+    emit8(m, 0xF9);
+    emit32(m, (uint32_t)(memorySize - width));
+    emit8(m, 0x77);
+    return m->jitCode++;
+}
+
+static void emitOutsideCall(Machine *m, void *helper)
+{
+    // The arguments are already in rdi, rsi, rdx, rcx, r8 and r9: mov rax, helper; call rax
+    // Leave the block if bit 32 of the result is set: mov rdx, rax; shr rdx, 32; jz continue; return; continue:
+    emit8(m, 0x48);
+    emit8(m, 0xB8);
+    emit64(m, (uint64_t)(uintptr_t)helper);
+    emit8(m, 0xFF);
+    emit8(m, 0xD0);
+    emit8(m, 0x48);
+    emit8(m, 0x89);
+    emit8(m, 0xC2);
+    emit8(m, 0x48);
+    emit8(m, 0xC1);
+    emit8(m, 0xEA);
+    emit8(m, 0x20);
+    emit8(m, 0x74);
+    emit8(m, 8);
+    emitReturn(m);
+}
+
+int compileBlock(Machine *m, BasicBlock *block)
+{
+    // Worst case size of the code of one instruction, the buffer is not extended in the middle of a block
+    size_t worstCase = 64 + 160 * (block->length + 1);
+    if (!m->jitBuffer || m->jitUsed + worstCase > JIT_BUFFER_SIZE)
+    {
+        return 0;
+    }
+
+    uint8_t *start = m->jitBuffer + m->jitUsed;
+    m->jitCode = start;
+
+    // push rbx; push r12; sub rsp, 8 (keeps the stack aligned for calls)
+    emit8(m, 0x53);
+    emit8(m, 0x41);
+    emit8(m, 0x54);
+    emit8(m, 0x48);
+    emit8(m, 0x83);
+    emit8(m, 0xEC);
+    emit8(m, 0x08);
+    // mov rbx, registers; mov r12, memory
+    emit8(m, 0x48);
+    emit8(m, 0xBB);
+    emit64(m, (uint64_t)(uintptr_t)&m->registers[0]);
+    emit8(m, 0x49);
+    emit8(m, 0xBC);
+    emit64(m, (uint64_t)(uintptr_t)m->memory);
+
+    for (const DecodedInstruction *d = block->code;; d++)
+    {
+        uint32_t pc = block->startPc + d->pcOffset;
+
+        switch (d->operation)
+        {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_XOR:
+        case OP_OR:
+        case OP_AND:
+        {
+            // op eax, ecx
+            static const uint8_t opcodes[OPERATION_COUNT] = {[OP_ADD] = 0x01, [OP_SUB] = 0x29, [OP_XOR] = 0x31, [OP_OR] = 0x09, [OP_AND] = 0x21};
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, opcodes[d->operation]);
+            emit8(m, 0xC8);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        }
+        case OP_SLL:
+        case OP_SRL:
+        case OP_SRA:
+            // shl/shr/sar eax, cl, x86 masks the shift amount to 5 bits like RISC-V
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0xD3);
+            emit8(m, d->operation == OP_SLL ? 0xE0 : d->operation == OP_SRL ? 0xE8 : 0xF8);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        case OP_MUL:
+            // imul eax, ecx
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0x0F);
+            emit8(m, 0xAF);
+            emit8(m, 0xC1);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        case OP_MULH:
+        case OP_MULHU:
+            // imul/mul ecx, the upper half of the product is in edx
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0xF7);
+            emit8(m, d->operation == OP_MULH ? 0xE9 : 0xE1);
+            emitStoreRegister(m, d->rd, HOST_EDX);
+            break;
+        case OP_MULHSU:
+            // movsxd rax, eax; imul rax, rcx (rcx is zero-extended by its load); shr rax, 32
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0x48);
+            emit8(m, 0x63);
+            emit8(m, 0xC0);
+            emit8(m, 0x48);
+            emit8(m, 0x0F);
+            emit8(m, 0xAF);
+            emit8(m, 0xC1);
+            emit8(m, 0x48);
+            emit8(m, 0xC1);
+            emit8(m, 0xE8);
+            emit8(m, 0x20);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        case OP_DIV:
+        case OP_DIVU:
+        case OP_REM:
+        case OP_REMU:
+        {
+            // The divisors that would make div/idiv trap are handled first:
+            // test ecx, ecx; jz zero; [signed: cmp ecx, -1; jne divide; neg eax or xor eax, eax; jmp done]
+            // divide: xor edx, edx; div ecx or cdq; idiv ecx; [remainder: mov eax, edx]; jmp done
+            // zero: [quotient: mov eax, -1, the remainder is the dividend already in eax]
+            int isSigned = d->operation == OP_DIV || d->operation == OP_REM;
+            int isRemainder = d->operation == OP_REM || d->operation == OP_REMU;
+            uint8_t *minusOne = NULL;
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0x85);
+            emit8(m, 0xC9);
+            emit8(m, 0x74);
+            uint8_t *zero = m->jitCode++;
+            if (isSigned)
+            {
+                // Dividing by -1 negates, which also gives INT_MIN for INT_MIN, and leaves no remainder
+                emit8(m, 0x83);
+                emit8(m, 0xF9);
+                emit8(m, 0xFF);
+                emit8(m, 0x75);
+                uint8_t *divide = m->jitCode++;
+                emit8(m, isRemainder ? 0x31 : 0xF7);
+                emit8(m, isRemainder ? 0xC0 : 0xD8);
+                emit8(m, 0xEB);
+                minusOne = m->jitCode++;
+                *divide = (uint8_t)(m->jitCode - divide - 1);
+                emit8(m, 0x99);
+                emit8(m, 0xF7);
+                emit8(m, 0xF9);
+            }
+            else
+            {
+                emit8(m, 0x31);
+                emit8(m, 0xD2);
+                emit8(m, 0xF7);
+                emit8(m, 0xF1);
+            }
+            if (isRemainder)
+            {
+                emit8(m, 0x89);
+                emit8(m, 0xD0);
+            }
+            emit8(m, 0xEB);
+            uint8_t *divided = m->jitCode++;
+            *zero = (uint8_t)(m->jitCode - zero - 1);
+            if (!isRemainder)
+            {
+                emitMoveImmediate(m, HOST_EAX, 0xFFFFFFFF);
+            }
+            *divided = (uint8_t)(m->jitCode - divided - 1);
+            if (minusOne)
+            {
+                *minusOne = (uint8_t)(m->jitCode - minusOne - 1);
+            }
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        }
+        case OP_SLT:
+        case OP_SLTU:
+            // cmp eax, ecx; setl/setb
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0x39);
+            emit8(m, 0xC8);
+            emitSetCondition(m, d->operation == OP_SLT ? CONDITION_L : CONDITION_B);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        case OP_ADDI:
+        case OP_XORI:
+        case OP_ORI:
+        case OP_ANDI:
+        {
+            // op eax, imm
+            static const uint8_t extensions[OPERATION_COUNT] = {[OP_ADDI] = 0, [OP_XORI] = 6, [OP_ORI] = 1, [OP_ANDI] = 4};
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emit8(m, 0x81);
+            emit8(m, 0xC0 | (extensions[d->operation] << 3));
+            emit32(m, d->imm);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        }
+        case OP_SLTI:
+        case OP_SLTIU:
+            // cmp eax, imm; setl/setb
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emit8(m, 0x81);
+            emit8(m, 0xF8);
+            emit32(m, d->imm);
+            emitSetCondition(m, d->operation == OP_SLTI ? CONDITION_L : CONDITION_B);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        case OP_SLLI:
+        case OP_SRLI:
+        case OP_SRAI:
+            // shl/shr/sar eax, imm
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emit8(m, 0xC1);
+            emit8(m, d->operation == OP_SLLI ? 0xE0 : d->operation == OP_SRLI ? 0xE8 : 0xF8);
+            emit8(m, (uint8_t)d->imm);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        case OP_LUI:
+            emitStoreRegisterImmediate(m, d->rd, d->imm);
+            break;
+        case OP_AUIPC:
+            emitStoreRegisterImmediate(m, d->rd, pc + d->imm);
+            break;
+
+        case OP_LB:
+        case OP_LH:
+        case OP_LW:
+        case OP_LBU:
+        case OP_LHU:
+        {
+            // movsx/movzx/mov eax, [r12 + rcx]; jmp loaded
+            static const uint8_t opcodes[OPERATION_COUNT] = {[OP_LB] = 0xBE, [OP_LH] = 0xBF, [OP_LBU] = 0xB6, [OP_LHU] = 0xB7};
+            static const uint8_t widths[OPERATION_COUNT] = {[OP_LB] = 1, [OP_LH] = 2, [OP_LW] = 4, [OP_LBU] = 1, [OP_LHU] = 2};
+            emitMemoryAddress(m, d);
+            uint8_t *outside = emitOutsideCheck(m, widths[d->operation]);
+            emit8(m, 0x41);
+            if (d->operation == OP_LW)
+            {
+                emit8(m, 0x8B);
+            }
+            else
+            {
+                emit8(m, 0x0F);
+                emit8(m, opcodes[d->operation]);
+            }
+            emit8(m, 0x04);
+            emit8(m, 0x0C);
+            emit8(m, 0xEB);
+            uint8_t *loaded = m->jitCode++;
+
+            // outside: mov rdi, m; mov esi, ecx; mov edx, width; mov ecx, pc; call jitLoadOutside; movsx eax, al/ax for LB/LH
+            *outside = (uint8_t)(m->jitCode - outside - 1);
+            emitMachineArgument(m);
+            emit8(m, 0x89);
+            emit8(m, 0xCE);
+            emitMoveImmediate(m, HOST_EDX, widths[d->operation]);
+            emitMoveImmediate(m, HOST_ECX, pc);
+            emitOutsideCall(m, (void *)&jitLoadOutside);
+            if (d->operation == OP_LB || d->operation == OP_LH)
+            {
+                emit8(m, 0x0F);
+                emit8(m, opcodes[d->operation]);
+                emit8(m, 0xC0);
+            }
+
+            *loaded = (uint8_t)(m->jitCode - loaded - 1);
+            emitStoreRegister(m, d->rd, HOST_EAX);
+            break;
+        }
+
+        case OP_SB:
+        case OP_SH:
+        case OP_SW:
+        {
+            // mov [r12 + rcx], al/ax/eax
+            uint32_t width = d->operation == OP_SB ? 1 : d->operation == OP_SH ? 2 : 4;
+            emitMemoryAddress(m, d);
+            emitLoadRegister(m, HOST_EAX, d->rs2);
+            uint8_t *outside = emitOutsideCheck(m, width);
+            if (d->operation == OP_SH)
+            {
+                emit8(m, 0x66);
+            }
+            emit8(m, 0x41);
+            emit8(m, d->operation == OP_SB ? 0x88 : 0x89);
+            emit8(m, 0x04);
+            emit8(m, 0x0C);
+
+            // Stores into the program image call back into the simulator, and return if code was changed:
+            // cmp ecx, programSize; jae stored; mov rdi, m; mov esi, ecx; mov edx, width; mov rax, jitStoreToCode; call rax
+            // test eax, eax; jz stored; mov eax, next pc; return
+            emit8(m, 0x81);
+            emit8(m, 0xF9);
+            emit32(m, m->programSize);
+            emit8(m, 0x73);
+            uint8_t *storedFromCompare = m->jitCode++;
+            emitMachineArgument(m);
+            emit8(m, 0x89);
+            emit8(m, 0xCE);
+            emitMoveImmediate(m, HOST_EDX, width);
+            emit8(m, 0x48);
+            emit8(m, 0xB8);
+            emit64(m, (uint64_t)(uintptr_t)&jitStoreToCode);
+            emit8(m, 0xFF);
+            emit8(m, 0xD0);
+            emit8(m, 0x85);
+            emit8(m, 0xC0);
+            emit8(m, 0x74);
+            uint8_t *storedFromTest = m->jitCode++;
+            emitMoveImmediate(m, HOST_EAX, pc + d->length);
+            emitReturn(m);
+
+            // outside: mov rdi, m; mov esi, ecx; mov edx, width; mov ecx, eax; mov r8d, pc; mov r9d, next pc;
+            // call jitStoreOutside
+            *outside = (uint8_t)(m->jitCode - outside - 1);
+            emitMachineArgument(m);
+            emit8(m, 0x89);
+            emit8(m, 0xCE);
+            emitMoveImmediate(m, HOST_EDX, width);
+            emit8(m, 0x89);
+            emit8(m, 0xC1);
+            emit8(m, 0x41);
+            emitMoveImmediate(m, 0, pc);
+            emit8(m, 0x41);
+            emitMoveImmediate(m, 1, pc + d->length);
+            emitOutsideCall(m, (void *)&jitStoreOutside);
+
+            // stored:
+            *storedFromCompare = (uint8_t)(m->jitCode - storedFromCompare - 1);
+            *storedFromTest = (uint8_t)(m->jitCode - storedFromTest - 1);
+            break;
+        }
+
+#define X(operation, name) case operation:
+        FLOAT_OPERATIONS(X)
+#undef X
+            // Floating-point instructions call the simulator with the decoded instruction:
+            // mov rdi, m; mov rsi, d; mov edx, pc; mov ecx, next pc; call jitFloat
+            emitMachineArgument(m);
+            emit8(m, 0x48);
+            emit8(m, 0xBE);
+            emit64(m, (uint64_t)(uintptr_t)d);
+            emitMoveImmediate(m, HOST_EDX, pc);
+            emitMoveImmediate(m, HOST_ECX, pc + d->length);
+            emitOutsideCall(m, (void *)&jitFloat);
+            break;
+
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLTU:
+        case OP_BGEU:
+        {
+            static const uint8_t conditions[OPERATION_COUNT] = {[OP_BEQ] = CONDITION_E, [OP_BNE] = CONDITION_NE, [OP_BLT] = CONDITION_L, [OP_BGE] = CONDITION_GE, [OP_BLTU] = CONDITION_B, [OP_BGEU] = CONDITION_AE};
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0x39);
+            emit8(m, 0xC8);
+            emitConditionalReturn(m, conditions[d->operation], pc + d->imm, pc + d->length);
+            goto compiled;
+        }
+        case OP_JAL:
+            emitStoreRegisterImmediate(m, d->rd, pc + d->length);
+            emitMoveImmediate(m, HOST_EAX, pc + d->imm);
+            emitReturn(m);
+            goto compiled;
+        case OP_JALR:
+            // eax = (rs1 + imm) & ~1, read before rd is written
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emit8(m, 0x81);
+            emit8(m, 0xC0);
+            emit32(m, d->imm);
+            emit8(m, 0x83);
+            emit8(m, 0xE0);
+            emit8(m, 0xFE);
+            emitStoreRegisterImmediate(m, d->rd, pc + d->length);
+            emitReturn(m);
+            goto compiled;
+
+        case OP_LUI_ADDI:
+            emitStoreRegisterImmediate(m, d[0].rd, d[0].imm);
+            emitStoreRegisterImmediate(m, d[1].rd, d[0].imm + d[1].imm);
+            d++;
+            break;
+        case OP_AUIPC_JALR:
+        {
+            uint32_t base = pc + d[0].imm;
+            emitStoreRegisterImmediate(m, d[0].rd, base);
+            emitStoreRegisterImmediate(m, d[1].rd, block->startPc + d[1].pcOffset + d[1].length);
+            emitMoveImmediate(m, HOST_EAX, (base + d[1].imm) & 0xFFFFFFFE);
+            emitReturn(m);
+            goto compiled;
+        }
+        case OP_SLT_BNE:
+        case OP_SLT_BEQ:
+        case OP_SLTU_BNE:
+        case OP_SLTU_BEQ:
+        {
+            int isSigned = d->operation == OP_SLT_BNE || d->operation == OP_SLT_BEQ;
+            int branchIfSet = d->operation == OP_SLT_BNE || d->operation == OP_SLTU_BNE;
+            emitLoadRegister(m, HOST_EAX, d->rs1);
+            emitLoadRegister(m, HOST_ECX, d->rs2);
+            emit8(m, 0x39);
+            emit8(m, 0xC8);
+            emitSetCondition(m, isSigned ? CONDITION_L : CONDITION_B);
+            emitStoreRegister(m, d[0].rd, HOST_EAX);
+            // test eax, eax
+            emit8(m, 0x85);
+            emit8(m, 0xC0);
+            uint32_t secondPc = block->startPc + d[1].pcOffset;
+            emitConditionalReturn(m, branchIfSet ? CONDITION_NE : CONDITION_E, secondPc + d[1].imm, secondPc + d[1].length);
+            goto compiled;
+        }
+
+        case OP_BLOCK_END:
+            emitMoveImmediate(m, HOST_EAX, pc);
+            emitReturn(m);
+            goto compiled;
+
+        default:
+            // Anything else is not supported, the block keeps running in the block engine
+            return 0;
+        }
+    }
+
+compiled:
+    m->jitUsed += m->jitCode - start;
+    block->native = (JitBlockFunction)start;
+    m->stats.blocksCompiled++;
+    return 1;
+}
+
+void initializeJit(Machine *m)
+{
+    // One executable buffer for all compiled blocks, if the system refuses the JIT is simply not used
+    void *buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        printf("Warning: Could not allocate executable memory, running without the JIT.\n");
+        return;
+    }
+    m->jitBuffer = buffer;
+}
+#endif
+
+void runBlocks(Machine *m)
+{
+    uint32_t pc = m->programCounter;
+    uint64_t executed = 0;
+    uint64_t limit = m->stopAt - m->stats.instructionsExecuted; // Checked between blocks
+    const DecodedInstruction *d;
+
+    if (!m->blockCache)
+    {
+        m->blockCache = calloc(m->programSize / 2 + 1, sizeof(BasicBlock *));
+        m->blockHalfwords = calloc(m->programSize / 2 + 1, 1);
+        if (!m->blockCache || !m->blockHalfwords)
+        {
+            fprintf(m->output, "Error: Could not allocate the block cache\n");
+            return;
+        }
+    }
+
+    // Blocks are only thrown away here, never while one of them is running
+    if (m->blocksStale)
+    {
+        flushBlocks(m);
+    }
+
+    BasicBlock *block = findBlock(m, pc);
+    if (!block)
+    {
+        return;
+    }
+
+    // Address of the instruction d in the running block
+#define CURRENT_PC (block->startPc + d->pcOffset)
+    // Leave the block towards target after executing its instructions up to and including d + extra
+#define EXIT_BLOCK(target, extra)                                   \
+    do                                                              \
+    {                                                               \
+        pc = (target);                                              \
+        executed += (uint32_t)(d - block->code) + 1 + (extra);      \
+        goto blockExit;                                             \
+    } while (0)
+    // Leave the engine before d, so the interpreter executes it and reports its access fault
+#define LEAVE_BEFORE_CURRENT()                   \
+    do                                           \
+    {                                            \
+        pc = CURRENT_PC;                         \
+        executed += (uint32_t)(d - block->code); \
+        goto leave;                              \
+    } while (0)
+
+#if THREADED_DISPATCH
+    static const void *operationTargets[OPERATION_COUNT] = {
+#define X(operation, ...) [operation] = &&target_##operation,
+        REGISTER_OPERATIONS(X) LOAD_OPERATIONS(X) STORE_OPERATIONS(X) BRANCH_OPERATIONS(X)
+#undef X
+        [OP_JAL] = &&target_OP_JAL,
+        [OP_JALR] = &&target_OP_JALR,
+        [OP_LUI_ADDI] = &&target_OP_LUI_ADDI,
+        [OP_AUIPC_JALR] = &&target_OP_AUIPC_JALR,
+        [OP_SLT_BNE] = &&target_OP_SLT_BNE,
+        [OP_SLT_BEQ] = &&target_OP_SLT_BEQ,
+        [OP_SLTU_BNE] = &&target_OP_SLTU_BNE,
+        [OP_SLTU_BEQ] = &&target_OP_SLTU_BEQ,
+#define X(operation, ...) [operation] = &&target_##operation,
+        FLOAT_OPERATIONS(X)
+#undef X
+        [OP_BLOCK_END] = &&target_OP_BLOCK_END};
+
+#define DISPATCH() goto *operationTargets[d->operation]
+#else
+#define DISPATCH() goto dispatch
+#endif
+
+    while (1)
+    {
+#ifdef JIT_SUPPORTED
+        // Hot blocks are compiled once they ran often enough, compiled blocks run as host code
+        if (block->native || (engine == ENGINE_JIT && ++block->executions == JIT_THRESHOLD && compileBlock(m, block)))
+        {
+            pc = block->native();
+            if (m->blocksStale || m->jitAccessFault)
+            {
+                // A store changed translated code and the block returned right after that store, or the block
+                // returned at an access outside memory, which the interpreter then executes and reports
+                for (d = block->code; d->operation != OP_BLOCK_END && block->startPc + d->pcOffset < pc; d++)
+                {
+                    executed++;
+                }
+                m->jitAccessFault = 0;
+                goto leave;
+            }
+            executed += block->length;
+            goto blockExit;
+        }
+#endif
+
+        d = block->code;
+
+#if THREADED_DISPATCH
+        DISPATCH();
+#else
+    dispatch:
+        switch (d->operation)
+        {
+#endif
+
+#define X(operation, result)  \
+    TARGET(operation):        \
+        WRITE(d->rd, result); \
+        d++;                  \
+        DISPATCH();
+        REGISTER_OPERATIONS(X)
+#undef X
+
+#define X(operation, width, result)                    \
+    TARGET(operation):                                 \
+    {                                                  \
+        uint32_t address = RS1 + d->imm;               \
+        uint32_t value;                                \
+        if (!OUTSIDE_MEMORY(address, width))           \
+        {                                              \
+            value = loadFlat(m, address, width);          \
+        }                                              \
+        else if (!loadOutside(m, address, width, &value)) \
+        {                                              \
+            LEAVE_BEFORE_CURRENT();                    \
+        }                                              \
+        WRITE(d->rd, result);                          \
+        d++;                                           \
+        DISPATCH();                                    \
+    }
+        LOAD_OPERATIONS(X)
+#undef X
+
+        // A store into a translated block ends the block right after the store
+#define X(operation, width)                                    \
+    TARGET(operation):                                         \
+    {                                                          \
+        uint32_t address = RS1 + d->imm;                       \
+        if (!OUTSIDE_MEMORY(address, width))                   \
+        {                                                      \
+            storeFlat(m, address, width, RS2);                    \
+        }                                                      \
+        else if (!storeOutside(m, address, width, RS2))           \
+        {                                                      \
+            LEAVE_BEFORE_CURRENT();                            \
+        }                                                      \
+        if (address < m->programSize)                             \
+        {                                                      \
+            invalidateDecodedInstructions(m, address, width);     \
+            if (m->blocksStale)                                   \
+            {                                                  \
+                pc = CURRENT_PC + d->length;                   \
+                executed += (uint32_t)(d - block->code) + 1;   \
+                goto leave;                                    \
+            }                                                  \
+        }                                                      \
+        d++;                                                   \
+        DISPATCH();                                            \
+    }
+        STORE_OPERATIONS(X)
+#undef X
+
+        // Floating-point instructions, which can also be stores into a translated block
+#define X(operation, name)                                     \
+    TARGET(operation):                                         \
+        if (!executeFloat(m, d))                               \
+        {                                                      \
+            LEAVE_BEFORE_CURRENT();                            \
+        }                                                      \
+        if (m->blocksStale)                                    \
+        {                                                      \
+            pc = CURRENT_PC + d->length;                       \
+            executed += (uint32_t)(d - block->code) + 1;       \
+            goto leave;                                        \
+        }                                                      \
+        d++;                                                   \
+        DISPATCH();
+        FLOAT_OPERATIONS(X)
+#undef X
+
+#define X(operation, condition) \
+    TARGET(operation):          \
+        EXIT_BLOCK((condition) ? CURRENT_PC + d->imm : CURRENT_PC + d->length, 0);
+        BRANCH_OPERATIONS(X)
+#undef X
+
+    TARGET(OP_JAL):
+    {
+        uint32_t jalPc = CURRENT_PC;
+        WRITE(d->rd, jalPc + d->length);
+        EXIT_BLOCK(jalPc + d->imm, 0);
+    }
+    TARGET(OP_JALR):
+    {
+        uint32_t jumpAddress = (RS1 + d->imm) & 0xFFFFFFFE;
+        WRITE(d->rd, CURRENT_PC + d->length);
+        EXIT_BLOCK(jumpAddress, 0);
+    }
+
+        // Superinstructions, d[0] carries the fused operation and d[1] the second instruction at SECOND_PC
+#define SECOND_PC (block->startPc + d[1].pcOffset)
+    TARGET(OP_LUI_ADDI):
+        WRITE(d[0].rd, d[0].imm);
+        WRITE(d[1].rd, d[0].imm + d[1].imm);
+        d += 2;
+        DISPATCH();
+    TARGET(OP_AUIPC_JALR):
+    {
+        uint32_t base = CURRENT_PC + d[0].imm;
+        WRITE(d[0].rd, base);
+        WRITE(d[1].rd, SECOND_PC + d[1].length);
+        EXIT_BLOCK((base + d[1].imm) & 0xFFFFFFFE, 1);
+    }
+    TARGET(OP_SLT_BNE):
+    {
+        uint32_t less = (int32_t)RS1 < (int32_t)RS2;
+        WRITE(d[0].rd, less);
+        EXIT_BLOCK(less ? SECOND_PC + d[1].imm : SECOND_PC + d[1].length, 1);
+    }
+    TARGET(OP_SLT_BEQ):
+    {
+        uint32_t less = (int32_t)RS1 < (int32_t)RS2;
+        WRITE(d[0].rd, less);
+        EXIT_BLOCK(!less ? SECOND_PC + d[1].imm : SECOND_PC + d[1].length, 1);
+    }
+    TARGET(OP_SLTU_BNE):
+    {
+        uint32_t less = RS1 < RS2;
+        WRITE(d[0].rd, less);
+        EXIT_BLOCK(less ? SECOND_PC + d[1].imm : SECOND_PC + d[1].length, 1);
+    }
+    TARGET(OP_SLTU_BEQ):
+    {
+        uint32_t less = RS1 < RS2;
+        WRITE(d[0].rd, less);
+        EXIT_BLOCK(!less ? SECOND_PC + d[1].imm : SECOND_PC + d[1].length, 1);
+    }
+
+    TARGET(OP_BLOCK_END):
+        // The block fell through, the marker itself is not an instruction
+        EXIT_BLOCK(CURRENT_PC, -1);
+
+#if !THREADED_DISPATCH
+    default:
+        // Blocks only contain the operations above
+        goto leave;
+        }
+#endif
+
+    blockExit:
+    {
+        // Follow a chained successor when it starts at the new pc, otherwise find the block and chain it
+        BasicBlock *next;
+        if (executed >= limit)
+        {
+            goto leave;
+        }
+        if (block->successor[0] && block->successorPc[0] == pc)
+        {
+            next = block->successor[0];
+        }
+        else if (block->successor[1] && block->successorPc[1] == pc)
+        {
+            next = block->successor[1];
+        }
+        else
+        {
+            next = findBlock(m, pc);
+            if (!next)
+            {
+                goto leave;
+            }
+            int slot = (block->successor[0] && !block->successor[1]) ? 1 : 0;
+            block->successor[slot] = next;
+            block->successorPc[slot] = pc;
+        }
+        block = next;
+    }
+    }
+
+leave:
+    m->programCounter = pc;
+    m->stats.instructionsExecuted += executed;
+
+#undef CURRENT_PC
+#undef SECOND_PC
+#undef EXIT_BLOCK
+#undef LEAVE_BEFORE_CURRENT
+#undef DISPATCH
+}
+
+#undef WRITE
+#undef RS1
+#undef RS2
+#undef TARGET
+
+static inline uint8_t trainCounter(uint8_t counter, int taken)
+{
+    // Two-bit saturating counter, predicting taken from 2 on
+    if (taken)
+    {
+        return counter < 3 ? counter + 1 : 3;
+    }
+    return counter > 0 ? counter - 1 : 0;
+}
+
+#define PREDICTOR_INDEX(pc) (((pc) >> 1) & ((1 << PREDICTOR_TABLE_BITS) - 1))
+
+// Static backward taken, forward not taken: loops branch backwards
+static int predictBtfn(void *state, uint32_t pc, uint32_t target)
+{
+    (void)state;
+    return target < pc;
+}
+
+static void updateBtfn(void *state, uint32_t pc, uint32_t target, int taken)
+{
+    (void)state, (void)pc, (void)target, (void)taken;
+}
+
+// A two-bit counter for each branch, selected by its address
+typedef struct
+{
+    uint8_t counters[1 << PREDICTOR_TABLE_BITS];
+} BimodalState;
+
+static int predictBimodal(void *state, uint32_t pc, uint32_t target)
+{
+    (void)target;
+    return ((BimodalState *)state)->counters[PREDICTOR_INDEX(pc)] >= 2;
+}
+
+static void updateBimodal(void *state, uint32_t pc, uint32_t target, int taken)
+{
+    (void)target;
+    uint8_t *counter = &((BimodalState *)state)->counters[PREDICTOR_INDEX(pc)];
+    *counter = trainCounter(*counter, taken);
+}
+
+// Two-bit counters selected by the address xor the directions of the last branches
+typedef struct
+{
+    uint8_t counters[1 << PREDICTOR_TABLE_BITS];
+    uint32_t history; // One bit per branch, the newest in bit 0
+} GshareState;
+
+static int predictGshare(void *state, uint32_t pc, uint32_t target)
+{
+    (void)target;
+    GshareState *g = state;
+    return g->counters[PREDICTOR_INDEX(pc ^ (g->history << 1))] >= 2;
+}
+
+static void updateGshare(void *state, uint32_t pc, uint32_t target, int taken)
+{
+    (void)target;
+    GshareState *g = state;
+    uint8_t *counter = &g->counters[PREDICTOR_INDEX(pc ^ (g->history << 1))];
+    *counter = trainCounter(*counter, taken);
+    g->history = (g->history << 1) | taken;
+}
+
+// A small TAGE: a bimodal base table and tagged tables looked up with ever longer global histories. The longest
+// matching history provides the prediction, and a misprediction allocates an entry with a longer history.
+#define TAGE_TABLES 4
+#define TAGE_TABLE_BITS 10
+#define TAGE_TAG_BITS 9
+#define TAGE_USEFUL_PERIOD (1 << 18) // Branches after which the usefulness of all entries is cleared
+
+static const uint32_t tageHistoryLengths[TAGE_TABLES] = {5, 11, 23, 47};
+
+typedef struct
+{
+    uint16_t tag;    // 0 for an unused entry, computed tags are never 0
+    int8_t counter;  // -4 to 3, taken from 0 on
+    uint8_t useful;  // 0 to 3, how often the entry predicted better than the shorter histories
+} TageEntry;
+
+typedef struct
+{
+    uint8_t base[1 << PREDICTOR_TABLE_BITS];
+    TageEntry tables[TAGE_TABLES][1 << TAGE_TABLE_BITS];
+    uint64_t history;
+    uint32_t branches;
+
+    // The lookup of the last prediction, for its update
+    uint32_t index[TAGE_TABLES];
+    uint16_t tag[TAGE_TABLES];
+    int provider;    // Table that provided the prediction, -1 for the base table
+    int providerTaken;
+    int alternativeTaken; // What the next shorter matching history, or the base table, predicted
+} TageState;
+
+static uint32_t foldHistory(uint64_t history, uint32_t length, uint32_t bits)
+{
+    // The newest length bits of the history, xored together in chunks of bits
+    uint64_t remaining = (length < 64) ? history & ((1ULL << length) - 1) : history;
+    uint32_t folded = 0;
+    while (remaining)
+    {
+        folded ^= remaining & ((1u << bits) - 1);
+        remaining >>= bits;
+    }
+    return folded;
+}
+
+static int predictTage(void *state, uint32_t pc, uint32_t target)
+{
+    (void)target;
+    TageState *t = state;
+    t->provider = -1;
+    t->providerTaken = t->alternativeTaken = t->base[PREDICTOR_INDEX(pc)] >= 2;
+    for (int i = 0; i < TAGE_TABLES; i++)
+    {
+        uint32_t length = tageHistoryLengths[i];
+        t->index[i] = ((pc >> 1) ^ (pc >> (TAGE_TABLE_BITS + 1)) ^ foldHistory(t->history, length, TAGE_TABLE_BITS)) & ((1 << TAGE_TABLE_BITS) - 1);
+        t->tag[i] = (((pc >> 1) ^ foldHistory(t->history, length, TAGE_TAG_BITS) ^ (foldHistory(t->history, length, TAGE_TAG_BITS - 1) << 1)) & ((1 << TAGE_TAG_BITS) - 1)) + 1;
+        const TageEntry *entry = &t->tables[i][t->index[i]];
+        if (entry->tag == t->tag[i])
+        {
+            t->alternativeTaken = t->providerTaken;
+            t->providerTaken = entry->counter >= 0;
+            t->provider = i;
+        }
+    }
+    return t->providerTaken;
+}
+
+static void updateTage(void *state, uint32_t pc, uint32_t target, int taken)
+{
+    (void)target;
+    TageState *t = state;
+    if (t->provider >= 0)
+    {
+        TageEntry *entry = &t->tables[t->provider][t->index[t->provider]];
+        if (t->providerTaken != t->alternativeTaken)
+        {
+            entry->useful = (t->providerTaken == taken) ? (entry->useful < 3 ? entry->useful + 1 : 3) : (entry->useful > 0 ? entry->useful - 1 : 0);
+        }
+        entry->counter = taken ? (entry->counter < 3 ? entry->counter + 1 : 3) : (entry->counter > -4 ? entry->counter - 1 : -4);
+    }
+    else
+    {
+        t->base[PREDICTOR_INDEX(pc)] = trainCounter(t->base[PREDICTOR_INDEX(pc)], taken);
+    }
+
+    // A wrong prediction takes over an entry that is not useful in a table with a longer history, or makes
+    // the entries that were in the way less useful
+    if (t->providerTaken != taken)
+    {
+        int allocated = 0;
+        for (int i = t->provider + 1; i < TAGE_TABLES && !allocated; i++)
+        {
+            TageEntry *entry = &t->tables[i][t->index[i]];
+            if (entry->useful == 0)
+            {
+                entry->tag = t->tag[i];
+                entry->counter = taken ? 0 : -1;
+                allocated = 1;
+            }
+        }
+        for (int i = t->provider + 1; i < TAGE_TABLES && !allocated; i++)
+        {
+            t->tables[i][t->index[i]].useful--;
+        }
+    }
+
+    if (++t->branches % TAGE_USEFUL_PERIOD == 0)
+    {
+        for (int i = 0; i < TAGE_TABLES; i++)
+        {
+            for (int j = 0; j < (1 << TAGE_TABLE_BITS); j++)
+            {
+                t->tables[i][j].useful = 0;
+            }
+        }
+    }
+    t->history = (t->history << 1) | taken;
+}
+
+#undef PREDICTOR_INDEX
+
+static const PredictorType predictorTypes[] = {
+    {"btfn", 0, predictBtfn, updateBtfn},
+    {"bimodal", sizeof(BimodalState), predictBimodal, updateBimodal},
+    {"gshare", sizeof(GshareState), predictGshare, updateGshare},
+    {"tage", sizeof(TageState), predictTage, updateTage},
+};
+
+const PredictorType *findPredictor(const char *name)
+{
+    for (size_t i = 0; i < sizeof(predictorTypes) / sizeof(predictorTypes[0]); i++)
+    {
+        if (strcmp(predictorTypes[i].name, name) == 0)
+        {
+            return &predictorTypes[i];
+        }
+    }
+    return NULL;
+}
+
+void destroyBranchModel(BranchModel *b)
+{
+    if (b)
+    {
+        for (int i = 0; i < predictorCount; i++)
+        {
+            free(b->state[i]);
+        }
+        free(b->records);
+        free(b);
+    }
+}
+
+BranchModel *createBranchModel()
+{
+    // Every predictor gets its own state, a predictor without state still gets a byte so NULL means failure
+    BranchModel *b = calloc(1, sizeof(BranchModel));
+    if (!b)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < predictorCount; i++)
+    {
+        b->state[i] = calloc(1, predictors[i]->stateSize ? predictors[i]->stateSize : 1);
+        if (!b->state[i])
+        {
+            destroyBranchModel(b);
+            return NULL;
+        }
+    }
+    return b;
+}
+
+void resetBranchModel(BranchModel *b)
+{
+    for (int i = 0; i < predictorCount; i++)
+    {
+        memset(b->state[i], 0, predictors[i]->stateSize);
+    }
+    memset(b->btb, 0, sizeof(b->btb));
+    b->returnDepth = 0;
+    free(b->records);
+    b->records = NULL;
+    b->recordCapacity = 0;
+    b->recordCount = 0;
+}
+
+static BranchRecord *findBranchRecord(BranchModel *b, uint32_t pc)
+{
+    // Open addressing with linear probing, the table doubles when it gets half full
+    if (2 * (b->recordCount + 1) > b->recordCapacity)
+    {
+        uint32_t capacity = b->recordCapacity ? 2 * b->recordCapacity : 256;
+        BranchRecord *records = calloc(capacity, sizeof(BranchRecord));
+        if (!records)
+        {
+            return NULL;
+        }
+        for (uint32_t i = 0; i < b->recordCapacity; i++)
+        {
+            if (b->records[i].executions)
+            {
+                uint32_t slot = (b->records[i].pc >> 1) & (capacity - 1);
+                while (records[slot].executions)
+                {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                records[slot] = b->records[i];
+            }
+        }
+        free(b->records);
+        b->records = records;
+        b->recordCapacity = capacity;
+    }
+
+    uint32_t slot = (pc >> 1) & (b->recordCapacity - 1);
+    while (b->records[slot].executions && b->records[slot].pc != pc)
+    {
+        slot = (slot + 1) & (b->recordCapacity - 1);
+    }
+    if (!b->records[slot].executions)
+    {
+        b->records[slot].pc = pc;
+        b->recordCount++;
+    }
+    return &b->records[slot];
+}
+
+// Calls and returns are told apart by their link registers, x1 and x5, like the RISC-V specification suggests.
+// A JALR that links and jumps through the other link register returns and calls at once, like a coroutine switch.
+#define LINK_REGISTER(reg) ((reg) == 1 || (reg) == 5)
+
+static inline int isCall(const DecodedInstruction *d)
+{
+    return (d->handler == HANDLER_JAL || d->handler == HANDLER_JALR) && LINK_REGISTER(d->rd);
+}
+
+static inline int isReturn(const DecodedInstruction *d)
+{
+    return d->handler == HANDLER_JALR && LINK_REGISTER(d->rs1) && (!LINK_REGISTER(d->rd) || d->rd != d->rs1);
+}
+
+uint32_t predictControlFlow(Machine *m, const DecodedInstruction *d, uint32_t pc)
+{
+    // Run the predictors on a branch or jump the interpreter executed at pc, m->programCounter already holds where it
+    // went. Returns the cycles the timing model loses fetching the wrong instructions with the first predictor:
+    // a wrong direction or indirect target is found in EX, a missing direct target once the instruction is decoded.
+    BranchModel *b = m->branchModel;
+    uint32_t nextPc = m->programCounter;
+    uint32_t fallThrough = pc + d->length;
+    BtbEntry *entry = &b->btb[(pc >> 1) & (BTB_ENTRIES - 1)];
+    int targetKnown = entry->pc == pc && entry->target == nextPc;
+    uint32_t penalty = 0;
+
+    if (m->programState == PROGRAM_FAULTED)
+    {
+        return 0;
+    }
+
+    if (d->handler == HANDLER_B)
+    {
+        int taken = nextPc != fallThrough;
+        uint32_t target = pc + d->imm;
+        BranchRecord *record = findBranchRecord(b, pc);
+        m->stats.conditionalBranches++;
+        m->stats.takenBranches += taken;
+        for (int i = 0; i < predictorCount; i++)
+        {
+            int predicted = predictors[i]->predict(b->state[i], pc, target);
+            predictors[i]->update(b->state[i], pc, target, taken);
+            if (predicted != taken)
+            {
+                m->stats.branchMispredictions[i]++;
+                if (record)
+                {
+                    record->mispredictions[i]++;
+                }
+            }
+            if (i == 0)
+            {
+                penalty = (predicted != taken) ? TIMING_BRANCH_PENALTY : (taken && !targetKnown) ? TIMING_JUMP_PENALTY : 0;
+            }
+        }
+        if (record)
+        {
+            record->executions++;
+            record->taken += taken;
+        }
+        if (!taken)
+        {
+            return penalty;
+        }
+    }
+    else
+    {
+        if (isReturn(d))
+        {
+            b->returnDepth--;
+            m->stats.returns++;
+            if (b->returnStack[b->returnDepth % RAS_ENTRIES] != nextPc)
+            {
+                m->stats.returnMisses++;
+                penalty = TIMING_BRANCH_PENALTY;
+            }
+        }
+        else if (d->handler == HANDLER_JAL)
+        {
+            m->stats.directJumps++;
+            if (!targetKnown)
+            {
+                m->stats.directJumpMisses++;
+                penalty = TIMING_JUMP_PENALTY;
+            }
+        }
+        else
+        {
+            m->stats.indirectJumps++;
+            if (!targetKnown)
+            {
+                m->stats.indirectJumpMisses++;
+                penalty = TIMING_BRANCH_PENALTY;
+            }
+        }
+        if (isCall(d))
+        {
+            b->returnStack[b->returnDepth % RAS_ENTRIES] = fallThrough;
+            b->returnDepth++;
+        }
+    }
+
+    entry->pc = pc;
+    entry->target = nextPc;
+    return penalty;
+}
+
+void printPredictions(const Statistics *stats)
+{
+    fprintf(stderr, "Conditional branches: %llu, %.1f%% taken\n", (unsigned long long)stats->conditionalBranches,
+            stats->conditionalBranches ? 100.0 * stats->takenBranches / stats->conditionalBranches : 0.0);
+    for (int i = 0; i < predictorCount; i++)
+    {
+        fprintf(stderr, "Predictor %s: %llu mispredicted, %.2f%% correct\n", predictors[i]->name, (unsigned long long)stats->branchMispredictions[i],
+                stats->conditionalBranches ? 100.0 - 100.0 * stats->branchMispredictions[i] / stats->conditionalBranches : 100.0);
+    }
+    fprintf(stderr, "Jumps: %llu jal with %llu BTB misses, %llu returns with %llu RAS misses, %llu other jalr with %llu BTB misses\n",
+            (unsigned long long)stats->directJumps, (unsigned long long)stats->directJumpMisses, (unsigned long long)stats->returns,
+            (unsigned long long)stats->returnMisses, (unsigned long long)stats->indirectJumps, (unsigned long long)stats->indirectJumpMisses);
+}
+
+static int compareRecordPcs(const void *first, const void *second)
+{
+    uint32_t a = ((const BranchRecord *)first)->pc;
+    uint32_t b = ((const BranchRecord *)second)->pc;
+    return (a > b) - (a < b);
+}
+
+static int compareRecordExecutions(const void *first, const void *second)
+{
+    uint64_t a = ((const BranchRecord *)first)->executions;
+    uint64_t b = ((const BranchRecord *)second)->executions;
+    return (a < b) - (a > b);
+}
+
+void printBranchRecords(Machine **harts, int count)
+{
+    // The harts run the same code, so the records of a branch are added up over all harts
+    size_t total = 0;
+    for (int hart = 0; hart < count; hart++)
+    {
+        total += harts[hart]->branchModel->recordCount;
+    }
+    BranchRecord *records = malloc((total ? total : 1) * sizeof(BranchRecord));
+    if (!records)
+    {
+        return;
+    }
+    size_t used = 0;
+    for (int hart = 0; hart < count; hart++)
+    {
+        const BranchModel *b = harts[hart]->branchModel;
+        for (uint32_t i = 0; i < b->recordCapacity; i++)
+        {
+            if (b->records[i].executions)
+            {
+                records[used++] = b->records[i];
+            }
+        }
+    }
+    qsort(records, used, sizeof(BranchRecord), compareRecordPcs);
+    size_t merged = 0;
+    for (size_t i = 0; i < used; i++)
+    {
+        if (merged > 0 && records[merged - 1].pc == records[i].pc)
+        {
+            records[merged - 1].executions += records[i].executions;
+            records[merged - 1].taken += records[i].taken;
+            for (int j = 0; j < predictorCount; j++)
+            {
+                records[merged - 1].mispredictions[j] += records[i].mispredictions[j];
+            }
+        }
+        else
+        {
+            records[merged++] = records[i];
+        }
+    }
+    qsort(records, merged, sizeof(BranchRecord), compareRecordExecutions);
+
+    // One line per branch with the mispredictions of each predictor, the most executed branches first
+    fprintf(stderr, "Mispredictions of the %d most executed of %zu branches:\n", merged < BRANCH_REPORT_LIMIT ? (int)merged : BRANCH_REPORT_LIMIT, merged);
+    fprintf(stderr, "PC          Executions   Taken");
+    for (int i = 0; i < predictorCount; i++)
+    {
+        fprintf(stderr, " %10s", predictors[i]->name);
+    }
+    fprintf(stderr, "\n");
+    for (size_t i = 0; i < merged && i < BRANCH_REPORT_LIMIT; i++)
+    {
+        fprintf(stderr, "0x%08X %12llu  %5.1f%%", records[i].pc, (unsigned long long)records[i].executions, 100.0 * records[i].taken / records[i].executions);
+        for (int j = 0; j < predictorCount; j++)
+        {
+            fprintf(stderr, " %10llu", (unsigned long long)records[i].mispredictions[j]);
+        }
+        fprintf(stderr, "\n");
+    }
+    free(records);
+}
+
+int createCaches(Machine *m)
+{
+    for (int level = 0; level < CACHE_LEVELS; level++)
+    {
+        const CacheConfig *config = &cacheConfigs[level];
+        Cache *c = &m->caches[level];
+        if (config->size == 0)
+        {
+            continue;
+        }
+        uint32_t sets = config->size / (config->ways * config->lineSize);
+        c->tags = calloc((size_t)sets * config->ways, sizeof(uint32_t));
+        c->plru = (config->policy == CACHE_PLRU) ? calloc(sets, sizeof(uint32_t)) : NULL;
+        if (!c->tags || (config->policy == CACHE_PLRU && !c->plru))
+        {
+            return 0;
+        }
+        c->setMask = sets - 1;
+        c->lineBits = __builtin_ctz(config->lineSize);
+        c->random = 0x9E3779B9;
+    }
+    return 1;
+}
+
+void resetCaches(Machine *m)
+{
+    for (int level = 0; level < CACHE_LEVELS; level++)
+    {
+        const CacheConfig *config = &cacheConfigs[level];
+        Cache *c = &m->caches[level];
+        if (c->tags)
+        {
+            uint32_t sets = c->setMask + 1;
+            memset(c->tags, 0, (size_t)sets * config->ways * sizeof(uint32_t));
+            if (c->plru)
+            {
+                memset(c->plru, 0, sets * sizeof(uint32_t));
+            }
+            c->random = 0x9E3779B9;
+            c->lastLine = 0;
+        }
+    }
+    free(m->cacheMisses);
+    m->cacheMisses = NULL;
+}
+
+void destroyCaches(Machine *m)
+{
+    for (int level = 0; level < CACHE_LEVELS; level++)
+    {
+        free(m->caches[level].tags);
+        free(m->caches[level].plru);
+    }
+    free(m->cacheMisses);
+}
+
+static void touchCacheWay(Cache *c, const CacheConfig *config, uint32_t *tags, uint32_t set, uint32_t way)
+{
+    if (config->policy == CACHE_LRU)
+    {
+        // Move the tag to the front, the least recently used one ends up last
+        uint32_t tag = tags[way];
+        memmove(&tags[1], &tags[0], way * sizeof(uint32_t));
+        tags[0] = tag;
+    }
+    else if (config->policy == CACHE_PLRU)
+    {
+        // Every node of the tree on the way from the root to the used way points to the other half.
+        // Node n has the children 2n and 2n + 1, a set bit points to the upper half of the ways.
+        uint32_t node = 1;
+        for (uint32_t half = config->ways >> 1; half; half >>= 1)
+        {
+            uint32_t upper = (way & half) != 0;
+            c->plru[set] = upper ? c->plru[set] & ~(1u << node) : c->plru[set] | (1u << node);
+            node = 2 * node + upper;
+        }
+    }
+}
+
+static uint32_t cacheVictim(Cache *c, const CacheConfig *config, const uint32_t *tags, uint32_t set)
+{
+    // An empty way is used first, with LRU it is always the last one
+    if (config->policy == CACHE_LRU)
+    {
+        return config->ways - 1;
+    }
+    for (uint32_t way = 0; way < config->ways; way++)
+    {
+        if (tags[way] == 0)
+        {
+            return way;
+        }
+    }
+    if (config->policy == CACHE_PLRU)
+    {
+        uint32_t node = 1;
+        uint32_t way = 0;
+        for (uint32_t half = config->ways >> 1; half; half >>= 1)
+        {
+            uint32_t upper = (c->plru[set] >> node) & 1;
+            way |= upper ? half : 0;
+            node = 2 * node + upper;
+        }
+        return way;
+    }
+    c->random ^= c->random << 13;
+    c->random ^= c->random >> 17;
+    c->random ^= c->random << 5;
+    return c->random % config->ways;
+}
+
+static void countCacheMiss(Machine *m, int level, uint32_t pc)
+{
+    if (!m->cacheMisses)
+    {
+        m->cacheMisses = calloc(m->programSize / 2 + 1, sizeof(CacheMisses));
+        if (!m->cacheMisses)
+        {
+            return;
+        }
+    }
+    CacheMisses *misses = &m->cacheMisses[pc / 2];
+    if (level == CACHE_L1I)
+    {
+        misses->instruction++;
+    }
+    else if (level == CACHE_L1D)
+    {
+        misses->data++;
+    }
+    else
+    {
+        misses->l2++;
+    }
+}
+
+static uint32_t accessCache(Machine *m, int level, uint32_t address, int isWrite, uint32_t pc);
+
+static uint32_t accessBelow(Machine *m, int level, uint32_t address, int isWrite, uint32_t pc)
+{
+    // Pass an access on from a cache level to L2 or memory, returning the cycles until its line arrives
+    if (level != CACHE_L2 && cacheConfigs[CACHE_L2].size)
+    {
+        return TIMING_L2_LATENCY + accessCache(m, CACHE_L2, address, isWrite, pc);
+    }
+    if (isWrite)
+    {
+        m->stats.memoryWrites++;
+    }
+    else
+    {
+        m->stats.memoryReads++;
+    }
+    return TIMING_MEMORY_LATENCY;
+}
+
+static uint32_t accessCache(Machine *m, int level, uint32_t address, int isWrite, uint32_t pc)
+{
+    // Look up the line of an address in one level for the instruction at pc, returning the cycles it takes
+    // beyond a hit. Writes to the next level go through a write buffer and cost nothing.
+    const CacheConfig *config = &cacheConfigs[level];
+    Cache *c = &m->caches[level];
+    CacheCounters *counters = &m->stats.caches[level];
+    uint32_t line = address >> c->lineBits;
+    uint32_t set = line & c->setMask;
+    uint32_t *tags = &c->tags[set * config->ways];
+    uint32_t tag = line + 1;
+
+    counters->reads += !isWrite;
+    counters->writes += isWrite;
+    uint32_t way = 0;
+    while (way < config->ways && (tags[way] & ~CACHE_DIRTY) != tag)
+    {
+        way++;
+    }
+
+    if (way < config->ways)
+    {
+        if (isWrite && config->writeThrough)
+        {
+            accessBelow(m, level, address, 1, pc);
+        }
+        else if (isWrite)
+        {
+            tags[way] |= CACHE_DIRTY;
+        }
+        touchCacheWay(c, config, tags, set, way);
+        return 0;
+    }
+
+    counters->readMisses += !isWrite;
+    counters->writeMisses += isWrite;
+    countCacheMiss(m, level, pc);
+    if (isWrite && config->writeThrough)
+    {
+        accessBelow(m, level, address, 1, pc);
+        return 0;
+    }
+
+    // Bring the line in, writing back the line it replaces if that was changed
+    uint32_t cycles = accessBelow(m, level, address, 0, pc);
+    way = cacheVictim(c, config, tags, set);
+    if (tags[way] & CACHE_DIRTY)
+    {
+        counters->writebacks++;
+        accessBelow(m, level, ((tags[way] & ~CACHE_DIRTY) - 1) << c->lineBits, 1, pc);
+    }
+    tags[way] = tag | (isWrite ? CACHE_DIRTY : 0);
+    touchCacheWay(c, config, tags, set, way);
+    return cycles;
+}
+
+static uint32_t accessCacheBytes(Machine *m, int level, uint32_t address, uint32_t width, int isWrite, uint32_t pc)
+{
+    // An access that crosses into the next line needs both lines
+    uint32_t cycles = accessCache(m, level, address, isWrite, pc);
+    if ((address ^ (address + width - 1)) >> m->caches[level].lineBits)
+    {
+        cycles += accessCache(m, level, address + width - 1, isWrite, pc);
+    }
+    return cycles;
+}
+
+uint32_t fetchThroughCaches(Machine *m, uint32_t pc, uint32_t length)
+{
+    // Most instructions are in the line of the one before, which only fetches use, so it is still there and the
+    // most recently used line and the lookup can be skipped
+    Cache *c = &m->caches[CACHE_L1I];
+    uint32_t lastLine = (pc + length - 1) >> c->lineBits;
+    if (lastLine + 1 == c->lastLine && (pc >> c->lineBits) == lastLine)
+    {
+        m->stats.caches[CACHE_L1I].reads++;
+        return 0;
+    }
+    c->lastLine = lastLine + 1;
+    return accessCacheBytes(m, CACHE_L1I, pc, length, 0, pc);
+}
+
+uint32_t accessDataThroughCaches(Machine *m, const DecodedInstruction *d, uint32_t pc, uint32_t address)
+{
+    // The memory accesses of an instruction the interpreter executed at pc, at the address its operands gave before
+    uint32_t width = 4;
+    if (d->operation == OP_LB || d->operation == OP_LBU || d->operation == OP_SB)
+    {
+        width = 1;
+    }
+    else if (d->operation == OP_LH || d->operation == OP_LHU || d->operation == OP_SH)
+    {
+        width = 2;
+    }
+
+    switch (d->handler)
+    {
+    case HANDLER_L:
+        return accessCacheBytes(m, CACHE_L1D, address, width, 0, pc);
+    case HANDLER_S:
+        return accessCacheBytes(m, CACHE_L1D, address, width, 1, pc);
+    case HANDLER_A:
+        // The atomic memory operations read the word and then write it
+        if (d->operation == OP_SC_W)
+        {
+            return accessCacheBytes(m, CACHE_L1D, address, 4, 1, pc);
+        }
+        return accessCacheBytes(m, CACHE_L1D, address, 4, 0, pc) + (d->operation != OP_LR_W ? accessCacheBytes(m, CACHE_L1D, address, 4, 1, pc) : 0);
+    case HANDLER_F:
+        if (d->operation == OP_FLW || d->operation == OP_FSW)
+        {
+            return accessCacheBytes(m, CACHE_L1D, address, 4, d->operation == OP_FSW, pc);
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+static const char *const cacheNames[CACHE_LEVELS] = {"L1I", "L1D", "L2"};
+
+int parseCacheConfig(const char *text, CacheConfig *config, int level)
+{
+    // SIZE:WAYS:LINE, optionally followed by the replacement policy and the write policy. L2 can be left out with 0.
+    char spec[64];
+    if (strlen(text) >= sizeof(spec))
+    {
+        return 0;
+    }
+    strcpy(spec, text);
+    char *rest = spec;
+    char *field = splitField(&rest);
+    if (level == CACHE_L2 && strcmp(field, "0") == 0 && !rest)
+    {
+        config->size = 0;
+        return 1;
+    }
+
+    CacheConfig parsed = *config;
+    uint64_t size = parseSize(field);
+    char *waysField = splitField(&rest);
+    char *lineSizeField = splitField(&rest);
+    uint64_t ways;
+    uint64_t lineSize;
+    if (!waysField || !lineSizeField || !parseCount(waysField, &ways) || !parseCount(lineSizeField, &lineSize) ||
+        ways < 1 || ways > CACHE_MAX_WAYS || lineSize < 4 || lineSize > PAGE_SIZE)
+    {
+        return 0;
+    }
+    parsed.ways = (uint32_t)ways;
+    parsed.lineSize = (uint32_t)lineSize;
+    while ((field = splitField(&rest)))
+    {
+        if (strcmp(field, "lru") == 0 || strcmp(field, "plru") == 0 || strcmp(field, "random") == 0)
+        {
+            parsed.policy = (field[0] == 'l') ? CACHE_LRU : (field[0] == 'p') ? CACHE_PLRU : CACHE_RANDOM;
+        }
+        else if (strcmp(field, "back") == 0 || strcmp(field, "through") == 0)
+        {
+            parsed.writeThrough = field[0] == 't';
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    // Sizes and the number of sets are powers of two so addresses can be split with masks, and PLRU needs a full tree
+    uint64_t setBytes = (uint64_t)parsed.ways * parsed.lineSize;
+    if (size == 0 || size > (1u << 30) || (parsed.lineSize & (parsed.lineSize - 1)) || size % setBytes || ((size / setBytes) & (size / setBytes - 1)) ||
+        (parsed.policy == CACHE_PLRU && (parsed.ways & (parsed.ways - 1))))
+    {
+        return 0;
+    }
+    parsed.size = size;
+    *config = parsed;
+    return 1;
+}
+
+void printCaches(const Statistics *stats)
+{
+    static const char *const policies[] = {"LRU", "PLRU", "random"};
+    for (int level = 0; level < CACHE_LEVELS; level++)
+    {
+        const CacheConfig *config = &cacheConfigs[level];
+        const CacheCounters *counters = &stats->caches[level];
+        if (config->size == 0)
+        {
+            continue;
+        }
+        uint64_t accesses = counters->reads + counters->writes;
+        uint64_t misses = counters->readMisses + counters->writeMisses;
+        fprintf(stderr, "%s cache (%u %s, %u-way, %u-byte lines, %s%s): %llu reads with %llu misses, %llu writes with %llu misses, %.2f%% missed",
+                cacheNames[level], config->size % 1024 ? config->size : config->size / 1024, config->size % 1024 ? "bytes" : "KiB", config->ways, config->lineSize, policies[config->policy],
+                level == CACHE_L1I ? "" : config->writeThrough ? ", write-through" : ", write-back",
+                (unsigned long long)counters->reads, (unsigned long long)counters->readMisses, (unsigned long long)counters->writes,
+                (unsigned long long)counters->writeMisses, accesses ? 100.0 * misses / accesses : 0.0);
+        fprintf(stderr, (level == CACHE_L1I) ? "\n" : ", %llu writebacks\n", (unsigned long long)counters->writebacks);
+    }
+    fprintf(stderr, "Memory: %llu line reads, %llu writes\n", (unsigned long long)stats->memoryReads, (unsigned long long)stats->memoryWrites);
+}
+
+// The misses of one instruction, for sorting them
+typedef struct
+{
+    uint32_t pc;
+    CacheMisses misses;
+} CacheMissRecord;
+
+static int compareCacheMisses(const void *first, const void *second)
+{
+    const CacheMisses *a = &((const CacheMissRecord *)first)->misses;
+    const CacheMisses *b = &((const CacheMissRecord *)second)->misses;
+    uint64_t aMisses = a->instruction + a->data;
+    uint64_t bMisses = b->instruction + b->data;
+    return (aMisses < bMisses) - (aMisses > bMisses);
+}
+
+void printCacheMisses(Machine **harts, int count)
+{
+    // The harts run the same program, so their misses are added up by address
+    uint32_t halfwords = harts[0]->programSize / 2 + 1;
+    CacheMissRecord *records = malloc(halfwords * sizeof(CacheMissRecord));
+    if (!records)
+    {
+        return;
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < halfwords; i++)
+    {
+        CacheMissRecord record = {2 * i, {0, 0, 0}};
+        for (int hart = 0; hart < count; hart++)
+        {
+            if (harts[hart]->cacheMisses)
+            {
+                record.misses.instruction += harts[hart]->cacheMisses[i].instruction;
+                record.misses.data += harts[hart]->cacheMisses[i].data;
+                record.misses.l2 += harts[hart]->cacheMisses[i].l2;
+            }
+        }
+        if (record.misses.instruction + record.misses.data + record.misses.l2)
+        {
+            records[used++] = record;
+        }
+    }
+    qsort(records, used, sizeof(CacheMissRecord), compareCacheMisses);
+
+    fprintf(stderr, "Instructions with the most L1 misses:\n");
+    fprintf(stderr, "PC          L1I misses  L1D misses   L2 misses\n");
+    for (uint32_t i = 0; i < used && i < CACHE_REPORT_LIMIT; i++)
+    {
+        fprintf(stderr, "0x%08X %11llu %11llu %11llu\n", records[i].pc, (unsigned long long)records[i].misses.instruction,
+                (unsigned long long)records[i].misses.data, (unsigned long long)records[i].misses.l2);
+    }
+    free(records);
+}
+
+static const char *const handlerNames[HANDLER_UNKNOWN + 1] = {
+    "undecoded", "R-type", "I-type", "S-type", "L-type", "LUI", "AUIPC", "B-type", "JAL", "JALR", "ECALL", "A-type", "F-type", "CSR", "FENCE", "unknown"};
+
+int startProfile(Machine *m)
+{
+    // The code running before the first call is the root, named after the address the program starts at
+    Profile *p = calloc(1, sizeof(Profile));
+    if (!p)
+    {
+        return 0;
+    }
+    p->counts = calloc(m->programSize / 2 + 1, sizeof(uint64_t));
+    p->nodeCapacity = 64;
+    p->nodes = calloc(p->nodeCapacity, sizeof(ProfileNode));
+    if (!p->counts || !p->nodes)
+    {
+        free(p->counts);
+        free(p->nodes);
+        free(p);
+        return 0;
+    }
+    p->nodes[0].function = m->programCounter;
+    p->nodeCount = 1;
+    p->currentSince = m->stats.instructionsExecuted;
+    m->profile = p;
+    return 1;
+}
+
+void destroyProfile(Profile *p)
+{
+    if (p)
+    {
+        free(p->counts);
+        free(p->nodes);
+        free(p);
+    }
+}
+
+static void enterProfileNode(Machine *m, uint32_t node)
+{
+    // Charge the instructions since the last call or return to the function that ran them
+    Profile *p = m->profile;
+    p->nodes[p->current].instructions += m->stats.instructionsExecuted - p->currentSince;
+    p->currentSince = m->stats.instructionsExecuted;
+    p->current = node;
+}
+
+void profileControlFlow(Machine *m, const DecodedInstruction *d, uint32_t pc)
+{
+    // Follow a JAL or JALR the interpreter executed at pc through the calling context tree
+    Profile *p = m->profile;
+    uint32_t target = m->programCounter;
+    if (isReturn(d))
+    {
+        // Return to the innermost caller that expects this address, a longjmp can leave several functions at once
+        if (p->hiddenDepth > 0)
+        {
+            p->hiddenDepth--;
+        }
+        else
+        {
+            uint32_t level = p->depth;
+            while (level > 0 && p->returnAddresses[level - 1] != target)
+            {
+                level--;
+            }
+            uint32_t node = p->current;
+            while (level > 0 && p->depth >= level)
+            {
+                node = p->nodes[node].parent;
+                p->depth--;
+            }
+            enterProfileNode(m, node);
+        }
+    }
+
+    if (!isCall(d))
+    {
+        return;
+    }
+    if (p->depth == PROFILE_MAX_DEPTH)
+    {
+        p->hiddenDepth++;
+        return;
+    }
+    uint32_t child = p->nodes[p->current].firstChild;
+    while (child && (p->nodes[child].callSite != pc || p->nodes[child].function != target))
+    {
+        child = p->nodes[child].nextSibling;
+    }
+    if (!child)
+    {
+        if (p->nodeCount == p->nodeCapacity)
+        {
+            ProfileNode *nodes = realloc(p->nodes, 2 * p->nodeCapacity * sizeof(ProfileNode));
+            if (!nodes)
+            {
+                p->hiddenDepth++;
+                return;
+            }
+            p->nodes = nodes;
+            p->nodeCapacity *= 2;
+        }
+        child = p->nodeCount++;
+        ProfileNode *node = &p->nodes[child];
+        memset(node, 0, sizeof(ProfileNode));
+        node->function = target;
+        node->callSite = pc;
+        node->parent = p->current;
+        node->nextSibling = p->nodes[p->current].firstChild;
+        p->nodes[p->current].firstChild = child;
+    }
+    p->nodes[child].calls++;
+    p->returnAddresses[p->depth++] = pc + d->length;
+    enterProfileNode(m, child);
+}
+
+// What the report shows of one address or call site
+typedef struct
+{
+    uint32_t pc;
+    uint32_t function; // Called function, for a call site
+    uint64_t calls;
+    uint64_t instructions;
+} ProfileEntry;
+
+static int compareProfileSites(const void *first, const void *second)
+{
+    const ProfileEntry *a = first;
+    const ProfileEntry *b = second;
+    if (a->pc != b->pc)
+    {
+        return (a->pc > b->pc) - (a->pc < b->pc);
+    }
+    return (a->function > b->function) - (a->function < b->function);
+}
+
+static int compareProfileInstructions(const void *first, const void *second)
+{
+    uint64_t a = ((const ProfileEntry *)first)->instructions;
+    uint64_t b = ((const ProfileEntry *)second)->instructions;
+    return (a < b) - (a > b);
+}
+
+static uint64_t *inclusiveInstructions(const Profile *p)
+{
+    // Instructions of every node including its callees. Callees are always created after their caller.
+    uint64_t *inclusive = malloc(p->nodeCount * sizeof(uint64_t));
+    if (!inclusive)
+    {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < p->nodeCount; i++)
+    {
+        inclusive[i] = p->nodes[i].instructions;
+    }
+    for (uint32_t i = p->nodeCount - 1; i > 0; i--)
+    {
+        inclusive[p->nodes[i].parent] += inclusive[i];
+    }
+    return inclusive;
+}
+
+void printProfile(Machine **harts, int count)
+{
+    // The harts run the same program, so their counts are added up
+    uint64_t total = 0;
+    uint64_t handlers[HANDLER_UNKNOWN + 1] = {0};
+    size_t nodes = 0;
+    for (int hart = 0; hart < count; hart++)
+    {
+        Profile *p = harts[hart]->profile;
+        enterProfileNode(harts[hart], p->current);
+        for (int i = 0; i <= HANDLER_UNKNOWN; i++)
+        {
+            handlers[i] += p->handlers[i];
+            total += p->handlers[i];
+        }
+        nodes += p->nodeCount;
+    }
+
+    fprintf(stderr, "Instructions by class:\n");
+    for (int i = 0; i <= HANDLER_UNKNOWN; i++)
+    {
+        if (handlers[i])
+        {
+            fprintf(stderr, "  %-9s %12llu  %5.1f%%\n", handlerNames[i], (unsigned long long)handlers[i], 100.0 * handlers[i] / total);
+        }
+    }
+
+    uint32_t halfwords = harts[0]->programSize / 2 + 1;
+    ProfileEntry *entries = malloc((halfwords > nodes ? halfwords : nodes) * sizeof(ProfileEntry));
+    if (!entries)
+    {
+        return;
+    }
+    size_t used = 0;
+    for (uint32_t i = 0; i < halfwords; i++)
+    {
+        ProfileEntry entry = {2 * i, 0, 0, 0};
+        for (int hart = 0; hart < count; hart++)
+        {
+            entry.instructions += harts[hart]->profile->counts[i];
+        }
+        if (entry.instructions)
+        {
+            entries[used++] = entry;
+        }
+    }
+    qsort(entries, used, sizeof(ProfileEntry), compareProfileInstructions);
+    fprintf(stderr, "Most executed instructions:\n");
+    fprintf(stderr, "%-10s %12s  %6s  %-9s  %s\n", "PC", "Instructions", "", "Class", "Word");
+    for (size_t i = 0; i < used && i < PROFILE_REPORT_LIMIT; i++)
+    {
+        const DecodedInstruction *decoded = &harts[0]->decodeCache[entries[i].pc / 2];
+        for (int hart = 1; hart < count && decoded->handler == HANDLER_UNDECODED; hart++)
+        {
+            decoded = &harts[hart]->decodeCache[entries[i].pc / 2];
+        }
+        fprintf(stderr, "0x%08X %12llu  %5.1f%%  %-9s  %0*X\n", entries[i].pc, (unsigned long long)entries[i].instructions, 100.0 * entries[i].instructions / total,
+                handlerNames[decoded->handler], decoded->length == 2 ? 4 : 8, decoded->instruction);
+    }
+
+    // A recursive call site is inside its own earlier calls, whose instructions already include those of the inner calls
+    used = 0;
+    for (int hart = 0; hart < count; hart++)
+    {
+        const Profile *p = harts[hart]->profile;
+        uint64_t *inclusive = inclusiveInstructions(p);
+        if (!inclusive)
+        {
+            free(entries);
+            return;
+        }
+        for (uint32_t i = 1; i < p->nodeCount; i++)
+        {
+            const ProfileNode *node = &p->nodes[i];
+            uint32_t outer = node->parent;
+            while (outer && (p->nodes[outer].callSite != node->callSite || p->nodes[outer].function != node->function))
+            {
+                outer = p->nodes[outer].parent;
+            }
+            ProfileEntry entry = {node->callSite, node->function, node->calls, outer ? 0 : inclusive[i]};
+            entries[used++] = entry;
+        }
+        free(inclusive);
+    }
+    qsort(entries, used, sizeof(ProfileEntry), compareProfileSites);
+    size_t merged = 0;
+    for (size_t i = 0; i < used; i++)
+    {
+        if (merged > 0 && entries[merged - 1].pc == entries[i].pc && entries[merged - 1].function == entries[i].function)
+        {
+            entries[merged - 1].calls += entries[i].calls;
+            entries[merged - 1].instructions += entries[i].instructions;
+        }
+        else
+        {
+            entries[merged++] = entries[i];
+        }
+    }
+    qsort(entries, merged, sizeof(ProfileEntry), compareProfileInstructions);
+    fprintf(stderr, "Call sites with the most instructions, including those of the functions they call:\n");
+    fprintf(stderr, "%-10s  %-10s  %12s  %12s\n", "Call site", "Function", "Calls", "Instructions");
+    for (size_t i = 0; i < merged && i < PROFILE_REPORT_LIMIT; i++)
+    {
+        fprintf(stderr, "0x%08X  0x%08X  %12llu  %12llu  %5.1f%%\n", entries[i].pc, entries[i].function, (unsigned long long)entries[i].calls,
+                (unsigned long long)entries[i].instructions, 100.0 * entries[i].instructions / total);
+    }
+    free(entries);
+}
+
+void writeFoldedStacks(Machine **harts, int count)
+{
+    // One line per calling context with the instructions retired in it, its frames named by the addresses of the
+    // functions from the outermost one, like flamegraph.pl and speedscope read them
+    FILE *file = fopen(profileFileName, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Error: Could not create %s.\n", profileFileName);
+        return;
+    }
+    for (int hart = 0; hart < count; hart++)
+    {
+        const Profile *p = harts[hart]->profile;
+        for (uint32_t i = 0; i < p->nodeCount; i++)
+        {
+            if (p->nodes[i].instructions == 0)
+            {
+                continue;
+            }
+            uint32_t frames[PROFILE_MAX_DEPTH + 1];
+            int depth = 0;
+            for (uint32_t node = i; node; node = p->nodes[node].parent)
+            {
+                frames[depth++] = p->nodes[node].function;
+            }
+            fprintf(file, "0x%08X", p->nodes[0].function);
+            while (depth > 0)
+            {
+                fprintf(file, ";0x%08X", frames[--depth]);
+            }
+            fprintf(file, " %llu\n", (unsigned long long)p->nodes[i].instructions);
+        }
+    }
+    fclose(file);
+    fprintf(stderr, "Folded stacks written to %s\n", profileFileName);
+}
+
+#ifdef THREADS_SUPPORTED
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // Harts on several threads write their chunks one at a time
+#endif
+
+static inline uint8_t *putTrace16(uint8_t *p, uint32_t value)
+{
+    uint16_t half = LITTLE_ENDIAN_16((uint16_t)value);
+    memcpy(p, &half, sizeof(half));
+    return p + sizeof(half);
+}
+
+static inline uint8_t *putTrace32(uint8_t *p, uint32_t value)
+{
+    uint32_t word = LITTLE_ENDIAN_32(value);
+    memcpy(p, &word, sizeof(word));
+    return p + sizeof(word);
+}
+
+static inline uint32_t getTrace32(const uint8_t *p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return LITTLE_ENDIAN_32(word);
+}
+
+int openTrace()
+{
+    traceFile = fopen(traceFileName, "wb");
+    if (!traceFile)
+    {
+        printf("Error: Could not create %s.\n", traceFileName);
+        return 0;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), traceFile);
+    return 1;
+}
+
+void flushTrace(Machine *m)
+{
+    // The chunk goes out in one piece, so the chunks of harts on other threads are never mixed into it
+    TraceBuffer *t = m->trace;
+    uint8_t header[8];
+    putTrace32(putTrace32(header, m->hartId), (uint32_t)t->used);
+#ifdef THREADS_SUPPORTED
+    pthread_mutex_lock(&traceLock);
+#endif
+    fwrite(header, 1, sizeof(header), traceFile);
+    fwrite(t->data, 1, t->used, traceFile);
+#ifdef THREADS_SUPPORTED
+    pthread_mutex_unlock(&traceLock);
+#endif
+    t->used = 0;
+}
+
+int startTrace(Machine *m)
+{
+    // The trace of a hart starts with its registers, so the decoder can print the values before the first instruction
+    TraceBuffer *t = calloc(1, sizeof(TraceBuffer));
+    if (!t)
+    {
+        return 0;
+    }
+    t->data = malloc(TRACE_BUFFER_SIZE);
+    if (!t->data)
+    {
+        free(t);
+        return 0;
+    }
+    uint8_t *p = t->data;
+    *p++ = TRACE_RECORD_START;
+    p = putTrace32(p, m->programCounter);
+    for (int i = 0; i < NUM_REGISTERS; i++)
+    {
+        p = putTrace32(p, m->registers[i]);
+    }
+    for (int i = 0; i < NUM_REGISTERS; i++)
+    {
+        p = putTrace32(p, m->floatRegisters[i]);
+    }
+    p = putTrace32(p, (m->frm << 5) | m->fflags);
+    t->used = p - t->data;
+    t->nextPc = m->programCounter;
+    m->trace = t;
+    return 1;
+}
+
+void destroyTrace(TraceBuffer *t)
+{
+    if (t)
+    {
+        free(t->data);
+        free(t);
+    }
+}
+
+static uint32_t traceAccessWidth(const DecodedInstruction *d)
+{
+    // Bytes the instruction reads or writes in memory, 0 if it does not access memory
+    switch (d->handler)
+    {
+    case HANDLER_L:
+    case HANDLER_S:
+        return (d->operation == OP_LB || d->operation == OP_LBU || d->operation == OP_SB) ? 1 : (d->operation == OP_LH || d->operation == OP_LHU || d->operation == OP_SH) ? 2 : 4;
+    case HANDLER_A:
+        return 4;
+    case HANDLER_F:
+        return (d->operation == OP_FLW || d->operation == OP_FSW) ? 4 : 0;
+    default:
+        return 0;
+    }
+}
+
+uint32_t prepareTraceAccess(Machine *m, const DecodedInstruction *d, uint32_t *address, uint32_t *value)
+{
+    // Called before the instruction runs, as loads and atomics record what memory held before. Returns the width
+    // of the access. If the access faults, the instruction is not recorded and the value does not matter.
+    uint32_t width = traceAccessWidth(d);
+    *address = m->registers[d->rs1] + d->imm;
+    *value = 0;
+    if (d->handler == HANDLER_S)
+    {
+        *value = m->registers[d->rs2] & (width == 4 ? 0xFFFFFFFF : (1u << (8 * width)) - 1);
+    }
+    else if (d->operation == OP_FSW)
+    {
+        *value = m->floatRegisters[d->rs2];
+    }
+    else if (width && !OUTSIDE_MEMORY(*address, width))
+    {
+        *value = loadFlat(m, *address, width);
+    }
+    else if (width && !loadOutside(m, *address, width, value))
+    {
+        *value = 0;
+    }
+    return width;
+}
+
+void traceInstruction(Machine *m, const DecodedInstruction *d, uint32_t pc, uint32_t width, uint32_t address, uint32_t value)
+{
+    // Append the record of an instruction the interpreter executed at pc without faulting
+    TraceBuffer *t = m->trace;
+    if (t->used > TRACE_BUFFER_SIZE - TRACE_RECORD_MAX_SIZE)
+    {
+        flushTrace(m);
+    }
+
+    uint8_t *record = t->data + t->used;
+    uint8_t *p = record + 1;
+    uint8_t flags = (width == 4) ? 3 : width;
+    if (pc != t->nextPc)
+    {
+        flags |= TRACE_RECORD_PC;
+        p = putTrace32(p, pc);
+    }
+    if (d->length == 2)
+    {
+        flags |= TRACE_RECORD_COMPRESSED;
+        p = putTrace16(p, d->instruction);
+    }
+    else
+    {
+        p = putTrace32(p, d->instruction);
+    }
+
+    // Only B-type, S-type, e-calls, fences, FSW and writes to x0 leave the registers unchanged
+    switch (d->handler)
+    {
+    case HANDLER_B:
+    case HANDLER_S:
+    case HANDLER_ECALL:
+    case HANDLER_FENCE:
+        break;
+    case HANDLER_F:
+        if (d->operation == OP_FSW)
+        {
+            break;
+        }
+        if (d->operation != OP_FCVT_W_S && d->operation != OP_FCVT_WU_S && d->operation != OP_FMV_X_W && d->operation != OP_FCLASS_S &&
+            d->operation != OP_FEQ_S && d->operation != OP_FLT_S && d->operation != OP_FLE_S)
+        {
+            flags |= TRACE_RECORD_F_VALUE;
+            p = putTrace32(p, m->floatRegisters[d->rd]);
+            break;
+        }
+        // fall through
+    default:
+        if (d->rd != 0)
+        {
+            flags |= TRACE_RECORD_X_VALUE;
+            p = putTrace32(p, m->registers[d->rd]);
+        }
+        break;
+    }
+
+    if (width)
+    {
+        p = putTrace32(putTrace32(p, address), value);
+    }
+    record[0] = flags;
+    t->used = p - t->data;
+    t->nextPc = pc + d->length;
+}
+
+void finishTrace(Machine **harts, int count)
+{
+    for (int hart = 0; hart < count; hart++)
+    {
+        if (harts[hart]->trace && harts[hart]->trace->used > 0)
+        {
+            flushTrace(harts[hart]);
+        }
+    }
+    long size = ftell(traceFile);
+    int failed = ferror(traceFile);
+    if (fclose(traceFile) != 0 || failed)
+    {
+        fprintf(stderr, "Error: Could not write %s.\n", traceFileName);
+        return;
+    }
+    fprintf(stderr, "Trace written to %s (%ld bytes)\n", traceFileName, size);
+}
+
+static uint32_t executeCycles(uint32_t operation)
+{
+    switch (operation)
+    {
+    case OP_MUL:
+    case OP_MULH:
+    case OP_MULHSU:
+    case OP_MULHU:
+        return TIMING_MULTIPLY_CYCLES;
+    case OP_DIV:
+    case OP_DIVU:
+    case OP_REM:
+    case OP_REMU:
+        return TIMING_DIVIDE_CYCLES;
+    case OP_FMADD_S:
+    case OP_FMSUB_S:
+    case OP_FNMSUB_S:
+    case OP_FNMADD_S:
+    case OP_FADD_S:
+    case OP_FSUB_S:
+    case OP_FMUL_S:
+    case OP_FCVT_W_S:
+    case OP_FCVT_WU_S:
+    case OP_FCVT_S_W:
+    case OP_FCVT_S_WU:
+        return TIMING_FLOAT_CYCLES;
+    case OP_FDIV_S:
+    case OP_FSQRT_S:
+        return TIMING_FLOAT_DIVIDE_CYCLES;
+    default:
+        return 1;
+    }
+}
+
+#define FLOAT_REGISTER(reg) (NUM_REGISTERS + (reg)) // Scoreboard entry of a floating-point register
+
+void advancePipeline(Machine *m, const DecodedInstruction *d, uint32_t pc, uint32_t memoryCycles)
+{
+    // Account for an instruction the interpreter executed at pc, m->programCounter already holds the next one.
+    // memoryCycles is how long the caches kept it waiting for its code and data, which holds up the whole pipeline.
+    // The registers it reads are scoreboard entries, 0 stands for x0 or no register and is always ready.
+    Pipeline *p = &m->pipeline;
+    uint32_t sources[3] = {0, 0, 0};
+    uint32_t destination = 0;
+    uint32_t memoryResult = 0; // The result comes from MEM instead of EX
+    uint32_t penalty = 0;
+
+    switch (d->handler)
+    {
+    case HANDLER_R:
+    case HANDLER_A:
+        sources[0] = d->rs1;
+        sources[1] = d->rs2; // x0 for LR.W
+        destination = d->rd;
+        memoryResult = d->handler == HANDLER_A;
+        break;
+    case HANDLER_I:
+    case HANDLER_L:
+        sources[0] = d->rs1;
+        destination = d->rd;
+        memoryResult = d->handler == HANDLER_L;
+        break;
+    case HANDLER_S:
+        sources[0] = d->rs1;
+        sources[1] = d->rs2;
+        break;
+    case HANDLER_B:
+        sources[0] = d->rs1;
+        sources[1] = d->rs2;
+        if (predictorCount > 0)
+        {
+            penalty = predictControlFlow(m, d, pc);
+        }
+        else
+        {
+            penalty = (m->programCounter != pc + d->length) ? TIMING_BRANCH_PENALTY : 0;
+        }
+        break;
+    case HANDLER_LUI:
+    case HANDLER_AUIPC:
+        destination = d->rd;
+        break;
+    case HANDLER_JAL:
+        destination = d->rd;
+        penalty = (predictorCount > 0) ? predictControlFlow(m, d, pc) : TIMING_JUMP_PENALTY;
+        break;
+    case HANDLER_JALR:
+        sources[0] = d->rs1;
+        destination = d->rd;
+        penalty = (predictorCount > 0) ? predictControlFlow(m, d, pc) : TIMING_BRANCH_PENALTY;
+        break;
+    case HANDLER_CSR:
+        sources[0] = (d->operation < OP_CSRRWI) ? d->rs1 : 0; // The immediate forms use the field as a value
+        destination = d->rd;
+        break;
+    case HANDLER_F:
+        switch (d->operation)
+        {
+        case OP_FLW:
+            sources[0] = d->rs1;
+            destination = FLOAT_REGISTER(d->rd);
+            memoryResult = 1;
+            break;
+        case OP_FSW:
+            sources[0] = d->rs1;
+            sources[1] = FLOAT_REGISTER(d->rs2);
+            break;
+        case OP_FMADD_S:
+        case OP_FMSUB_S:
+        case OP_FNMSUB_S:
+        case OP_FNMADD_S:
+            sources[0] = FLOAT_REGISTER(d->rs1);
+            sources[1] = FLOAT_REGISTER(d->rs2);
+            sources[2] = FLOAT_REGISTER(d->imm >> 3);
+            destination = FLOAT_REGISTER(d->rd);
+            break;
+        case OP_FSQRT_S:
+            sources[0] = FLOAT_REGISTER(d->rs1);
+            destination = FLOAT_REGISTER(d->rd);
+            break;
+        case OP_FCVT_W_S:
+        case OP_FCVT_WU_S:
+        case OP_FMV_X_W:
+        case OP_FCLASS_S:
+            sources[0] = FLOAT_REGISTER(d->rs1);
+            destination = d->rd;
+            break;
+        case OP_FCVT_S_W:
+        case OP_FCVT_S_WU:
+        case OP_FMV_W_X:
+            sources[0] = d->rs1;
+            destination = FLOAT_REGISTER(d->rd);
+            break;
+        case OP_FEQ_S:
+        case OP_FLT_S:
+        case OP_FLE_S:
+            sources[0] = FLOAT_REGISTER(d->rs1);
+            sources[1] = FLOAT_REGISTER(d->rs2);
+            destination = d->rd;
+            break;
+        default:
+            sources[0] = FLOAT_REGISTER(d->rs1);
+            sources[1] = FLOAT_REGISTER(d->rs2);
+            destination = FLOAT_REGISTER(d->rd);
+            break;
+        }
+        break;
+    }
+
+    // The instruction enters EX once the one before has left it, once it has been fetched after a taken branch
+    // and once its operands can be forwarded. Each cycle it waits is counted for the first of these reasons.
+    uint64_t issue = p->nextIssue;
+    if (p->executeFree > issue)
+    {
+        m->stats.executeStalls += p->executeFree - issue;
+        issue = p->executeFree;
+    }
+    if (p->fetchReady > issue)
+    {
+        m->stats.flushCycles += p->fetchReady - issue;
+        issue = p->fetchReady;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        // Only loads finish late enough for a stall, the other results are forwarded as soon as EX ends
+        if (p->ready[sources[i]] > issue)
+        {
+            m->stats.loadUseStalls += p->ready[sources[i]] - issue;
+            issue = p->ready[sources[i]];
+        }
+    }
+
+    if (memoryCycles)
+    {
+        m->stats.memoryStalls += memoryCycles;
+        issue += memoryCycles;
+    }
+
+    uint32_t cycles = executeCycles(d->operation);
+    p->nextIssue = issue + 1;
+    p->executeFree = issue + cycles;
+    p->fetchReady = issue + 1 + penalty;
+    if (destination != 0)
+    {
+        p->ready[destination] = issue + cycles + memoryResult * TIMING_LOAD_DELAY;
+    }
+
+    // IF and ID of the first instruction come before cycle 0, MEM and WB follow the last cycle in EX
+    uint64_t finished = issue + cycles + 4;
+    m->stats.cycles += finished - p->finished;
+    p->finished = finished;
+}
+
+#undef FLOAT_REGISTER
+
+static inline void executeInstruction(Machine *m, const DecodedInstruction *decoded)
+{
+    // Trace and execute one decoded instruction, for the interpreter and for --decode replaying a trace
+    if (decoded->length == 2)
+    {
+        TRACE(TRACE_INSTRUCTIONS, "Compressed instruction: %04X\n", decoded->instruction);
+    }
+    else
+    {
+        TRACE(TRACE_INSTRUCTIONS, "Instruction: %08X, Opcode: %02X\n", decoded->instruction, decoded->instruction & 0x7F);
+    }
+
+    switch (decoded->handler)
+    {
+    case HANDLER_R:
+        TRACE(TRACE_INSTRUCTIONS, "R-type instruction\n");
+        processRType(m, decoded);
+        break;
+    case HANDLER_I:
+        TRACE(TRACE_INSTRUCTIONS, "I-type instruction\n");
+        processIType(m, decoded);
+        break;
+    case HANDLER_S:
+        TRACE(TRACE_INSTRUCTIONS, "S-type instruction\n");
+        processSType(m, decoded);
+        break;
+    case HANDLER_LUI:
+        TRACE(TRACE_INSTRUCTIONS, "U-type instruction\n");
+        processUType(m, decoded);
+        break;
+    case HANDLER_ECALL:
+        TRACE(TRACE_INSTRUCTIONS, "E-call instruction\nThe program has ended.\n\n");
+        m->programState = PROGRAM_EXITED;
+        break;
+    case HANDLER_AUIPC:
+        TRACE(TRACE_INSTRUCTIONS, "AUIPC instruction\n");
+        processUType(m, decoded);
+        break;
+    case HANDLER_B:
+        TRACE(TRACE_INSTRUCTIONS, "B-type instruction\n");
+        processBType(m, decoded);
+        break;
+    case HANDLER_JAL:
+        TRACE(TRACE_INSTRUCTIONS, "JAL instruction\n");
+        processJALType(m, decoded);
+        break;
+    case HANDLER_JALR:
+        TRACE(TRACE_INSTRUCTIONS, "JALR instruction\n");
+        processJALRType(m, decoded);
+        break;
+    case HANDLER_L:
+        TRACE(TRACE_INSTRUCTIONS, "L-type instruction\n");
+        processLType(m, decoded);
+        break;
+    case HANDLER_A:
+        TRACE(TRACE_INSTRUCTIONS, "A-type instruction\n");
+        processAType(m, decoded);
+        break;
+    case HANDLER_F:
+        TRACE(TRACE_INSTRUCTIONS, "F-type instruction\n");
+        processFType(m, decoded);
+        break;
+    case HANDLER_CSR:
+        TRACE(TRACE_INSTRUCTIONS, "CSR instruction\n");
+        processCSRType(m, decoded);
+        break;
+    case HANDLER_FENCE:
+        TRACE(TRACE_INSTRUCTIONS, "FENCE instruction\n");
+        processFenceType(m, decoded);
+        break;
+    default:
+        // The program counter would not move past the instruction, so the program is stopped
+        fprintf(m->output, "Error: Unrecognized opcode '%02X' at PC 0x%08X.\n", decoded->instruction & 0x7F, m->programCounter);
+        m->programState = PROGRAM_FAULTED;
+        break;
+    }
+}
+
+void runProgram(Machine *m)
+{
+    if (profileFileName && !m->profile && !startProfile(m))
+    {
+        fprintf(m->output, "Error: Could not allocate the profile\n");
+        m->programState = PROGRAM_FAULTED;
+        return;
+    }
+    if (traceFileName && !m->trace && !startTrace(m))
+    {
+        fprintf(m->output, "Error: Could not allocate the trace buffer\n");
+        m->programState = PROGRAM_FAULTED;
+        return;
+    }
+
+    // While sampling, the models only follow the instructions that warm them up and the measured ones, and the
+    // faster engines run the others
+    int detailed = !m->sampling || m->sampling->detailed;
+    int timing = timingModel && detailed;
+    int caches = cacheModel && detailed;
+    int predicting = predictorCount > 0 && detailed;
+    int fast = !timing && !caches && !predicting;
+
+    // Execute the instructions from the simulated memory, until the program ends or until the stopAt
+    // instruction count of the hart's turn is reached
+    while (m->programState == PROGRAM_RUNNING && m->stats.instructionsExecuted < m->stopAt)
+    {
+        // A faster engine runs until it reaches something it leaves to the interpreter below
+        if (engine == ENGINE_THREADED && fast)
+        {
+            runThreaded(m);
+        }
+        else if ((engine == ENGINE_BLOCK || engine == ENGINE_JIT) && fast)
+        {
+            runBlocks(m);
+        }
+
+        // The program ends when the program counter leaves the loaded program image
+        if (m->programSize < 2 || m->programCounter > m->programSize - 2)
+        {
+            m->programState = PROGRAM_EXITED;
+            break;
+        }
+
+        // Instructions are 4 bytes long, or 2 if compressed, and must be halfword aligned
+        if (m->programCounter & 0x1)
+        {
+            fprintf(m->output, "Error: Misaligned program counter 0x%08X.\n", m->programCounter);
+            m->programState = PROGRAM_FAULTED;
+            break;
+        }
+
+        // Decode the instruction the first time it is executed, afterwards use the cached decoding
+        DecodedInstruction *decoded = &m->decodeCache[m->programCounter / 2];
+        if (decoded->handler == HANDLER_UNDECODED)
+        {
+            decodeInstruction(fetchInstruction(m, m->programCounter), decoded);
+        }
+
+        // A 4-byte instruction in the last halfword of the program is cut off, so the program ends there too
+        if (m->programCounter + decoded->length > m->programSize)
+        {
+            m->programState = PROGRAM_EXITED;
+            break;
+        }
+        m->stats.instructionsExecuted++;
+        uint32_t pc = m->programCounter;
+        if (m->profile)
+        {
+            m->profile->counts[pc / 2]++;
+            m->profile->handlers[decoded->handler]++;
+        }
+
+        // The cache model needs the address of a load or store before the instruction changes its base register
+        uint32_t memoryCycles = 0;
+        uint32_t dataAddress = 0;
+        if (caches)
+        {
+            memoryCycles = fetchThroughCaches(m, pc, decoded->length);
+            dataAddress = m->registers[decoded->rs1] + decoded->imm;
+        }
+
+        uint32_t traceWidth = 0;
+        uint32_t traceAddress = 0;
+        uint32_t traceValue = 0;
+        if (m->trace)
+        {
+            traceWidth = prepareTraceAccess(m, decoded, &traceAddress, &traceValue);
+        }
+
+        executeInstruction(m, decoded);
+
+        if (m->trace && m->programState != PROGRAM_FAULTED)
+        {
+            traceInstruction(m, decoded, pc, traceWidth, traceAddress, traceValue);
+        }
+
+        if (caches && m->programState != PROGRAM_FAULTED)
+        {
+            memoryCycles += accessDataThroughCaches(m, decoded, pc, dataAddress);
+        }
+
+        if (m->profile && (decoded->handler == HANDLER_JAL || decoded->handler == HANDLER_JALR))
+        {
+            profileControlFlow(m, decoded, pc);
+        }
+
+        // The timing model runs the predictors itself, as they decide its branch penalties
+        if (timing)
+        {
+            advancePipeline(m, decoded, pc, memoryCycles);
+        }
+        else if (predicting && (decoded->handler == HANDLER_B || decoded->handler == HANDLER_JAL || decoded->handler == HANDLER_JALR))
+        {
+            predictControlFlow(m, decoded, pc);
+        }
+    }
+}
+
+void runSampled(Machine *m)
+{
+    // Alternate running fast, warming up the models and measuring a sample until the program ends. A sample the end
+    // of the program cuts short is left out, it would give the instructions before the end too much weight.
+    Sampling *s = calloc(1, sizeof(Sampling));
+    if (!s)
+    {
+        fprintf(m->output, "Error: Could not allocate the samples\n");
+        m->programState = PROGRAM_FAULTED;
+        return;
+    }
+    m->sampling = s;
+    while (m->programState == PROGRAM_RUNNING)
+    {
+        s->detailed = 0;
+        m->stopAt = m->stats.instructionsExecuted + sampleSkip;
+        runProgram(m);
+        s->detailed = 1;
+        m->stopAt = m->stats.instructionsExecuted + sampleWarmup;
+        runProgram(m);
+
+        Statistics before = m->stats;
+        m->stopAt = m->stats.instructionsExecuted + sampleLength;
+        runProgram(m);
+        if (m->stats.instructionsExecuted - before.instructionsExecuted < sampleLength)
+        {
+            break;
+        }
+
+        if (s->count == s->capacity)
+        {
+            uint32_t capacity = s->capacity ? 2 * s->capacity : 64;
+            Sample *samples = realloc(s->samples, capacity * sizeof(Sample));
+            if (!samples)
+            {
+                fprintf(m->output, "Error: Could not allocate the samples\n");
+                m->programState = PROGRAM_FAULTED;
+                break;
+            }
+            s->samples = samples;
+            s->capacity = capacity;
+        }
+        Sample *sample = &s->samples[s->count++];
+        sample->instructions = m->stats.instructionsExecuted - before.instructionsExecuted;
+        sample->cycles = m->stats.cycles - before.cycles;
+        for (int level = 0; level < CACHE_LEVELS; level++)
+        {
+            const CacheCounters *now = &m->stats.caches[level];
+            const CacheCounters *then = &before.caches[level];
+            sample->accesses[level] = (now->reads + now->writes) - (then->reads + then->writes);
+            sample->misses[level] = (now->readMisses + now->writeMisses) - (then->readMisses + then->writeMisses);
+        }
+        sample->branches = m->stats.conditionalBranches - before.conditionalBranches;
+        for (int j = 0; j < predictorCount; j++)
+        {
+            sample->mispredictions[j] = m->stats.branchMispredictions[j] - before.branchMispredictions[j];
+        }
+    }
+    s->detailed = 0;
+    m->stopAt = UINT64_MAX;
+}
+
+static double confidenceInterval(const double *values, uint32_t count, double *mean)
+{
+    // The mean of the values, and half the width of its 95% confidence interval from Student's t distribution
+    static const double t[SAMPLE_T_VALUES] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                              2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                              2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    double sum = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        sum += values[i];
+    }
+    *mean = sum / count;
+    if (count < 2)
+    {
+        return 0;
+    }
+    double squares = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        squares += (values[i] - *mean) * (values[i] - *mean);
+    }
+    double variance = squares / (count - 1);
+    return (count - 1 <= SAMPLE_T_VALUES ? t[count - 2] : 1.960) * sqrt(variance / count);
+}
+
+static const char *formatInterval(char *text, size_t size, double interval, uint32_t count, int decimals)
+{
+    // A single sample tells nothing about the spread, so it gets no interval instead of one of width 0
+    if (count < 2)
+    {
+        return "(no interval)";
+    }
+    snprintf(text, size, "+/- %.*f", decimals, interval);
+    return text;
+}
+
+void printSampling(const Machine *m, const Statistics *total)
+{
+    // Each sample is as long as the others, so the mean of their CPIs and of their misses per 1000 instructions
+    // estimates those of the whole run, and the miss rates are those of all samples together
+    const Sampling *s = m->sampling;
+    uint64_t instructions = total->instructionsExecuted;
+    if (!s || s->count == 0)
+    {
+        fprintf(stderr, "Sampling: no complete sample in the %llu instructions of the program\n", (unsigned long long)instructions);
+        return;
+    }
+    double *values = calloc(s->count, sizeof(double));
+    if (!values)
+    {
+        return;
+    }
+    fprintf(stderr, "Sampling: %u samples of %llu instructions, %.2f%% of the %llu instructions measured, %s\n",
+            s->count, (unsigned long long)sampleLength, 100.0 * s->count * sampleLength / instructions, (unsigned long long)instructions,
+            s->count < 2 ? "too few for confidence intervals" : "with 95% confidence intervals");
+    double mean;
+    double interval;
+    char text[32];
+    if (timingModel)
+    {
+        for (uint32_t i = 0; i < s->count; i++)
+        {
+            values[i] = (double)s->samples[i].cycles / s->samples[i].instructions;
+        }
+        interval = confidenceInterval(values, s->count, &mean);
+        fprintf(stderr, "CPI: %.3f %s", mean, formatInterval(text, sizeof(text), interval, s->count, 3));
+        fprintf(stderr, ", about %.0f %s cycles in total\n", mean * instructions, formatInterval(text, sizeof(text), interval * instructions, s->count, 0));
+    }
+    for (int level = 0; cacheModel && level < CACHE_LEVELS; level++)
+    {
+        if (cacheConfigs[level].size == 0)
+        {
+            continue;
+        }
+        uint64_t accesses = 0;
+        uint64_t misses = 0;
+        for (uint32_t i = 0; i < s->count; i++)
+        {
+            values[i] = 1000.0 * s->samples[i].misses[level] / s->samples[i].instructions;
+            accesses += s->samples[i].accesses[level];
+            misses += s->samples[i].misses[level];
+        }
+        interval = confidenceInterval(values, s->count, &mean);
+        fprintf(stderr, "%s misses per 1000 instructions: %.2f %s, %.2f%% missed\n", cacheNames[level], mean,
+                formatInterval(text, sizeof(text), interval, s->count, 2), accesses ? 100.0 * misses / accesses : 0.0);
+    }
+    for (int j = 0; j < predictorCount; j++)
+    {
+        uint64_t branches = 0;
+        uint64_t mispredictions = 0;
+        for (uint32_t i = 0; i < s->count; i++)
+        {
+            values[i] = 1000.0 * s->samples[i].mispredictions[j] / s->samples[i].instructions;
+            branches += s->samples[i].branches;
+            mispredictions += s->samples[i].mispredictions[j];
+        }
+        interval = confidenceInterval(values, s->count, &mean);
+        fprintf(stderr, "Predictor %s mispredictions per 1000 instructions: %.2f %s, %.2f%% correct\n", predictors[j]->name, mean,
+                formatInterval(text, sizeof(text), interval, s->count, 2), branches ? 100.0 - 100.0 * mispredictions / branches : 100.0);
+    }
+    free(values);
+}
+
+int loadProgram(Machine *m, const char *fileName)
+{
+    // Check if the file exists
+    FILE *file = fopen(fileName, "rb");
+    if (!file)
+    {
+        fprintf(m->output, "Error: File '%s' not found.\n", fileName);
+        return 0;
+    }
+
+    if (!initializeMemory(m))
+    {
+        fclose(file);
+        return 0;
+    }
+
+    // The program is mapped or copied into memory, the mappings stay valid after the file is closed
+    int loaded = loadInstructions(m, file);
+    fclose(file);
+    return loaded;
+}
+
+int attachHart(Machine *m, Machine *first, uint32_t hartId)
+{
+    // Every further hart shares the memory and program of hart 0 and starts at the same entry point. Like
+    // on boot with OpenSBI, a0 holds the hart id so the program can tell the harts apart.
+    m->memory = first->memory;
+    m->pageDirectory = first->pageDirectory;
+    m->sharesMemory = 1;
+    m->programSize = first->programSize;
+    m->programCounter = first->programCounter;
+    m->hartId = hartId;
+    m->registers[10] = hartId;
+
+    // The decoded and translated code is the hart's own, so a store into the code is only seen by the
+    // hart that made it, a FENCE.I does not make other harts see it either
+    m->decodeCache = calloc(m->programSize / 2 + 1, sizeof(DecodedInstruction));
+    if (!m->decodeCache)
+    {
+        fprintf(m->output, "Error: Could not allocate the decode cache\n");
+        return 0;
+    }
+    return 1;
+}
+
+// State of the snapshot of this run, which the end of the program reports
+int snapshotTaken = 0;
+int snapshotWritten = 0;
+uint64_t snapshotInstructions = 0; // Instructions the program had executed when it was taken
+#ifdef FORK_SUPPORTED
+pid_t snapshotWriter = 0; // The forked process writing it
+#endif
+
+static int writeSnapshotWords(FILE *file, const uint32_t *words, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t word = LITTLE_ENDIAN_32(words[i]);
+        if (fwrite(&word, sizeof(word), 1, file) != 1)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int readSnapshotWords(FILE *file, uint32_t *words, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t word;
+        if (fread(&word, sizeof(word), 1, file) != 1)
+        {
+            return 0;
+        }
+        words[i] = LITTLE_ENDIAN_32(word);
+    }
+    return 1;
+}
+
+static int writeSnapshotPage(FILE *file, uint32_t page, const uint8_t *data, size_t size)
+{
+    // A page of memory, or the first size bytes of a page at the end of the flat memory, unless it is all zeros
+    static const uint8_t zeros[PAGE_SIZE];
+    if (memcmp(data, zeros, size) == 0)
+    {
+        return 1;
+    }
+    uint8_t padded[PAGE_SIZE];
+    memcpy(padded, data, size);
+    memset(padded + size, 0, PAGE_SIZE - size);
+    return writeSnapshotWords(file, &page, 1) && fwrite(padded, 1, PAGE_SIZE, file) == PAGE_SIZE;
+}
+
+int writeSnapshot(Machine **harts, int count, int nextHart)
+{
+    // The file holds the memory configuration and the next hart to run, the registers of every hart, then the pages of the flat memory and
+    // the pages of sparse memory, each list ended by SNAPSHOT_END. Untouched memory reads as zeros and is left out.
+    FILE *file = fopen(snapshotFileName, "wb");
+    if (!file)
+    {
+        return 0;
+    }
+    Machine *first = harts[0];
+    uint32_t header[6] = {(uint32_t)memorySize, (uint32_t)(memorySize >> 32), (uint32_t)sparseMemory, (uint32_t)count, first->programSize, (uint32_t)nextHart};
+    int written = fwrite(SNAPSHOT_MAGIC, 1, strlen(SNAPSHOT_MAGIC), file) == strlen(SNAPSHOT_MAGIC) && writeSnapshotWords(file, header, 6);
+    for (int hart = 0; written && hart < count; hart++)
+    {
+        Machine *m = harts[hart];
+        uint32_t state[7] = {m->programCounter, (uint32_t)m->programState, (uint32_t)m->reservationValid, m->reservationAddress,
+                             m->reservationValue, m->fflags, m->frm};
+        written = writeSnapshotWords(file, state, 7) && writeSnapshotWords(file, m->registers, NUM_REGISTERS) &&
+                  writeSnapshotWords(file, m->floatRegisters, NUM_REGISTERS);
+    }
+
+    uint32_t end = SNAPSHOT_END;
+    for (uint64_t address = 0; written && address < memorySize; address += PAGE_SIZE)
+    {
+        size_t size = (memorySize - address < PAGE_SIZE) ? (size_t)(memorySize - address) : PAGE_SIZE;
+        written = writeSnapshotPage(file, (uint32_t)(address >> PAGE_BITS), &first->memory[address], size);
+    }
+    written = written && writeSnapshotWords(file, &end, 1);
+    for (uint32_t i = 0; written && first->pageDirectory && i < PAGE_TABLE_SIZE; i++)
+    {
+        for (uint32_t j = 0; written && first->pageDirectory[i] && j < PAGE_TABLE_SIZE; j++)
+        {
+            if (first->pageDirectory[i][j])
+            {
+                written = writeSnapshotPage(file, (i << PAGE_TABLE_BITS) | j, first->pageDirectory[i][j], PAGE_SIZE);
+            }
+        }
+    }
+    written = written && writeSnapshotWords(file, &end, 1);
+    return (fclose(file) == 0) && written;
+}
+
+void takeSnapshot(Machine **harts, int count, int nextHart)
+{
+    // Called between turns, when every hart has stopped, nextHart is the one whose turn comes next. A forked copy of the process writes the snapshot from its
+    // copy-on-write view of the memory while this one keeps running, and the end of the program waits for it.
+    uint64_t instructions = 0;
+    for (int hart = 0; hart < count; hart++)
+    {
+        instructions += harts[hart]->stats.instructionsExecuted;
+    }
+    snapshotTaken = 1;
+    snapshotInstructions = instructions;
+#ifdef FORK_SUPPORTED
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Scanning a large memory takes a while, and must not slow the simulation down on a busy host
+        setpriority(PRIO_PROCESS, 0, 19);
+        _exit(writeSnapshot(harts, count, nextHart) ? 0 : 1);
+    }
+    if (pid > 0)
+    {
+        snapshotWriter = pid;
+        return;
+    }
+#endif
+    snapshotWritten = writeSnapshot(harts, count, nextHart);
+}
+
+void finishSnapshot()
+{
+#ifdef FORK_SUPPORTED
+    int status;
+    if (snapshotWriter > 0 && waitpid(snapshotWriter, &status, 0) == snapshotWriter)
+    {
+        snapshotWritten = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+#endif
+    if (!snapshotTaken)
+    {
+        fprintf(stderr, "Error: The program ended before the snapshot after %llu instructions.\n", (unsigned long long)snapshotAt);
+    }
+    else if (!snapshotWritten)
+    {
+        fprintf(stderr, "Error: Could not write the snapshot to %s.\n", snapshotFileName);
+    }
+    else
+    {
+        fprintf(stderr, "Snapshot after %llu instructions written to %s\n", (unsigned long long)snapshotInstructions, snapshotFileName);
+    }
+}
+
+// The harts of the program, which take turns of quantum instructions on one or more host threads
+typedef struct
+{
+    Machine **harts;
+    int count;
+    int *claimed;  // Set while a thread runs the hart
+    uint64_t turn; // Turn t belongs to hart t % count
+    int finished;  // Harts that ended
+    int faulted;   // A hart stopped with an error, which ends all harts
+} Scheduler;
+
+static int claimHart(int *claimed)
+{
+#ifdef THREADS_SUPPORTED
+    int expected = 0;
+    return __atomic_compare_exchange_n(claimed, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#else
+    *claimed = 1;
+    return 1;
+#endif
+}
+
+static uint64_t programInstructions(Scheduler *scheduler)
+{
+    uint64_t instructions = 0;
+    for (int hart = 0; hart < scheduler->count; hart++)
+    {
+        instructions += scheduler->harts[hart]->stats.instructionsExecuted;
+    }
+    return instructions;
+}
+
+void *runScheduledHarts(void *argument)
+{
+    // Without a lock, the threads take the next turn from the shared counter and run it unless another thread
+    // is still running that hart's previous turn. On one thread the harts simply run round-robin.
+    Scheduler *scheduler = argument;
+    while (ATOMIC_LOAD(&scheduler->finished) < scheduler->count && !ATOMIC_LOAD(&scheduler->faulted))
+    {
+        int hart = (int)(ATOMIC_FETCH_ADD(&scheduler->turn, 1) % scheduler->count);
+        Machine *m = scheduler->harts[hart];
+        if (!claimHart(&scheduler->claimed[hart]))
+        {
+            continue;
+        }
+
+        if (m->programState == PROGRAM_RUNNING)
+        {
+            // With --snapshot the harts run on one thread, and the turn that reaches the snapshot ends there
+            uint64_t executed = (snapshotAt && !snapshotTaken) ? programInstructions(scheduler) : 0;
+            m->stopAt = m->stats.instructionsExecuted + quantum;
+            if (snapshotAt && !snapshotTaken && snapshotAt - executed < quantum)
+            {
+                m->stopAt = m->stats.instructionsExecuted + (snapshotAt - executed);
+            }
+            runProgram(m);
+            if (snapshotAt && !snapshotTaken && programInstructions(scheduler) >= snapshotAt)
+            {
+                takeSnapshot(scheduler->harts, scheduler->count, (hart + 1) % scheduler->count);
+            }
+            if (m->programState != PROGRAM_RUNNING)
+            {
+                ATOMIC_FETCH_ADD(&scheduler->finished, 1);
+            }
+            if (m->programState == PROGRAM_FAULTED)
+            {
+                ATOMIC_STORE(&scheduler->faulted, 1);
+            }
+        }
+        ATOMIC_STORE(&scheduler->claimed[hart], 0);
+    }
+    return NULL;
+}
+
+int runHarts(Machine **harts, int count)
+{
+    // Returns 0 if a hart stopped with an error
+    if (count == 1)
+    {
+        if (sampleLength)
+        {
+            runSampled(harts[0]);
+            return harts[0]->programState != PROGRAM_FAULTED;
+        }
+        if (snapshotAt)
+        {
+            harts[0]->stopAt = snapshotAt;
+            runProgram(harts[0]);
+            if (harts[0]->programState == PROGRAM_RUNNING)
+            {
+                takeSnapshot(harts, 1, 0);
+            }
+            harts[0]->stopAt = UINT64_MAX;
+        }
+        runProgram(harts[0]);
+        return harts[0]->programState != PROGRAM_FAULTED;
+    }
+
+    Scheduler scheduler;
+    memset(&scheduler, 0, sizeof(scheduler));
+    scheduler.harts = harts;
+    scheduler.count = count;
+    scheduler.turn = firstTurn;
+    for (int hart = 0; hart < count; hart++)
+    {
+        // Harts of a snapshot may have ended already
+        scheduler.finished += harts[hart]->programState != PROGRAM_RUNNING;
+    }
+    scheduler.claimed = calloc(count, sizeof(int));
+    if (!scheduler.claimed)
+    {
+        printf("Error: Could not allocate the scheduler\n");
+        return 0;
+    }
+
+#ifdef THREADS_SUPPORTED
+    // One thread by default, which keeps the interleaving of the harts the same on every run
+    int threadCount = jobs > 0 ? jobs : 1;
+    if (threadCount > count)
+    {
+        threadCount = count;
+    }
+    pthread_t threads[MAX_HARTS];
+    int started = 0;
+    while (started < threadCount - 1 && pthread_create(&threads[started], NULL, runScheduledHarts, &scheduler) == 0)
+    {
+        started++;
+    }
+    runScheduledHarts(&scheduler);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    runScheduledHarts(&scheduler);
+#endif
+
+    free(scheduler.claimed);
+    return !scheduler.faulted;
+}
+
+void resetSimulator(Machine *m)
+{
+    // Throw away everything the previous program left behind, so the next one starts like in a new process
+    if (m->blockCache)
+    {
+        flushBlocks(m);
+        free(m->blockCache);
+        free(m->blockHalfwords);
+        m->blockCache = NULL;
+        m->blockHalfwords = NULL;
+    }
+    free(m->threadedTargets);
+    m->threadedTargets = NULL;
+    free(m->decodeCache);
+    m->decodeCache = NULL;
+    releaseMemory(m);
+
+    initializeRegisters(m);
+    m->programCounter = 0;
+    m->programSize = 0;
+    m->programState = PROGRAM_RUNNING;
+    m->reservationValid = 0;
+    memset(&m->pipeline, 0, sizeof(m->pipeline));
+    if (m->branchModel)
+    {
+        resetBranchModel(m->branchModel);
+    }
+    if (cacheModel)
+    {
+        resetCaches(m);
+    }
+    destroyProfile(m->profile);
+    m->profile = NULL;
+    destroyTrace(m->trace);
+    m->trace = NULL;
+#ifdef JIT_SUPPORTED
+    m->jitUsed = 0;
+    m->jitAccessFault = 0;
+#endif
+}
+
+Machine *createMachine()
+{
+    // A machine without a program, its messages go to stdout
+    Machine *m = calloc(1, sizeof(Machine));
+    if (!m)
+    {
+        printf("Error: Could not allocate the machine\n");
+        return NULL;
+    }
+    m->output = stdout;
+    m->programState = PROGRAM_RUNNING;
+    m->stopAt = UINT64_MAX;
+    initializeTlb(m);
+    if (predictorCount > 0)
+    {
+        m->branchModel = createBranchModel();
+        if (!m->branchModel)
+        {
+            printf("Error: Could not allocate the branch predictors\n");
+            free(m);
+            return NULL;
+        }
+    }
+    if (cacheModel && !createCaches(m))
+    {
+        printf("Error: Could not allocate the caches\n");
+        destroyCaches(m);
+        destroyBranchModel(m->branchModel);
+        free(m);
+        return NULL;
+    }
+#ifdef JIT_SUPPORTED
+    if (engine == ENGINE_JIT)
+    {
+        initializeJit(m);
+    }
+#endif
+    return m;
+}
+
+void destroyMachine(Machine *m)
+{
+    resetSimulator(m);
+    destroyBranchModel(m->branchModel);
+    destroyCaches(m);
+#ifdef JIT_SUPPORTED
+    if (m->jitBuffer)
+    {
+        munmap(m->jitBuffer, JIT_BUFFER_SIZE);
+    }
+#endif
+    free(m);
+}
+
+int restoreSnapshot(Machine **harts)
+{
+    // Create the harts of a snapshot, with its memory configuration, and return how many there are, 0 on an error
+    FILE *file = fopen(restoreFileName, "rb");
+    if (!file)
+    {
+        printf("Error: File '%s' not found.\n", restoreFileName);
+        return 0;
+    }
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    uint32_t header[6];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+        !readSnapshotWords(file, header, 6))
+    {
+        printf("Error: '%s' is not a valid snapshot.\n", restoreFileName);
+        fclose(file);
+        return 0;
+    }
+    memorySize = header[0] | ((uint64_t)header[1] << 32);
+    sparseMemory = header[2] != 0;
+    int count = (int)header[3];
+    firstTurn = (int)header[5];
+    if (memorySize < MIN_MEMORY_SIZE || memorySize > MAX_MEMORY_SIZE || count < 1 || count > MAX_HARTS || header[4] > memorySize || header[5] >= (uint32_t)count)
+    {
+        printf("Error: '%s' is not a valid snapshot.\n", restoreFileName);
+        fclose(file);
+        return 0;
+    }
+
+    // Hart 0 owns the memory and the others share it, like after loading a program
+    int valid = 1;
+    for (int hart = 0; valid && hart < count; hart++)
+    {
+        harts[hart] = createMachine();
+        if (!harts[hart])
+        {
+            fclose(file);
+            return 0;
+        }
+        if (hart == 0)
+        {
+            harts[0]->programSize = header[4];
+            harts[0]->decodeCache = calloc(harts[0]->programSize / 2 + 1, sizeof(DecodedInstruction));
+            valid = initializeMemory(harts[0]) && harts[0]->decodeCache;
+        }
+        else
+        {
+            valid = attachHart(harts[hart], harts[0], hart);
+        }
+
+        Machine *m = harts[hart];
+        uint32_t state[7];
+        valid = valid && readSnapshotWords(file, state, 7) && readSnapshotWords(file, m->registers, NUM_REGISTERS) &&
+                readSnapshotWords(file, m->floatRegisters, NUM_REGISTERS);
+        m->programCounter = state[0];
+        m->programState = (int)state[1];
+        m->reservationValid = (int)state[2];
+        m->reservationAddress = state[3];
+        m->reservationValue = state[4];
+        m->fflags = state[5] & 0x1F;
+        m->frm = state[6] & 0x7;
+    }
+
+    // The flat memory pages, then the sparse pages
+    uint8_t data[PAGE_SIZE];
+    for (int list = 0; valid && list < 2; list++)
+    {
+        uint32_t page;
+        while ((valid = readSnapshotWords(file, &page, 1)) && page != SNAPSHOT_END)
+        {
+            uint64_t address = (uint64_t)page << PAGE_BITS;
+            if (fread(data, 1, PAGE_SIZE, file) != PAGE_SIZE || page >= (1u << (32 - PAGE_BITS)) ||
+                (list == 0 ? address >= memorySize : !sparseMemory))
+            {
+                valid = 0;
+                break;
+            }
+            if (list == 0)
+            {
+                memcpy(&harts[0]->memory[address], data, (memorySize - address < PAGE_SIZE) ? (size_t)(memorySize - address) : PAGE_SIZE);
+            }
+            else
+            {
+                memcpy(walkPageTable(harts[0], page), data, PAGE_SIZE);
+            }
+        }
+    }
+    fclose(file);
+    if (!valid)
+    {
+        printf("Error: '%s' is not a valid snapshot.\n", restoreFileName);
+        return 0;
+    }
+    return count;
+}
+
+int decodeTrace(const char *fileName)
+{
+    // Print a trace written with --trace-file like the interpreter traces. Each hart's instructions are executed
+    // again on a machine of its own with the registers of the trace, whose memory is filled from the accesses
+    // recorded, and the values recorded are put back afterwards in case another hart made them different.
+    FILE *file = fopen(fileName, "rb");
+    if (!file)
+    {
+        printf("Error: File '%s' not found.\n", fileName);
+        return 0;
+    }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    uint8_t *chunk = malloc(TRACE_BUFFER_SIZE);
+    Machine **harts = calloc(MAX_HARTS, sizeof(Machine *));
+    uint32_t *nextPcs = calloc(MAX_HARTS, sizeof(uint32_t));
+    int valid = chunk && harts && nextPcs && fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+
+    // The replaying machines have a small flat memory and sparse pages for every other address
+    memorySize = MIN_MEMORY_SIZE;
+    sparseMemory = 1;
+    uint64_t instructions = 0;
+    uint8_t header[8];
+    while (valid && fread(header, 1, sizeof(header), file) == sizeof(header))
+    {
+        uint32_t hartId = getTrace32(header);
+        uint32_t size = getTrace32(header + 4);
+        if (hartId >= MAX_HARTS || size > TRACE_BUFFER_SIZE || fread(chunk, 1, size, file) != size)
+        {
+            valid = 0;
+            break;
+        }
+        if (!harts[hartId])
+        {
+            harts[hartId] = createMachine();
+            if (!harts[hartId] || !initializeMemory(harts[hartId]))
+            {
+                valid = 0;
+                break;
+            }
+            harts[hartId]->hartId = hartId;
+        }
+        Machine *m = harts[hartId];
+
+        const uint8_t *p = chunk;
+        const uint8_t *end = chunk + size;
+        while (p < end)
+        {
+            uint8_t flags = *p++;
+            if (flags == TRACE_RECORD_START)
+            {
+                if (end - p < TRACE_START_SIZE - 1)
+                {
+                    valid = 0;
+                    break;
+                }
+                nextPcs[hartId] = getTrace32(p);
+                p += 4;
+                for (int i = 0; i < NUM_REGISTERS; i++, p += 4)
+                {
+                    m->registers[i] = getTrace32(p);
+                }
+                for (int i = 0; i < NUM_REGISTERS; i++, p += 4)
+                {
+                    m->floatRegisters[i] = getTrace32(p);
+                }
+                m->frm = (getTrace32(p) >> 5) & 0x7;
+                m->fflags = getTrace32(p) & 0x1F;
+                p += 4;
+                continue;
+            }
+
+            uint32_t width = flags & TRACE_RECORD_WIDTH;
+            width = (width == 3) ? 4 : width;
+            size_t length = ((flags & TRACE_RECORD_PC) ? 4 : 0) + ((flags & TRACE_RECORD_COMPRESSED) ? 2 : 4) +
+                            ((flags & (TRACE_RECORD_X_VALUE | TRACE_RECORD_F_VALUE)) ? 4 : 0) + (width ? 8 : 0);
+            if (flags > 0x3F || (size_t)(end - p) < length)
+            {
+                valid = 0;
+                break;
+            }
+            uint32_t pc = nextPcs[hartId];
+            if (flags & TRACE_RECORD_PC)
+            {
+                pc = getTrace32(p);
+                p += 4;
+            }
+            uint32_t instruction = (flags & TRACE_RECORD_COMPRESSED) ? (uint32_t)(p[0] | (p[1] << 8)) : getTrace32(p);
+            p += (flags & TRACE_RECORD_COMPRESSED) ? 2 : 4;
+            uint32_t value = 0;
+            if (flags & (TRACE_RECORD_X_VALUE | TRACE_RECORD_F_VALUE))
+            {
+                value = getTrace32(p);
+                p += 4;
+            }
+            if (width)
+            {
+                // A load finds the value it read, and an atomic the value it read and may compare
+                uint32_t address = getTrace32(p);
+                if (!OUTSIDE_MEMORY(address, width))
+                {
+                    storeFlat(m, address, width, getTrace32(p + 4));
+                }
+                else
+                {
+                    storeOutside(m, address, width, getTrace32(p + 4));
+                }
+                p += 8;
+            }
+
+            DecodedInstruction decoded;
+            decodeInstruction(instruction, &decoded);
+            m->programCounter = pc;
+            m->programState = PROGRAM_RUNNING;
+            executeInstruction(m, &decoded);
+            if (flags & TRACE_RECORD_X_VALUE)
+            {
+                m->registers[decoded.rd] = value;
+            }
+            else if (flags & TRACE_RECORD_F_VALUE)
+            {
+                m->floatRegisters[decoded.rd] = value;
+            }
+            nextPcs[hartId] = pc + decoded.length;
+            instructions++;
+        }
+    }
+    if (valid && ferror(file))
+    {
+        valid = 0;
+    }
+
+    if (!valid)
+    {
+        printf("Error: '%s' is not a valid trace.\n", fileName);
+    }
+    else
+    {
+        fprintf(stderr, "Instructions decoded: %llu\n", (unsigned long long)instructions);
+    }
+    for (int i = 0; harts && i < MAX_HARTS; i++)
+    {
+        if (harts[i])
+        {
+            destroyMachine(harts[i]);
+        }
+    }
+    free(harts);
+    free(nextPcs);
+    free(chunk);
+    fclose(file);
+    return valid;
+}
+
+#define BATCH_PASSED 0
+#define BATCH_FAILED 1
+#define BATCH_SKIPPED 2
+
+// The programs of a batch, run by the worker threads in any order but reported in the order of this list
+typedef struct
+{
+    char **names;
+    int count;
+    int next;         // Index of the next program a worker takes
+    int *results;     // BATCH_PASSED, BATCH_FAILED or BATCH_SKIPPED, -1 while the program has not finished
+    char **reports;   // What each finished program printed, until it is its turn to be printed
+    int printed;      // Number of programs whose report has been printed
+    Statistics stats; // Summed over the machines of all workers
+#ifdef THREADS_SUPPORTED
+    pthread_mutex_t lock;
+#endif
+} Batch;
+
+int runBatchProgram(Machine *m, const char *fileName)
+{
+    resetSimulator(m);
+    uint64_t executedBefore = m->stats.instructionsExecuted;
+    uint64_t cyclesBefore = m->stats.cycles;
+    if (!loadProgram(m, fileName))
+    {
+        fprintf(m->output, "FAIL %s: could not be loaded\n", fileName);
+        return BATCH_FAILED;
+    }
+    runProgram(m);
+
+    // The expected registers are in the file with the same name and the extension .res
+    char *expectedName = malloc(strlen(fileName) + 5);
+    if (!expectedName)
+    {
+        return BATCH_FAILED;
+    }
+    strcpy(expectedName, fileName);
+    char *extension = strrchr(expectedName, '.');
+    if (!extension || strpbrk(extension, "/\\"))
+    {
+        extension = expectedName + strlen(expectedName);
+    }
+    strcpy(extension, ".res");
+
+    uint8_t expected[NUM_REGISTERS * 4];
+    FILE *expectedFile = fopen(expectedName, "rb");
+    if (!expectedFile)
+    {
+        fprintf(m->output, "SKIP %s: %s not found\n", fileName, expectedName);
+        free(expectedName);
+        return BATCH_SKIPPED;
+    }
+    size_t expectedBytes = fread(expected, 1, sizeof(expected), expectedFile);
+    fclose(expectedFile);
+    if (expectedBytes != sizeof(expected))
+    {
+        fprintf(m->output, "FAIL %s: %s does not hold %d registers\n", fileName, expectedName, NUM_REGISTERS);
+        free(expectedName);
+        return BATCH_FAILED;
+    }
+    free(expectedName);
+
+    // Compare like 02155_check_output.sh, listing every register with a wrong value
+    uint32_t values[NUM_REGISTERS];
+    int wrong = 0;
+    for (int i = 0; i < NUM_REGISTERS; i++)
+    {
+        values[i] = expected[4 * i] | (expected[4 * i + 1] << 8) | (expected[4 * i + 2] << 16) | ((uint32_t)expected[4 * i + 3] << 24);
+        wrong += m->registers[i] != values[i];
+    }
+
+    if (wrong == 0 && m->programState != PROGRAM_FAULTED)
+    {
+        if (timingModel)
+        {
+            fprintf(m->output, "PASS %s (%llu instructions, %llu cycles)\n", fileName, (unsigned long long)(m->stats.instructionsExecuted - executedBefore), (unsigned long long)(m->stats.cycles - cyclesBefore));
+        }
+        else
+        {
+            fprintf(m->output, "PASS %s (%llu instructions)\n", fileName, (unsigned long long)(m->stats.instructionsExecuted - executedBefore));
+        }
+        return BATCH_PASSED;
+    }
+
+    fprintf(m->output, "FAIL %s%s\n", fileName, m->programState == PROGRAM_FAULTED ? ": the program stopped with an error" : "");
+    for (int i = 0; i < NUM_REGISTERS; i++)
+    {
+        if (m->registers[i] != values[i])
+        {
+            fprintf(m->output, "  Register x%02d: expected 0x%08X (%d), got 0x%08X (%d)\n", i, values[i], (int32_t)values[i], m->registers[i], (int32_t)m->registers[i]);
+        }
+    }
+    return BATCH_FAILED;
+}
+
+int addBatchProgram(Batch *batch, char *name)
+{
+    // Takes over the allocated name
+    char **grown = realloc(batch->names, (batch->count + 1) * sizeof(char *));
+    if (!grown)
+    {
+        printf("Error: Could not allocate the list of programs\n");
+        free(name);
+        return 0;
+    }
+    batch->names = grown;
+    batch->names[batch->count++] = name;
+    return 1;
+}
+
+#ifdef DIRECTORIES_SUPPORTED
+static int compareNames(const void *first, const void *second)
+{
+    return strcmp(*(char *const *)first, *(char *const *)second);
+}
+
+int addBatchDirectory(Batch *batch, DIR *directory, const char *directoryName)
+{
+    // Add the .bin and .elf programs in name order
+    int first = batch->count;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        const char *extension = strrchr(entry->d_name, '.');
+        if (!extension || (strcmp(extension, ".bin") != 0 && strcmp(extension, ".elf") != 0))
+        {
+            continue;
+        }
+        char *name = malloc(strlen(directoryName) + strlen(entry->d_name) + 2);
+        if (!name)
+        {
+            printf("Error: Could not list the directory '%s'\n", directoryName);
+            return 0;
+        }
+        sprintf(name, "%s/%s", directoryName, entry->d_name);
+        if (!addBatchProgram(batch, name))
+        {
+            return 0;
+        }
+    }
+
+    qsort(batch->names + first, batch->count - first, sizeof(char *), compareNames);
+    return 1;
+}
+#endif
+
+void *runBatchWorker(void *argument)
+{
+    // Every worker runs programs on its own machine until none are left
+    Batch *batch = argument;
+    Machine *m = createMachine();
+    if (!m)
+    {
+        exit(1);
+    }
+
+    while (1)
+    {
+        int index = ATOMIC_FETCH_ADD(&batch->next, 1);
+        if (index >= batch->count)
+        {
+            break;
+        }
+
+#ifdef THREADS_SUPPORTED
+        // The program's messages are collected and printed once the programs before it have been printed,
+        // so the output does not depend on the number of workers
+        char *report = NULL;
+        size_t reportSize = 0;
+        FILE *reportFile = open_memstream(&report, &reportSize);
+        m->output = reportFile ? reportFile : stdout;
+        int result = runBatchProgram(m, batch->names[index]);
+        if (reportFile)
+        {
+            fclose(reportFile);
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        batch->results[index] = result;
+        batch->reports[index] = report;
+        while (batch->printed < batch->count && batch->results[batch->printed] >= 0)
+        {
+            if (batch->reports[batch->printed])
+            {
+                fputs(batch->reports[batch->printed], stdout);
+                free(batch->reports[batch->printed]);
+            }
+            batch->printed++;
+        }
+        pthread_mutex_unlock(&batch->lock);
+#else
+        batch->results[index] = runBatchProgram(m, batch->names[index]);
+#endif
+    }
+
+#ifdef THREADS_SUPPORTED
+    pthread_mutex_lock(&batch->lock);
+#endif
+    addStatistics(&batch->stats, &m->stats);
+#ifdef THREADS_SUPPORTED
+    pthread_mutex_unlock(&batch->lock);
+#endif
+    destroyMachine(m);
+    return NULL;
+}
+
+int runBatch()
+{
+    // Run all programs in this process on --jobs threads, nothing is written to registers.hex
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    for (int i = 0; i < inputFileCount; i++)
+    {
+#ifdef DIRECTORIES_SUPPORTED
+        DIR *directory = opendir(inputFileNames[i]);
+        if (directory)
+        {
+            int listed = addBatchDirectory(&batch, directory, inputFileNames[i]);
+            closedir(directory);
+            if (!listed)
+            {
+                return 1;
+            }
+            continue;
+        }
+#endif
+        char *name = malloc(strlen(inputFileNames[i]) + 1);
+        if (!name)
+        {
+            printf("Error: Could not allocate the list of programs\n");
+            return 1;
+        }
+        strcpy(name, inputFileNames[i]);
+        if (!addBatchProgram(&batch, name))
+        {
+            return 1;
+        }
+    }
+
+    batch.results = malloc((batch.count + 1) * sizeof(int));
+    batch.reports = calloc(batch.count + 1, sizeof(char *));
+    if (!batch.results || !batch.reports)
+    {
+        printf("Error: Could not allocate the list of programs\n");
+        return 1;
+    }
+    for (int i = 0; i < batch.count; i++)
+    {
+        batch.results[i] = -1;
+    }
+
+    timespec_get(&startTime, TIME_UTC);
+#ifdef THREADS_SUPPORTED
+    // One worker per core by default, but never more workers than programs
+    int workers = jobs > 0 ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > batch.count)
+    {
+        workers = batch.count;
+    }
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    if (!threads)
+    {
+        printf("Error: Could not allocate the worker threads\n");
+        return 1;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    int started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, runBatchWorker, &batch) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        // Without any thread the programs still run, one after the other on this one
+        runBatchWorker(&batch);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&batch.lock);
+    free(threads);
+#else
+    runBatchWorker(&batch);
+#endif
+
+    int results[3] = {0, 0, 0};
+    for (int i = 0; i < batch.count; i++)
+    {
+        results[batch.results[i]]++;
+        free(batch.names[i]);
+    }
+    free(batch.names);
+    free(batch.results);
+    free(batch.reports);
+
+    printf("%d passed, %d failed, %d skipped\n", results[BATCH_PASSED], results[BATCH_FAILED], results[BATCH_SKIPPED]);
+    if (showStats)
+    {
+        printStats(&batch.stats);
+    }
+    if (timingModel)
+    {
+        printTiming(&batch.stats);
+    }
+    if (predictorCount > 0)
+    {
+        printPredictions(&batch.stats);
+    }
+    if (cacheModel)
     {
-        printf("Error: File size exceeds available memory\n");
-        fclose(file);
-        return;
+        printCaches(&batch.stats);
     }
-
-    // Read the file contents into memory
-    fread(&memory[0], sizeof(uint8_t), file_size, file);
+    return results[BATCH_FAILED] > 0 ? 1 : 0;
 }
 
 int main(int argc, char *argv[])
 {
-    initializeRegisters();
-
-    if (argc != 2)
+    if (!parseArguments(argc, argv))
     {
-        printf("Usage: RiscVSimulator <input_file>\n");
+        printUsage();
         return 1;
     }
 
-    char *inputFileName = argv[1];
-
-    // Check if the file exists
-    FILE *file = fopen(inputFileName, "rb");
-    if (!file)
+    if (decodeMode)
     {
-        printf("Error: File '%s' not found.\n", inputFileName);
-        return 1;
+        return decodeTrace(inputFileNames[0]) ? 0 : 1;
     }
-    else
+    if (batchMode)
     {
-        loadInstructions(file);
+        return runBatch();
     }
 
-    // Read binary instructions from the specified file
-    while (1)
+    Machine *harts[MAX_HARTS];
+    if (restoreFileName)
     {
-        // Save the current program counter
-        uint32_t currentPC = programCounter;
-
-        // Seek to the correct position in the file
-        fseek(file, currentPC, SEEK_SET);
-
-        uint32_t instruction;
-        if (fread(&instruction, sizeof(uint32_t), 1, file) != 1)
+        // The snapshot brings its own harts and memory configuration
+        hartCount = restoreSnapshot(harts);
+        if (hartCount == 0)
         {
-            // End of file or error, break out of the loop
-            break;
+            return 1;
         }
-
-        // Extract opcode and other fields, classify into instruction groups, and execute them
-        // Extract opcode (bits 0-6)
-        uint32_t opcode = instruction & 0x7F;
-
-        printf("Instruction: %08X, Opcode: %02X\n", instruction, opcode);
-
-        switch (opcode)
+        if (sampleLength && hartCount > 1)
         {
-        case 0x33: // R-type opcode
-            printf("R-type instruction\n");
-            processRType(instruction);
-            break;
-        case 0x13: // I-type opcode
-            printf("I-type instruction\n");
-            processIType(instruction);
-            break;
-        case 0x23: // S-type opcode
-            printf("S-type instruction\n");
-            processSType(instruction);
-            break;
-        case 0x37: // U-type opcode
-            printf("U-type instruction\n");
-            processUType(instruction);
-            break;
-        case 0x73: // E-call opcode
-            printf("E-call instruction\nThe program has ended.\n\n");
-            finishProgram();
-        case 0x17: // AUIPC opcode
-            printf("AUIPC instruction\n");
-            processUType(instruction);
-            break;
-        case 0x63: // B-type opcode
-            printf("B-type instruction\n");
-            processBType(instruction);
-            break;
-        case 0x6F: // JAL opcode
-            printf("JAL instruction\n");
-            processJALType(instruction);
-            break;
-        case 0x67: // JALR opcode
-            printf("JALR instruction\n");
-            processJALRType(instruction);
-            break;
-        case 0x03: // L-type opcode
-            printf("L-type instruction\n");
-            processLType(instruction);
-            break;
-        default:
-            printf("Error: Unrecognized opcode '%02X'.\n", opcode);
-            break;
+            printf("Error: --sample cannot be used with --harts.\n");
+            return 1;
         }
     }
+    else
+    {
+        for (int i = 0; i < hartCount; i++)
+        {
+            harts[i] = createMachine();
+            if (!harts[i])
+            {
+                return 1;
+            }
+        }
+        if (!loadProgram(harts[0], inputFileNames[0]))
+        {
+            return 1;
+        }
+        for (int i = 1; i < hartCount; i++)
+        {
+            if (!attachHart(harts[i], harts[0], i))
+            {
+                return 1;
+            }
+        }
+    }
+    if (traceFileName && !openTrace())
+    {
+        return 1;
+    }
 
-    fclose(file);
-
-    finishProgram();
+    timespec_get(&startTime, TIME_UTC);
+    int completed = runHarts(harts, hartCount);
+    finishProgram(harts, hartCount, completed ? 0 : 1);
 }
 
-void processRType(uint32_t instruction)
+void processRType(Machine *m, const DecodedInstruction *decoded)
 {
-    // Process R-type instruction, divide into fields
-    uint32_t rd = (instruction >> 7) & 0x1F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    uint32_t rs2 = (instruction >> 20) & 0x1F;
-    uint32_t funct7 = (instruction >> 25) & 0x7F;
+    // Register fields were extracted by the decoder
+    uint32_t rd = decoded->rd;
+    uint32_t rs1 = decoded->rs1;
+    uint32_t rs2 = decoded->rs2;
 
     // Print values before execution in hexadecimal
-    printf("Before R-type execution: x%d = 0x%X, x%d = 0x%X, x%d = 0x%X\n", rd, registers[rd].value, rs1, registers[rs1].value, rs2, registers[rs2].value);
+    TRACE(TRACE_FULL, "Before R-type execution: x%d = 0x%X, x%d = 0x%X, x%d = 0x%X\n", rd, m->registers[rd], rs1, m->registers[rs1], rs2, m->registers[rs2]);
 
-    switch (funct3)
+    switch (decoded->operation)
     {
-    case 0x0: // ADD/SUB
-        if (funct7 == 0x00)
-        {
-            // add (Addition)
-            printf("ADD\n");
-            writeRegister(rd, readRegister(rs1) + readRegister(rs2));
-        }
-        else if (funct7 == 0x20)
-        {
-            // sub (Subtraction)
-            printf("SUB\n");
-            writeRegister(rd, readRegister(rs1) - readRegister(rs2));
-        }
-        else
-        {
-            printf("Unrecognized R-type instruction input\n");
-        }
+    case OP_ADD: // add (Addition)
+        TRACE(TRACE_INSTRUCTIONS, "ADD\n");
+        writeRegister(m, rd, readRegister(m, rs1) + readRegister(m, rs2));
         break;
 
-    case 0x1: // SLL
-        printf("SLL\n");
-        writeRegister(rd, readRegister(rs1) << readRegister(rs2));
+    case OP_SUB: // sub (Subtraction)
+        TRACE(TRACE_INSTRUCTIONS, "SUB\n");
+        writeRegister(m, rd, readRegister(m, rs1) - readRegister(m, rs2));
         break;
 
-    case 0x2: // SLT
-        printf("SLT\n");
-        writeRegister(rd, ((int32_t)readRegister(rs1) < (int32_t)readRegister(rs2)) ? 1 : 0);
+    case OP_SLL:
+        TRACE(TRACE_INSTRUCTIONS, "SLL\n");
+        writeRegister(m, rd, readRegister(m, rs1) << (readRegister(m, rs2) & 0x1F));
         break;
 
-    case 0x3: // SLTU
-        printf("SLTU\n");
-        writeRegister(rd, (readRegister(rs1) < readRegister(rs2)) ? 1 : 0);
+    case OP_SLT:
+        TRACE(TRACE_INSTRUCTIONS, "SLT\n");
+        writeRegister(m, rd, ((int32_t)readRegister(m, rs1) < (int32_t)readRegister(m, rs2)) ? 1 : 0);
         break;
 
-    case 0x4: // XOR
-        printf("XOR\n");
-        writeRegister(rd, readRegister(rs1) ^ readRegister(rs2));
+    case OP_SLTU:
+        TRACE(TRACE_INSTRUCTIONS, "SLTU\n");
+        writeRegister(m, rd, (readRegister(m, rs1) < readRegister(m, rs2)) ? 1 : 0);
         break;
 
-    case 0x5: // SRL/SRA
-        if (funct7 == 0x00)
-        {
-            // srl (Shift Right Logical)
-            printf("SRL\n");
-            writeRegister(rd, readRegister(rs1) >> readRegister(rs2));
-        }
-        else if (funct7 == 0x20)
-        {
-            // sra (Shift Right Arithmetic)
-            printf("SRA\n");
-            writeRegister(rd, (int32_t)readRegister(rs1) >> readRegister(rs2));
-        }
-        else
-        {
-            printf("Unrecognized R-type instruction input\n");
-        }
+    case OP_XOR:
+        TRACE(TRACE_INSTRUCTIONS, "XOR\n");
+        writeRegister(m, rd, readRegister(m, rs1) ^ readRegister(m, rs2));
+        break;
+
+    case OP_SRL: // srl (Shift Right Logical)
+        TRACE(TRACE_INSTRUCTIONS, "SRL\n");
+        writeRegister(m, rd, readRegister(m, rs1) >> (readRegister(m, rs2) & 0x1F));
+        break;
+
+    case OP_SRA: // sra (Shift Right Arithmetic)
+        TRACE(TRACE_INSTRUCTIONS, "SRA\n");
+        writeRegister(m, rd, (int32_t)readRegister(m, rs1) >> (readRegister(m, rs2) & 0x1F));
         break;
 
-    case 0x6: // OR
-        printf("OR\n");
-        writeRegister(rd, readRegister(rs1) | readRegister(rs2));
+    case OP_OR:
+        TRACE(TRACE_INSTRUCTIONS, "OR\n");
+        writeRegister(m, rd, readRegister(m, rs1) | readRegister(m, rs2));
         break;
 
-    case 0x7: // AND
-        printf("AND\n");
-        writeRegister(rd, readRegister(rs1) & readRegister(rs2));
+    case OP_AND:
+        TRACE(TRACE_INSTRUCTIONS, "AND\n");
+        writeRegister(m, rd, readRegister(m, rs1) & readRegister(m, rs2));
+        break;
+
+    case OP_MUL: // mul (lower 32 bits of the product, the same signed and unsigned)
+        TRACE(TRACE_INSTRUCTIONS, "MUL\n");
+        writeRegister(m, rd, readRegister(m, rs1) * readRegister(m, rs2));
+        break;
+
+    case OP_MULH: // mulh (upper 32 bits, both signed)
+        TRACE(TRACE_INSTRUCTIONS, "MULH\n");
+        writeRegister(m, rd, multiplyHigh(readRegister(m, rs1), readRegister(m, rs2)));
+        break;
+
+    case OP_MULHSU: // mulhsu (upper 32 bits, rs1 signed and rs2 unsigned)
+        TRACE(TRACE_INSTRUCTIONS, "MULHSU\n");
+        writeRegister(m, rd, multiplyHighSignedUnsigned(readRegister(m, rs1), readRegister(m, rs2)));
+        break;
+
+    case OP_MULHU: // mulhu (upper 32 bits, both unsigned)
+        TRACE(TRACE_INSTRUCTIONS, "MULHU\n");
+        writeRegister(m, rd, multiplyHighUnsigned(readRegister(m, rs1), readRegister(m, rs2)));
+        break;
+
+    case OP_DIV:
+        TRACE(TRACE_INSTRUCTIONS, "DIV\n");
+        writeRegister(m, rd, divideSigned(readRegister(m, rs1), readRegister(m, rs2)));
+        break;
+
+    case OP_DIVU:
+        TRACE(TRACE_INSTRUCTIONS, "DIVU\n");
+        writeRegister(m, rd, divideUnsigned(readRegister(m, rs1), readRegister(m, rs2)));
+        break;
+
+    case OP_REM:
+        TRACE(TRACE_INSTRUCTIONS, "REM\n");
+        writeRegister(m, rd, remainderSigned(readRegister(m, rs1), readRegister(m, rs2)));
+        break;
+
+    case OP_REMU:
+        TRACE(TRACE_INSTRUCTIONS, "REMU\n");
+        writeRegister(m, rd, remainderUnsigned(readRegister(m, rs1), readRegister(m, rs2)));
         break;
 
     default:
-        printf("Unrecognized R-type instruction input\n");
+        fprintf(m->output, "Unrecognized R-type instruction input\n");
         break;
     }
 
     // Print values after execution in hexadecimal
-    printf("After R-type execution: x%d = 0x%X, x%d = 0x%X, x%d = 0x%X\n\n", rd, registers[rd].value, rs1, registers[rs1].value, rs2, registers[rs2].value);
+    TRACE(TRACE_FULL, "After R-type execution: x%d = 0x%X, x%d = 0x%X, x%d = 0x%X\n\n", rd, m->registers[rd], rs1, m->registers[rs1], rs2, m->registers[rs2]);
 
-    programCounter += 4;
+    m->programCounter += decoded->length;
 }
 
-void processIType(uint32_t instruction)
+void processIType(Machine *m, const DecodedInstruction *decoded)
 {
-    // Process I-type instruction, divide into fields
-    uint32_t rd = (instruction >> 7) & 0x1F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    int32_t imm = (int32_t)(((instruction >> 31) ? 0xFFFFF000 : 0) | ((instruction >> 20) & 0xFFF));
+    // Register fields and the sign-extended immediate were extracted by the decoder
+    uint32_t rd = decoded->rd;
+    uint32_t rs1 = decoded->rs1;
+    int32_t imm = decoded->imm;
 
-    printf("Before: x%d = 0x%x, x%d = 0x%x, imm = %d\n", rd, registers[rd].value, rs1, registers[rs1].value, imm);
+    TRACE(TRACE_FULL, "Before: x%d = 0x%x, x%d = 0x%x, imm = %d\n", rd, m->registers[rd], rs1, m->registers[rs1], imm);
 
-    // Add your I-type instruction processing logic here
-    switch (funct3)
+    switch (decoded->operation)
     {
-    case 0x0: // ADDI
-        printf("ADDI\n");
-        writeRegister(rd, readRegister(rs1) + imm);
+    case OP_ADDI:
+        TRACE(TRACE_INSTRUCTIONS, "ADDI\n");
+        writeRegister(m, rd, readRegister(m, rs1) + imm);
         break;
-    case 0x1: // SLLI
-        printf("SLLI\n");
-        writeRegister(rd, readRegister(rs1) << imm);
+    case OP_SLLI:
+        TRACE(TRACE_INSTRUCTIONS, "SLLI\n");
+        writeRegister(m, rd, readRegister(m, rs1) << imm);
         break;
-    case 0x2: // SLTI
-        printf("SLTI\n");
-        writeRegister(rd, ((int32_t)readRegister(rs1) < (int32_t)imm) ? 1 : 0);
+    case OP_SLTI:
+        TRACE(TRACE_INSTRUCTIONS, "SLTI\n");
+        writeRegister(m, rd, ((int32_t)readRegister(m, rs1) < (int32_t)imm) ? 1 : 0);
         break;
-    case 0x3: // SLTIU
-        printf("SLTIU\n");
-        writeRegister(rd, (readRegister(rs1) < imm) ? 1 : 0);
+    case OP_SLTIU:
+        TRACE(TRACE_INSTRUCTIONS, "SLTIU\n");
+        writeRegister(m, rd, (readRegister(m, rs1) < (uint32_t)imm) ? 1 : 0);
         break;
-    case 0x4: // XORI
-        printf("XORI\n");
-        writeRegister(rd, readRegister(rs1) ^ imm);
+    case OP_XORI:
+        TRACE(TRACE_INSTRUCTIONS, "XORI\n");
+        writeRegister(m, rd, readRegister(m, rs1) ^ imm);
         break;
-    case 0x5: // SRLI/SRAI
-        printf("SRLI/SRAI\n");
-        if ((instruction & 0x40000000) == 0)
-        {
-            // srli (Shift Right Logical Immediate)
-            writeRegister(rd, readRegister(rs1) >> imm);
-        }
-        else
-        {
-            // srai (Shift Right Arithmetic Immediate)
-            writeRegister(rd, (int32_t)readRegister(rs1) >> imm);
-        }
+    case OP_SRLI: // srli (Shift Right Logical Immediate)
+        TRACE(TRACE_INSTRUCTIONS, "SRLI/SRAI\n");
+        writeRegister(m, rd, readRegister(m, rs1) >> imm);
         break;
-    case 0x6: // ORI
-        printf("ORI\n");
-        writeRegister(rd, readRegister(rs1) | imm);
+    case OP_SRAI: // srai (Shift Right Arithmetic Immediate)
+        TRACE(TRACE_INSTRUCTIONS, "SRLI/SRAI\n");
+        writeRegister(m, rd, (int32_t)readRegister(m, rs1) >> imm);
         break;
-    case 0x7: // ANDI
-        printf("ANDI\n");
-        writeRegister(rd, readRegister(rs1) & imm);
+    case OP_ORI:
+        TRACE(TRACE_INSTRUCTIONS, "ORI\n");
+        writeRegister(m, rd, readRegister(m, rs1) | imm);
+        break;
+    case OP_ANDI:
+        TRACE(TRACE_INSTRUCTIONS, "ANDI\n");
+        writeRegister(m, rd, readRegister(m, rs1) & imm);
         break;
     default:
-        printf("Unrecognized inmediate instruction input\n");
+        fprintf(m->output, "Unrecognized inmediate instruction input\n");
         break;
     }
 
-    printf("After: x%d = 0x%x, x%d = 0x%x, imm = %d\n\n", rd, registers[rd].value, rs1, registers[rs1].value, imm);
+    TRACE(TRACE_FULL, "After: x%d = 0x%x, x%d = 0x%x, imm = %d\n\n", rd, m->registers[rd], rs1, m->registers[rs1], imm);
 
-    programCounter += 4;
+    m->programCounter += decoded->length;
 }
 
-void processSType(uint32_t instruction)
+void processSType(Machine *m, const DecodedInstruction *decoded)
 {
-    // Process S-type instruction, divide into fields
-    uint32_t imm1 = (instruction >> 7) & 0x1F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    uint32_t rs2 = (instruction >> 20) & 0x1F;
-    uint32_t imm2 = (instruction >> 25) & 0x7F;
-    uint32_t imm = (imm2 << 5) | imm1;
-    // Add your S-type instruction processing logic here
-    switch (funct3)
-    {
-    case 0x0: // SB
-        printf("SB\n");
-        memory[registers[rs1].value + imm] = registers[rs2].value & 0xFF;
-        printf("memory[%d] = %d\n", registers[rs1].value + imm, memory[registers[rs1].value + imm]);
-        break;
-    case 0x1: // SH
-        printf("SH\n");
-        memory[registers[rs1].value + imm] = registers[rs2].value & 0xFF;
-        memory[registers[rs1].value + imm + 1] = (registers[rs2].value >> 8) & 0xFF;
-        printf("memory[%d] = %d\n", registers[rs1].value + imm, memory[registers[rs1].value + imm]);
-        break;
-    case 0x2: // SW
-        printf("SW\n");
-        memory[registers[rs1].value + imm] = registers[rs2].value & 0xFF;
-        memory[registers[rs1].value + imm + 1] = (registers[rs2].value >> 8) & 0xFF;
-        memory[registers[rs1].value + imm + 2] = (registers[rs2].value >> 16) & 0xFF;
-        memory[registers[rs1].value + imm + 3] = (registers[rs2].value >> 24) & 0xFF;
-        printf("memory[%d] = %d\n", registers[rs1].value + imm, memory[registers[rs1].value + imm]);
+    // Register fields and the sign-extended offset were extracted by the decoder
+    uint32_t rs1 = decoded->rs1;
+    uint32_t rs2 = decoded->rs2;
+    uint32_t address = m->registers[rs1] + decoded->imm;
+
+    uint32_t width;
+
+    switch (decoded->operation)
+    {
+    case OP_SB:
+        TRACE(TRACE_INSTRUCTIONS, "SB\n");
+        width = 1;
         break;
-    default:
-        printf("Unrecognized S-type instruction input\n");
+    case OP_SH:
+        TRACE(TRACE_INSTRUCTIONS, "SH\n");
+        width = 2;
         break;
+    case OP_SW:
+        TRACE(TRACE_INSTRUCTIONS, "SW\n");
+        width = 4;
+        break;
+    default:
+        fprintf(m->output, "Unrecognized S-type instruction input\n");
+        m->programCounter += decoded->length;
+        return;
+    }
+
+    // A store that is neither in the flat memory nor in sparse memory stops the program before anything is written
+    if (!OUTSIDE_MEMORY(address, width))
+    {
+        storeFlat(m, address, width, m->registers[rs2]);
+    }
+    else if (!storeOutside(m, address, width, m->registers[rs2]))
+    {
+        raiseAccessFault(m, address, width, "store");
+        return;
+    }
+    TRACE(TRACE_FULL, "memory[%u] = %d\n", address, m->registers[rs2] & 0xFF);
+
+    // A store into the program image makes the cached decoding of that code stale
+    if (address < m->programSize)
+    {
+        invalidateDecodedInstructions(m, address, width);
     }
 
-    programCounter += 4;
+    m->programCounter += decoded->length;
 }
 
-void processLType(uint32_t instruction)
+void processLType(Machine *m, const DecodedInstruction *decoded)
 {
-    // Process L-type instruction, divide into fields
-    uint32_t rd = (instruction >> 7) & 0x1F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    int32_t imm = (int32_t)(((instruction >> 31) ? 0xFFFFF000 : 0) | ((instruction >> 20) & 0xFFF));
+    // Register fields and the sign-extended offset were extracted by the decoder
+    uint32_t rd = decoded->rd;
+    uint32_t rs1 = decoded->rs1;
+    int32_t imm = decoded->imm;
+    uint32_t address = m->registers[rs1] + imm;
+
+    TRACE(TRACE_FULL, "Before L-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rd, m->registers[rd], rs1, m->registers[rs1], imm);
 
-    printf("Before L-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rd, registers[rd].value, rs1, registers[rs1].value, imm);
+    uint32_t width;
 
-    switch (funct3)
+    switch (decoded->operation)
     {
-    case 0x0: // LB
-        printf("LB\n");
-        writeRegister(rd, (int8_t)memory[registers[rs1].value + imm]);
+    case OP_LB:
+        TRACE(TRACE_INSTRUCTIONS, "LB\n");
+        width = 1;
         break;
-    case 0x1: // LH
-        printf("LH\n");
-        writeRegister(rd, (int16_t)(memory[registers[rs1].value + imm] | (memory[registers[rs1].value + imm + 1] << 8)));
+    case OP_LH:
+        TRACE(TRACE_INSTRUCTIONS, "LH\n");
+        width = 2;
         break;
-    case 0x2: // LW
-        printf("LW\n");
-        writeRegister(rd, (int32_t)(memory[registers[rs1].value + imm] | (memory[registers[rs1].value + imm + 1] << 8) | (memory[registers[rs1].value + imm + 2] << 16) | (memory[registers[rs1].value + imm + 3] << 24)));
+    case OP_LW:
+        TRACE(TRACE_INSTRUCTIONS, "LW\n");
+        width = 4;
         break;
-    case 0x4: // LBU
-        printf("LBU\n");
-        writeRegister(rd, memory[registers[rs1].value + imm]);
+    case OP_LBU:
+        TRACE(TRACE_INSTRUCTIONS, "LBU\n");
+        width = 1;
         break;
-    case 0x5: // LHU
-        printf("LHU\n");
-        writeRegister(rd, memory[registers[rs1].value + imm] | (memory[registers[rs1].value + imm + 1] << 8));
+    case OP_LHU:
+        TRACE(TRACE_INSTRUCTIONS, "LHU\n");
+        width = 2;
         break;
     default:
-        printf("Unrecognized L-type instruction input\n");
-        break;
+        fprintf(m->output, "Unrecognized L-type instruction input\n");
+        m->programCounter += decoded->length;
+        return;
     }
 
-    printf("After L-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n\n", rd, registers[rd].value, rs1, registers[rs1].value, imm);
-
-    programCounter += 4;
-}
-
-void processUType(uint32_t instruction)
-{
-    switch (instruction & 0x7F)
+    // A load that is neither in the flat memory nor in sparse memory stops the program
+    uint32_t value;
+    if (!OUTSIDE_MEMORY(address, width))
     {
-    case 0x17: // AUIPC
+        value = loadFlat(m, address, width);
+    }
+    else if (!loadOutside(m, address, width, &value))
     {
-        // Process U-type instruction, divide into fields
-        uint32_t rd = (instruction >> 7) & 0x1F;
-        uint32_t imm = (instruction >> 12) & 0xFFFFF;
-
-        // U-type instruction to implement is AUIPC
-        printf("AUIPC\n");
-        writeRegister(rd, programCounter + (imm << 12));
-        printf("x%d = 0x%x\n\n", rd, registers[rd].value);
+        raiseAccessFault(m, address, width, "load");
+        return;
+    }
 
-        programCounter += 4;
-        break;
+    // LB and LH sign-extend the loaded value, the other loads zero-extend it
+    if (decoded->operation == OP_LB)
+    {
+        value = (int8_t)value;
     }
-    case 0x37: // LUI
+    else if (decoded->operation == OP_LH)
     {
-        // Process U-type instruction, divide into fields
-        uint32_t rd = (instruction >> 7) & 0x1F;
-        uint32_t imm = (instruction >> 12) & 0xFFFFF;
+        value = (int16_t)value;
+    }
+    writeRegister(m, rd, value);
 
-        // U-type instruction to implement is LUI
-        printf("LUI\n");
-        writeRegister(rd, imm << 12);
-        printf("x%d = 0x%x\n\n", rd, registers[rd].value);
+    TRACE(TRACE_FULL, "After L-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n\n", rd, m->registers[rd], rs1, m->registers[rs1], imm);
 
-        programCounter += 4;
+    m->programCounter += decoded->length;
+}
+
+void processUType(Machine *m, const DecodedInstruction *decoded)
+{
+    // The decoder already shifted the immediate into the upper 20 bits
+    uint32_t rd = decoded->rd;
+    uint32_t imm = decoded->imm;
+
+    switch (decoded->operation)
+    {
+    case OP_AUIPC:
+        TRACE(TRACE_INSTRUCTIONS, "AUIPC\n");
+        writeRegister(m, rd, m->programCounter + imm);
+        TRACE(TRACE_FULL, "x%d = 0x%x\n\n", rd, m->registers[rd]);
+        break;
+    case OP_LUI:
+        TRACE(TRACE_INSTRUCTIONS, "LUI\n");
+        writeRegister(m, rd, imm);
+        TRACE(TRACE_FULL, "x%d = 0x%x\n\n", rd, m->registers[rd]);
         break;
-    }
     default:
-        printf("Unrecognized U-type instruction input\n");
-        programCounter += 4;
+        fprintf(m->output, "Unrecognized U-type instruction input\n");
         break;
     }
+
+    m->programCounter += decoded->length;
 }
 
-void processBType(uint32_t instruction)
+void processBType(Machine *m, const DecodedInstruction *decoded)
 {
-    // Process B-type instruction, divide into fields
-    uint32_t imm1 = (instruction >> 7) & 0x1F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    uint32_t rs2 = (instruction >> 20) & 0x1F;
-    uint32_t imm2 = (instruction >> 25) & 0x7F;
+    // Register fields and the sign-extended branch offset were extracted by the decoder
+    uint32_t rs1 = decoded->rs1;
+    uint32_t rs2 = decoded->rs2;
+    int32_t imm = decoded->imm;
+
+    TRACE(TRACE_FULL, "Before B-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rs1, m->registers[rs1], rs2, m->registers[rs2], imm);
+    TRACE(TRACE_FULL, "Program counter value: %d\n", m->programCounter);
 
-    int32_t imm = (imm2 << 5) | imm1;
-    if (imm2 & 0x40)
+    int taken = 0;
+    switch (decoded->operation)
     {
-        // Set upper bits to 1 for negative values
-        imm |= 0xFFFFFFC0;
+    case OP_BEQ:
+        TRACE(TRACE_INSTRUCTIONS, "BEQ\n");
+        taken = m->registers[rs1] == m->registers[rs2];
+        break;
+    case OP_BNE:
+        TRACE(TRACE_INSTRUCTIONS, "BNE\n");
+        taken = m->registers[rs1] != m->registers[rs2];
+        break;
+    case OP_BLT:
+        TRACE(TRACE_INSTRUCTIONS, "BLT\n");
+        taken = (int32_t)m->registers[rs1] < (int32_t)m->registers[rs2];
+        break;
+    case OP_BGE:
+        TRACE(TRACE_INSTRUCTIONS, "BGE\n");
+        taken = (int32_t)m->registers[rs1] >= (int32_t)m->registers[rs2];
+        break;
+    case OP_BLTU:
+        TRACE(TRACE_INSTRUCTIONS, "BLTU\n");
+        taken = m->registers[rs1] < m->registers[rs2];
+        break;
+    case OP_BGEU:
+        TRACE(TRACE_INSTRUCTIONS, "BGEU\n");
+        taken = m->registers[rs1] >= m->registers[rs2];
+        break;
+    default:
+        fprintf(m->output, "Unrecognized B-type instruction input\n");
+        break;
+    }
 
-        // I dont know why, but the imm value is always 1 more than it should be
-        imm = imm - 1;
+    if (taken)
+    {
+        m->programCounter += imm;
+        TRACE(TRACE_FULL, "Branch taken\n");
     }
+    else
+    {
+        m->programCounter += decoded->length;
+    }
+
+    TRACE(TRACE_FULL, "After B-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rs1, m->registers[rs1], rs2, m->registers[rs2], imm);
+    TRACE(TRACE_FULL, "Program counter value: %d\n\n", m->programCounter);
+}
+
+void processJALType(Machine *m, const DecodedInstruction *decoded)
+{
+    // The decoder already reassembled and sign-extended the jump offset
+    uint32_t rd = decoded->rd;
+
+    TRACE(TRACE_FULL, "Before JAL execution: x%d = 0x%X\n", rd, m->registers[rd]);
+
+    // Execute the JAL instruction
+    writeRegister(m, rd, m->programCounter + decoded->length);
+    m->programCounter += decoded->imm;
+
+    TRACE(TRACE_FULL, "After JAL execution: x%d = 0x%X\n\n", rd, m->registers[rd]);
+}
+
+void processJALRType(Machine *m, const DecodedInstruction *decoded)
+{
+    // Register fields and the sign-extended immediate were extracted by the decoder
+    uint32_t rd = decoded->rd;
+    uint32_t rs1 = decoded->rs1;
+    int32_t imm = decoded->imm;
+
+    TRACE(TRACE_FULL, "Before JALR execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rd, m->registers[rd], rs1, m->registers[rs1], imm);
+
+    // Execute the JALR instruction
+    uint32_t jumpAddress = (m->registers[rs1] + imm) & 0xFFFFFFFE; // Ensure alignment
+    writeRegister(m, rd, m->programCounter + decoded->length);
+    m->programCounter = jumpAddress;
+
+    TRACE(TRACE_FULL, "After JALR execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n\n", rd, m->registers[rd], rs1, m->registers[rs1], imm);
+}
+
+void processAType(Machine *m, const DecodedInstruction *decoded)
+{
+    // Register fields were extracted by the decoder, the address is rs1 without an offset
+    uint32_t rd = decoded->rd;
+    uint32_t rs1 = decoded->rs1;
+    uint32_t rs2 = decoded->rs2;
+    uint32_t address = m->registers[rs1];
 
-    printf("Before B-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rs1, registers[rs1].value, rs2, registers[rs2].value, (int32_t)imm);
-    printf("Program counter value: %d\n", programCounter);
+    TRACE(TRACE_FULL, "Before A-type execution: x%d = 0x%X, x%d = 0x%X, x%d = 0x%X\n", rd, m->registers[rd], rs1, m->registers[rs1], rs2, m->registers[rs2]);
 
-    switch (funct3)
+    if (decoded->operation == OP_UNKNOWN)
     {
+        fprintf(m->output, "Unrecognized A-type instruction input\n");
+        m->programCounter += decoded->length;
+        return;
+    }
 
-    case 0x0: // BEQ
-        printf("BEQ\n");
-        if (registers[rs1].value == registers[rs2].value)
-        {
-            programCounter += imm;
-            printf("Branch taken\n");
-        }
-        else
-        {
-            programCounter += 4;
-        }
+    // Atomics have to be aligned, and are done on the host word, so they cannot be split between memories
+    if (address & 0x3)
+    {
+        fprintf(m->output, "Error: Misaligned atomic at PC 0x%08X, address 0x%08X is not a multiple of 4.\n", m->programCounter, address);
+        m->programState = PROGRAM_FAULTED;
+        return;
+    }
+    uint32_t *word = atomicWord(m, address);
+    if (!word)
+    {
+        raiseAccessFault(m, address, 4, decoded->operation == OP_LR_W ? "load" : "atomic store");
+        return;
+    }
+
+    switch (decoded->operation)
+    {
+    case OP_LR_W:
+        TRACE(TRACE_INSTRUCTIONS, "LR.W\n");
+        m->reservationValid = 1;
+        m->reservationAddress = address;
+        m->reservationValue = LITTLE_ENDIAN_32(ATOMIC_LOAD(word));
+        writeRegister(m, rd, m->reservationValue);
         break;
-    case 0x1: // BNE
-        printf("BNE\n");
-        if (registers[rs1].value != registers[rs2].value)
-        {
-            programCounter += imm;
-            printf("Branch taken\n");
-        }
-        else
+    case OP_SC_W:
+    {
+        // rd is 0 if the store happened and 1 if it failed, either way the reservation is gone
+        TRACE(TRACE_INSTRUCTIONS, "SC.W\n");
+        int stored = m->reservationValid && m->reservationAddress == address &&
+                     storeConditional(word, m->reservationValue, m->registers[rs2]);
+        m->reservationValid = 0;
+        writeRegister(m, rd, stored ? 0 : 1);
+        if (!stored)
         {
-            programCounter += 4;
+            m->programCounter += decoded->length;
+            return;
         }
         break;
-    case 0x4: // BLT
-        printf("BLT\n");
-        if ((int32_t)registers[rs1].value < (int32_t)registers[rs2].value)
-        {
-            programCounter += imm;
-            printf("Branch taken\n");
-        }
-        else
-        {
-            programCounter += 4;
-        }
+    }
+    default:
+        TRACE(TRACE_INSTRUCTIONS, "AMO\n");
+        writeRegister(m, rd, atomicMemoryOperation(word, decoded->operation, m->registers[rs2]));
         break;
-    case 0x5: // BGE
-        printf("BGE\n");
-        if ((int32_t)registers[rs1].value >= (int32_t)registers[rs2].value)
+    }
+
+    // Like any other store, one into the program image makes the cached decoding of that code stale
+    if (decoded->operation != OP_LR_W && address < m->programSize)
+    {
+        invalidateDecodedInstructions(m, address, 4);
+    }
+
+    TRACE(TRACE_FULL, "After A-type execution: x%d = 0x%X, x%d = 0x%X, x%d = 0x%X\n\n", rd, m->registers[rd], rs1, m->registers[rs1], rs2, m->registers[rs2]);
+
+    m->programCounter += decoded->length;
+}
+
+void processFType(Machine *m, const DecodedInstruction *decoded)
+{
+    // Register fields, the offset of loads and stores and the rounding mode were extracted by the decoder
+#ifndef NO_TRACE
+    static const char *const names[OPERATION_COUNT] = {
+#define X(operation, name) [operation] = name,
+        FLOAT_OPERATIONS(X)
+#undef X
+    };
+#endif
+    uint32_t rs1 = decoded->rs1;
+
+    TRACE(TRACE_FULL, "Before F-type execution: f%d = 0x%08X, f%d = 0x%08X, f%d = 0x%08X, x%d = 0x%08X\n", decoded->rd, m->floatRegisters[decoded->rd], rs1, m->floatRegisters[rs1], decoded->rs2, m->floatRegisters[decoded->rs2], rs1, m->registers[rs1]);
+
+    if (decoded->operation == OP_UNKNOWN)
+    {
+        fprintf(m->output, "Unrecognized F-type instruction input\n");
+        m->programCounter += decoded->length;
+        return;
+    }
+    TRACE(TRACE_INSTRUCTIONS, "%s\n", names[decoded->operation]);
+
+    // Nothing was changed if the instruction faulted
+    if (!executeFloat(m, decoded))
+    {
+        if (decoded->operation == OP_FLW || decoded->operation == OP_FSW)
         {
-            programCounter += imm;
-            printf("Branch taken\n");
+            raiseAccessFault(m, m->registers[rs1] + decoded->imm, 4, decoded->operation == OP_FLW ? "load" : "store");
         }
         else
         {
-            programCounter += 4;
+            fprintf(m->output, "Error: Invalid rounding mode at PC 0x%08X, the instruction selects %u and frm is %u.\n", m->programCounter, decoded->imm & 0x7, m->frm);
+            m->programState = PROGRAM_FAULTED;
         }
+        return;
+    }
+
+    TRACE(TRACE_FULL, "After F-type execution: f%d = 0x%08X, x%d = 0x%08X, fflags = 0x%02X\n\n", decoded->rd, m->floatRegisters[decoded->rd], decoded->rd, m->registers[decoded->rd], m->fflags);
+
+    m->programCounter += decoded->length;
+}
+
+void processCSRType(Machine *m, const DecodedInstruction *decoded)
+{
+    // imm is the CSR number, the immediate forms use rs1 as the value. Only the CSRs of the F extension exist.
+    uint32_t rd = decoded->rd;
+    uint32_t csr = decoded->imm;
+    uint32_t value;
+
+    switch (csr)
+    {
+    case CSR_FFLAGS:
+        value = m->fflags;
         break;
-    case 0x6: // BLTU
-        printf("BLTU\n");
-        if (registers[rs1].value < registers[rs2].value)
-        {
-            programCounter += imm;
-            printf("Branch taken\n");
-        }
-        else
-        {
-            programCounter += 4;
-        }
+    case CSR_FRM:
+        value = m->frm;
         break;
-    case 0x7: // BGEU
-        printf("BGEU\n");
-        if (registers[rs1].value >= registers[rs2].value)
-        {
-            programCounter += imm;
-            printf("Branch taken\n");
-        }
-        else
-        {
-            programCounter += 4;
-        }
+    case CSR_FCSR:
+        value = (m->frm << 5) | m->fflags;
         break;
+    default:
+        fprintf(m->output, "Error: Unsupported CSR 0x%03X at PC 0x%08X.\n", csr, m->programCounter);
+        m->programState = PROGRAM_FAULTED;
+        return;
     }
-    printf("After B-type execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rs1, registers[rs1].value, rs2, registers[rs2].value, imm);
-    printf("Program counter value: %d\n\n", programCounter);
-}
 
-void processJALType(uint32_t instruction)
-{
-    // Process JAL instruction, divide into fields
-    uint32_t rd = (instruction >> 7) & 0x1F;
-    int32_t imm20 = (instruction >> 31) & 0x1;
-    int32_t imm10to1 = (instruction >> 21) & 0x3FF;
-    int32_t imm11 = (instruction >> 20) & 0x1;
-    int32_t imm19to12 = (instruction >> 12) & 0xFF;
+    TRACE(TRACE_FULL, "Before CSR execution: x%d = 0x%X, csr 0x%03X = 0x%X\n", rd, m->registers[rd], csr, value);
 
-    int32_t imm = (imm20 << 20) | (imm19to12 << 12) | (imm11 << 11) | (imm10to1 << 1);
+    uint32_t operand = decoded->rs1;
+    if (decoded->operation == OP_CSRRW || decoded->operation == OP_CSRRS || decoded->operation == OP_CSRRC)
+    {
+        operand = m->registers[decoded->rs1];
+    }
 
-    printf("Before JAL execution: x%d = 0x%X\n", rd, registers[rd].value);
+    // CSRRS and CSRRC with x0 or an immediate of 0 only read the CSR
+    uint32_t written = value;
+    switch (decoded->operation)
+    {
+    case OP_CSRRW:
+    case OP_CSRRWI:
+        TRACE(TRACE_INSTRUCTIONS, "CSRRW\n");
+        written = operand;
+        break;
+    case OP_CSRRS:
+    case OP_CSRRSI:
+        TRACE(TRACE_INSTRUCTIONS, "CSRRS\n");
+        written = value | operand;
+        break;
+    case OP_CSRRC:
+    case OP_CSRRCI:
+        TRACE(TRACE_INSTRUCTIONS, "CSRRC\n");
+        written = value & ~operand;
+        break;
+    default:
+        fprintf(m->output, "Unrecognized CSR instruction input\n");
+        m->programCounter += decoded->length;
+        return;
+    }
 
-    // Execute the JAL instruction
-    writeRegister(rd, programCounter + 4);
-    programCounter += imm;
+    if (csr == CSR_FFLAGS || csr == CSR_FCSR)
+    {
+        m->fflags = written & 0x1F;
+    }
+    if (csr == CSR_FRM)
+    {
+        m->frm = written & 0x7;
+    }
+    else if (csr == CSR_FCSR)
+    {
+        m->frm = (written >> 5) & 0x7;
+    }
+    writeRegister(m, rd, value);
+
+    TRACE(TRACE_FULL, "After CSR execution: x%d = 0x%X, fcsr = 0x%02X\n\n", rd, m->registers[rd], (m->frm << 5) | m->fflags);
 
-    printf("After JAL execution: x%d = 0x%X\n\n", rd, registers[rd].value);
+    m->programCounter += decoded->length;
 }
 
-void processJALRType(uint32_t instruction)
+void processFenceType(Machine *m, const DecodedInstruction *decoded)
 {
-    // Process JALR instruction, divide into fields
-    uint32_t rd = (instruction >> 7) & 0x1F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    int32_t imm = (int32_t)(((instruction >> 31) ? 0xFFFFF000 : 0) | ((instruction >> 20) & 0xFFF));
-
-    printf("Before JALR execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n", rd, registers[rd].value, rs1, registers[rs1].value, imm);
+    if (decoded->operation == OP_UNKNOWN)
+    {
+        fprintf(m->output, "Unrecognized FENCE instruction input\n");
+        m->programCounter += decoded->length;
+        return;
+    }
 
-    // Execute the JALR instruction
-    uint32_t jumpAddress = (registers[rs1].value + imm) & 0xFFFFFFFE; // Ensure alignment
-    writeRegister(rd, programCounter + 4);
-    programCounter = jumpAddress;
+    // With --jobs the other harts run on other host threads, so a FENCE orders the memory accesses of the host
+    // the same way. A FENCE.I has nothing to do, a store into the code already dropped its cached decoding.
+    if (decoded->operation == OP_FENCE)
+    {
+        TRACE(TRACE_INSTRUCTIONS, "FENCE\n");
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        TRACE(TRACE_INSTRUCTIONS, "FENCE.I\n");
+    }
 
-    printf("After JALR execution: x%d = 0x%X, x%d = 0x%X, imm = %d\n\n", rd, registers[rd].value, rs1, registers[rs1].value, imm);
-}
\ No newline at end of file
+    m->programCounter += decoded->length;
+}
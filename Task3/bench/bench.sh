@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Measure simulator throughput (instructions per second) with tracing on and off, and for each engine.
+# Usage: bench.sh [simulator] [program]
+
+SIMULATOR=${1:-../RiscVSimulator}
+PROGRAM=${2:-loop500k.bin}
+
+# Check if the simulator and the program exist
+if [ ! -x "$SIMULATOR" ] || [ ! -f "$PROGRAM" ]; then
+    echo "Usage: $0 [simulator] [program]"
+    exit 1
+fi
+
+for level in 2 1 0; do
+    echo "--trace=$level:"
+    # The trace goes to stdout and is discarded, the statistics are printed on stderr
+    "$SIMULATOR" --trace=$level --stats "$PROGRAM" 2>&1 >/dev/null | sed 's/^/    /'
+done
+
+echo "--trace-file:"
+"$SIMULATOR" --trace-file=bench.trace --stats "$PROGRAM" 2>&1 >/dev/null | sed 's/^/    /'
+rm -f bench.trace
+
+for engine in interpreter threaded block jit; do
+    echo "--engine=$engine:"
+    "$SIMULATOR" --quiet --engine=$engine --stats "$PROGRAM" 2>&1 >/dev/null | sed 's/^/    /'
+done
+
+# Scaling with the number of harts, every hart runs the whole program on its own host thread
+for harts in 1 2 4 8; do
+    echo "--harts=$harts --jobs=$harts:"
+    "$SIMULATOR" --quiet --engine=jit --harts=$harts --jobs=$harts --stats "$PROGRAM" 2>&1 >/dev/null | sed 's/^/    /'
+done